@@ -0,0 +1,168 @@
+#include "fixed_rotators.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// State magnitude above which the block floating shift is lowered. Keeps
+// every operand of mul_q15 below 2^30.
+#define STATE_LIMIT (1 << 29)
+// The shift is raised while the state is below this.
+#define STATE_QUIET (1 << 27)
+#define MAX_SHIFT 16
+// Samples between the checks for raising the shift.
+#define RENORMALIZE_INTERVAL 64
+
+#define SINE_BITS 10
+#define SINE_SIZE (1 << SINE_BITS)
+
+// sin(2 * pi * i / SINE_SIZE) in Q15, with one extra entry for interpolation.
+static int16_t sine_table[SINE_SIZE + 1];
+static int sine_table_ready = 0;
+
+// Integer Taylor series in Q30, so that the table does not depend on the
+// float library of the platform.
+static int32_t sine_q15(int64_t x_q30) {
+  const int64_t x2 = (x_q30 * x_q30) >> 30;
+  int64_t term = x_q30;
+  int64_t sum = x_q30;
+  for (int k = 1; k <= 8; ++k) {
+    term = -((term * x2) >> 30) / ((2 * k) * (2 * k + 1));
+    sum += term;
+  }
+  int64_t v = (sum + (1 << 14)) >> 15;
+  return v > 32767 ? 32767 : v;
+}
+
+static void init_sine_table(void) {
+  // 2 * pi in Q30.
+  const int64_t kTwoPiQ30 = 6746518852LL;
+  const int quarter = SINE_SIZE / 4;
+  for (int i = 0; i <= quarter; ++i) {
+    const int32_t v = sine_q15((kTwoPiQ30 * i + SINE_SIZE / 2) / SINE_SIZE);
+    sine_table[i] = v;
+    sine_table[2 * quarter - i] = v;
+    sine_table[2 * quarter + i] = -v;
+    sine_table[4 * quarter - i] = -v;
+  }
+  sine_table_ready = 1;
+}
+
+// Linearly interpolated sine of phase / 2^32 turns, in Q15.
+static inline int32_t sine(uint32_t phase) {
+  const uint32_t ix = phase >> (32 - SINE_BITS);
+  const int32_t frac = (phase >> (17 - SINE_BITS)) & 0x7fff;
+  const int32_t a = sine_table[ix];
+  const int32_t b = sine_table[ix + 1];
+  return a + (((b - a) * frac + (1 << 14)) >> 15);
+}
+
+// Rounded a * c / 2^15 for |a| < 2^30, |c| <= 2^15, with 32-bit multiplies.
+static inline int32_t mul_q15(int32_t a, int32_t c) {
+  return (a >> 15) * c + (((a & 0x7fff) * c + (1 << 14)) >> 15);
+}
+
+static inline int32_t round_shift(int32_t v, int shift) {
+  return shift == 0 ? v : (v + (1 << (shift - 1))) >> shift;
+}
+
+static inline int32_t abs32(int32_t v) { return v < 0 ? -v : v; }
+
+static inline int32_t clamp24(int64_t v) {
+  const int32_t kMax = (1 << 23) - 1;
+  return v > kMax ? kMax : v < -kMax ? -kMax : (int32_t)v;
+}
+
+void fixed_rotators_init(FixedRotators *r, const FixedRotatorParams *params,
+                         int num_channels) {
+  if (!sine_table_ready) init_sine_table();
+  memset(r, 0, sizeof(*r));
+  r->num_channels = num_channels;
+  memcpy(r->params, params, sizeof(r->params));
+}
+
+// Halves the state of rotator i on channel c and lowers its shift.
+static void lower_shift(FixedRotators *r, int c, int i) {
+  for (int k = 0; k < 6; ++k) {
+    r->accu[c][k][i] = round_shift(r->accu[c][k][i], 1);
+  }
+  --r->shift[c][i];
+}
+
+static void raise_shifts(FixedRotators *r) {
+  for (int c = 0; c < r->num_channels; ++c) {
+    for (int i = 0; i < FIXED_ROTATORS_NUM; ++i) {
+      int32_t peak = 0;
+      for (int k = 0; k < 6; ++k) {
+        const int32_t v = abs32(r->accu[c][k][i]);
+        if (v > peak) peak = v;
+      }
+      while (r->shift[c][i] < MAX_SHIFT && peak < STATE_QUIET) {
+        for (int k = 0; k < 6; ++k) r->accu[c][k][i] *= 2;
+        peak *= 2;
+        ++r->shift[c][i];
+      }
+    }
+  }
+}
+
+void fixed_rotators_process(FixedRotators *r, const int32_t *in, int32_t *out,
+                            int num_frames) {
+  const int num_channels = r->num_channels;
+  for (int n = 0; n < num_frames; ++n) {
+    const uint32_t pos = r->pos;
+    int32_t *frame =
+        &r->history[num_channels * (pos & FIXED_ROTATORS_HISTORY_MASK)];
+    for (int c = 0; c < num_channels; ++c) {
+      frame[c] = in[n * num_channels + c];
+    }
+    int64_t sum[FIXED_ROTATORS_MAX_CHANNELS] = {0};
+    for (int i = 0; i < FIXED_ROTATORS_NUM; ++i) {
+      const FixedRotatorParams *p = &r->params[i];
+      // e^(-i * phase) as used for the input, then advanced for the output.
+      const int32_t in_re = sine(r->phase[i] + (1u << 30));
+      const int32_t in_im = -sine(r->phase[i]);
+      r->phase[i] += p->phase_step;
+      const int32_t out_re = sine(r->phase[i] + (1u << 30));
+      const int32_t out_im = -sine(r->phase[i]);
+      const int32_t *delayed =
+          &r->history[num_channels *
+                      ((pos - p->advance) & FIXED_ROTATORS_HISTORY_MASK)];
+      for (int c = 0; c < num_channels; ++c) {
+        // Q27, bounded by 2^27.
+        const int32_t x = delayed[c] * 16;
+        while (r->shift[c][i] > 0 &&
+               abs32(x) > (STATE_LIMIT >> r->shift[c][i])) {
+          lower_shift(r, c, i);
+        }
+        const int shift = r->shift[c][i];
+        int32_t *a0 = &r->accu[c][0][i];
+        int32_t *a1 = &r->accu[c][1][i];
+        int32_t *a2 = &r->accu[c][2][i];
+        int32_t *a3 = &r->accu[c][3][i];
+        int32_t *a4 = &r->accu[c][4][i];
+        int32_t *a5 = &r->accu[c][5][i];
+        // b = w * (b + (1 - w) * u) for the first stage, and
+        // b = w * b + (1 - w) * previous stage for the other two.
+#define LEAK(v) round_shift(mul_q15((v), p->leak), p->leak_shift)
+        int32_t re = *a0 + LEAK(mul_q15(x, in_re) * (1 << shift));
+        int32_t im = *a1 + LEAK(mul_q15(x, in_im) * (1 << shift));
+        *a0 = re - LEAK(re);
+        *a1 = im - LEAK(im);
+        *a2 += LEAK(*a0 - *a2);
+        *a3 += LEAK(*a1 - *a3);
+        *a4 += LEAK(*a2 - *a4);
+        *a5 += LEAK(*a3 - *a5);
+#undef LEAK
+        const int32_t v =
+            round_shift(mul_q15(*a4, out_re) + mul_q15(*a5, out_im), shift);
+        sum[c] += mul_q15(v, p->gain) * (1 << p->gain_shift);
+      }
+    }
+    for (int c = 0; c < num_channels; ++c) {
+      // Q27 to Q23.
+      out[n * num_channels + c] = clamp24((sum[c] + 8) >> 4);
+    }
+    ++r->pos;
+    if ((r->pos % RENORMALIZE_INTERVAL) == 0) raise_shifts(r);
+  }
+}
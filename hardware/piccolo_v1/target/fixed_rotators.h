@@ -0,0 +1,72 @@
+// Fixed-point version of the identity rotator bank of
+// speaker_experiments/fourier_bank.h, for cores without an FPU.
+//
+// Only 32-bit integer multiplies are used, so the same code runs on the
+// Cortex-M0+ and on the host, where it is the bit-exact reference.
+//
+// Differences to the float Rotators:
+//  - the rotation is a 32-bit phase accumulator and a 1024-entry Q15 sine
+//    table instead of a renormalized complex multiply;
+//  - the leaking integrators are normalized, b = w * b + (1 - w) * x, so
+//    that their state never exceeds the input, and the filter gain is applied
+//    on output;
+//  - the state of every rotator and channel is block floating: it is kept
+//    scaled up by 2^shift, with the shift lowered before a louder input could
+//    overflow it and raised again while the state is quiet.
+#ifndef PICCOLO_FIXED_ROTATORS_H
+#define PICCOLO_FIXED_ROTATORS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FIXED_ROTATORS_NUM 128
+#define FIXED_ROTATORS_MAX_CHANNELS 2
+// Input frames kept for the per-rotator advance; must exceed the largest
+// advance (5506 at 48 kHz).
+#define FIXED_ROTATORS_HISTORY 8192
+#define FIXED_ROTATORS_HISTORY_MASK (FIXED_ROTATORS_HISTORY - 1)
+
+// Constants of one rotator. They are computed on the host from the float
+// bank, so that device and host run on identical coefficients.
+typedef struct FixedRotatorParams {
+  // frequency / samplerate * 2^32
+  uint32_t phase_step;
+  // 1 - window = leak * 2^-(15 + leak_shift), with leak in [2^14, 2^15).
+  int16_t leak;
+  uint8_t leak_shift;
+  // Filter gain = gain * 2^(gain_shift - 15), with gain in [2^14, 2^15)
+  // unless the filter gain is below 1/2.
+  int16_t gain;
+  uint8_t gain_shift;
+  uint16_t advance;
+} FixedRotatorParams;
+
+typedef struct FixedRotators {
+  int num_channels;
+  FixedRotatorParams params[FIXED_ROTATORS_NUM];
+  uint32_t phase[FIXED_ROTATORS_NUM];
+  // Same layout as PerChannel::accu, in Q27 units scaled by 2^shift.
+  int32_t accu[FIXED_ROTATORS_MAX_CHANNELS][6][FIXED_ROTATORS_NUM];
+  uint8_t shift[FIXED_ROTATORS_MAX_CHANNELS][FIXED_ROTATORS_NUM];
+  // Q23 input, interleaved by channel.
+  int32_t history[FIXED_ROTATORS_HISTORY * FIXED_ROTATORS_MAX_CHANNELS];
+  uint32_t pos;
+} FixedRotators;
+
+void fixed_rotators_init(FixedRotators *r, const FixedRotatorParams *params,
+                         int num_channels);
+
+// Filters num_frames of interleaved 24-bit (Q23) samples. Output sample n
+// corresponds to input sample n - max(advance), like the float bank after
+// its first max_delay_ samples; it saturates at the 24-bit range.
+void fixed_rotators_process(FixedRotators *r, const int32_t *in, int32_t *out,
+                            int num_frames);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // PICCOLO_FIXED_ROTATORS_H
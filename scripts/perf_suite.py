@@ -0,0 +1,406 @@
+# Copyright 2024 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# End-to-end performance suite of the renderers. It synthesizes deterministic
+# inputs (a stereo mix of sweeps, tones and noise, noise bursts between runs
+# of digital silence and a multichannel file of sweeps), runs the binaries of
+# a build over them in all their main modes, and records the real-time factor
+# and the peak memory of each run as JSON, together with the SHA-256 of each
+# output.
+#
+# Record a baseline with the build before a change, and compare the build
+# after it against that:
+#
+#   python3 scripts/perf_suite.py --update   # writes the baseline
+#   python3 scripts/perf_suite.py            # fails if an output changed
+#
+# The hashes depend on the compiler and the CPU, so baselines are only
+# comparable on the same machine. The cclvi muxers are built with Bazel and
+# only run when --mux and --dsd_mux point at them; they map the inputs to
+# their channels at random, so only their times are recorded.
+
+import argparse
+import array
+import concurrent.futures
+import hashlib
+import json
+import math
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SAMPLERATE = 48000
+MUX_RATE = 44100
+MUX_SECONDS = 60
+
+
+class Noise:
+    """Deterministic uniform noise in [-1, 1) from a linear congruence."""
+
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self):
+        self.state = (self.state * 6364136223846793005 +
+                      1442695040888963407) % (1 << 64)
+        return (self.state >> 40) / float(1 << 23) - 1.0
+
+
+def write_wav(path, channels, samplerate, frames, fmt):
+    """Writes interleaved samples in [-1, 1] as 16-bit PCM or 32-bit float."""
+    if fmt == 'float':
+        data = array.array('f', frames)
+        tag, bits = 3, 32
+    else:
+        data = array.array('h', (max(-32768, min(32767, round(v * 32767)))
+                                 for v in frames))
+        tag, bits = 1, 16
+    if sys.byteorder != 'little':
+        data.byteswap()
+    payload = data.tobytes()
+    block = channels * bits // 8
+    with open(path, 'wb') as f:
+        f.write(b'RIFF' + struct.pack('<I', 36 + len(payload)) + b'WAVE')
+        f.write(b'fmt ' + struct.pack('<IHHIIHH', 16, tag, channels,
+                                      samplerate, samplerate * block, block,
+                                      bits))
+        f.write(b'data' + struct.pack('<I', len(payload)))
+        f.write(payload)
+
+
+def sweep(t, seconds, low=20.0, high=20000.0):
+    """Exponential sine sweep from low to high Hz over seconds."""
+    k = math.log(high / low)
+    return math.sin(2 * math.pi * low * seconds / k *
+                    (math.exp(k * t / seconds) - 1))
+
+
+def stereo_mix(seconds):
+    noise = Noise(1)
+    n = int(seconds * SAMPLERATE)
+    out = []
+    for i in range(n):
+        t = i / SAMPLERATE
+        # A sweep panned from left to right over tones in the center and
+        # noise on both sides.
+        pan = t / seconds
+        s = 0.3 * sweep(t, seconds)
+        tones = 0.1 * (math.sin(2 * math.pi * 220 * t) +
+                       math.sin(2 * math.pi * 1760 * t))
+        out.append((1 - pan) * s + tones + 0.05 * noise.next())
+        out.append(pan * s + tones + 0.05 * noise.next())
+    return out
+
+
+def silence_runs(seconds):
+    noise = Noise(2)
+    n = int(seconds * SAMPLERATE)
+    out = []
+    for i in range(n):
+        # One second of noise every six seconds.
+        loud = (i // SAMPLERATE) % 6 == 0
+        out.append(0.3 * noise.next() if loud else 0.0)
+        out.append(0.3 * noise.next() if loud else 0.0)
+    return out
+
+
+def multichannel(seconds, channels):
+    n = int(seconds * SAMPLERATE)
+    out = []
+    for i in range(n):
+        t = i / SAMPLERATE
+        for c in range(channels):
+            # The sweeps of the channels are offset against each other.
+            out.append(0.3 * sweep((t + c * seconds / channels) % seconds,
+                                   seconds))
+    return out
+
+
+def synthesize(path, signal, channels, fmt, seconds):
+    print('Synthesizing %s' % path)
+    if signal == 'multichannel':
+        frames = multichannel(seconds, channels)
+    else:
+        frames = {'mix': stereo_mix, 'silence': silence_runs}[signal](seconds)
+    # Under another name until complete, so that an interrupted run does not
+    # leave a truncated input behind.
+    write_wav(path + '.tmp', channels, SAMPLERATE, frames, fmt)
+    os.replace(path + '.tmp', path)
+
+
+def make_inputs(work_dir, seconds):
+    """Writes the inputs unless they exist, and returns their paths.
+
+    They are synthesized in worker processes, which also keeps their memory
+    out of the peak of the runs that are forked from this one."""
+    inputs = {
+        'mix': ('mix', 2, 'pcm16'),
+        'mix_float': ('mix', 2, 'float'),
+        'silence': ('silence', 2, 'pcm16'),
+        'multichannel': ('multichannel', 8, 'pcm16'),
+    }
+    paths = {}
+    with concurrent.futures.ProcessPoolExecutor() as pool:
+        jobs = []
+        for name, (signal, channels, fmt) in inputs.items():
+            path = os.path.join(work_dir, '%s-%gs.wav' % (name, seconds))
+            paths[name] = path
+            if not os.path.exists(path):
+                jobs.append(pool.submit(synthesize, path, signal, channels,
+                                        fmt, seconds))
+        for job in jobs:
+            job.result()
+    return paths
+
+
+def make_mux_inputs(mux_dir, dsd_mux_dir):
+    """Writes the inputs of the muxers into the directories they run in."""
+    for directory, ext, size in (
+            (mux_dir, '.pcm16', 2 * MUX_RATE * MUX_SECONDS),
+            (dsd_mux_dir, '.dsd64', 8 * MUX_RATE * MUX_SECONDS)):
+        os.makedirs(directory, exist_ok=True)
+        for i in range(4):
+            path = os.path.join(directory, 'input%d%s' % (i, ext))
+            if os.path.exists(path) and os.path.getsize(path) == size:
+                continue
+            with open(path, 'wb') as f:
+                f.write(random.Random(10 + i).randbytes(size))
+
+
+def cases(args, inputs, out):
+    """Returns (name, command, input, outputs, hashed, cwd) of each run."""
+    build = args.build_dir
+    identity = os.path.join(build, 'identity_sliding_fft')
+    mix = inputs['mix']
+    result = []
+
+    def identity_case(name, flags, input_name='mix'):
+        output = os.path.join(out, 'identity_%s.wav' % name)
+        result.append(('identity_sliding_fft/' + name,
+                       [identity] + flags + [inputs[input_name], output],
+                       inputs[input_name], [output], True, None))
+
+    identity_case('identity', [])
+    identity_case('amplitude', ['--filter_mode=amplitude'])
+    identity_case('phase', ['--filter_mode=phase'])
+    identity_case('multirate', ['--multirate'])
+    identity_case('fft_convolution', ['--fft_convolution'])
+    identity_case('max_latency', ['--max_latency_ms=20'])
+    identity_case('resample', ['--internal_samplerate=96000'])
+    identity_case('segments', ['--segment_seconds=5'])
+    identity_case('normalize', ['--peak_db=-1'])
+    identity_case('limiter', ['--gain=4', '--limiter_ms=2'])
+    identity_case('silence', [], 'silence')
+    identity_case('multichannel', [], 'multichannel')
+    identity_case('threads', ['--num_threads=4'], 'multichannel')
+
+    for name, flags in (('revolve', []), ('revolve/pipeline', ['--pipeline'])):
+        stem = name.replace('/', '_')
+        outputs = [os.path.join(out, stem + '_speakers.wav'),
+                   os.path.join(out, stem + '_binaural.wav')]
+        result.append((name,
+                       [os.path.join(build, 'revolve')] + flags + [mix] +
+                       outputs, mix, outputs, True, None))
+
+    for name, flags in (('emphasizer', []),
+                        ('angular', ['--output_channels=16']),
+                        ('two_to_three', [])):
+        output = os.path.join(out, name + '.wav')
+        result.append((name, [os.path.join(build, name)] + flags +
+                       [mix, output], mix, [output], True, None))
+
+    output = os.path.join(out, 'virtual_speakers.wav')
+    result.append(('virtual_speakers',
+                   [os.path.join(build, 'virtual_speakers'),
+                    '--input_file=' + mix, '--output_file=' + output],
+                   mix, [output], True, None))
+
+    output = os.path.join(out, 'driver_model.wav')
+    result.append(('driver_model',
+                   [os.path.join(build, 'driver_model'), inputs['mix_float'],
+                    output], inputs['mix_float'], [output], True, None))
+
+    for name, binary in (('mux', args.mux), ('dsd_mux', args.dsd_mux)):
+        if not binary:
+            continue
+        cwd = os.path.join(args.work_dir, name)
+        result.append((name, [os.path.abspath(binary)], None,
+                       [os.path.join(cwd, 'snd.mux')], False, cwd))
+    return result
+
+
+def audio_seconds(path):
+    if path is None:
+        return MUX_SECONDS
+    with open(path, 'rb') as f:
+        header = f.read(44)
+    channels, samplerate = struct.unpack('<HI', header[22:28])
+    bits = struct.unpack('<H', header[34:36])[0]
+    size = struct.unpack('<I', header[40:44])[0]
+    return size / (channels * bits // 8) / samplerate
+
+
+def sha256(path):
+    digest = hashlib.sha256()
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(1 << 20), b''):
+            digest.update(chunk)
+    return digest.hexdigest()
+
+
+def output_files(path):
+    """The output at path, or the files that --split_output made of it."""
+    if os.path.exists(path):
+        return [path]
+    stem, ext = os.path.splitext(path)
+    directory = os.path.dirname(path)
+    prefix = os.path.basename(stem) + '.'
+    return sorted(os.path.join(directory, f) for f in os.listdir(directory)
+                  if f.startswith(prefix) and f.endswith(ext))
+
+
+def run(name, command, input_path, outputs, hashed, cwd):
+    print('Running %s' % name)
+    with open(os.devnull, 'w') as devnull, tempfile.TemporaryFile() as log:
+        start = time.monotonic()
+        process = subprocess.Popen(command, cwd=cwd, stdout=devnull,
+                                   stderr=log)
+        # wait4 also returns the resource usage of this child alone, with
+        # its peak resident set in kB.
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.monotonic() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+        if process.returncode != 0:
+            log.seek(0)
+            sys.stderr.write(log.read().decode(errors='replace'))
+            raise SystemExit('%s failed with status %d' %
+                             (name, process.returncode))
+    peak_kb = usage.ru_maxrss
+    seconds = audio_seconds(input_path)
+    hashes = {}
+    for output in outputs:
+        for path in output_files(output):
+            hashes[os.path.basename(path)] = sha256(path) if hashed else None
+            if not hashed:
+                os.remove(path)
+    return {
+        'name': name,
+        'command': command,
+        'audio_seconds': round(seconds, 3),
+        'wall_seconds': round(wall, 3),
+        'real_time_factor': round(wall / seconds, 4),
+        'peak_rss_mb': round(peak_kb / 1024.0, 1),
+        'outputs': hashes,
+    }
+
+
+def compare(results, baseline, max_slowdown):
+    """Returns the differences of the results from the baseline."""
+    problems = []
+    previous = {r['name']: r for r in baseline['results']}
+    for result in results:
+        before = previous.get(result['name'])
+        if before is None:
+            continue
+        for output, digest in result['outputs'].items():
+            if digest is not None and before['outputs'].get(output) != digest:
+                problems.append('%s: %s changed' % (result['name'], output))
+        slowdown = (result['real_time_factor'] /
+                    max(before['real_time_factor'], 1e-9))
+        if max_slowdown > 0 and slowdown > max_slowdown:
+            problems.append('%s: %.2fx slower' % (result['name'], slowdown))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--build_dir', default='build',
+                        help='Directory with the built binaries.')
+    parser.add_argument('--work_dir', default='/tmp/tabuli_perf',
+                        help='Directory for the inputs and the outputs.')
+    parser.add_argument('--seconds', type=float, default=30,
+                        help='Length of the synthesized inputs.')
+    parser.add_argument('--only', default='',
+                        help='Runs only the cases whose names contain this.')
+    parser.add_argument('--baseline', default='',
+                        help='Baseline JSON, by default in --work_dir. '
+                        'If given, it has to exist unless --update is set.')
+    parser.add_argument('--update', action='store_true',
+                        help='Writes the results as the baseline.')
+    parser.add_argument('--json', default='',
+                        help='Also writes the results to this file.')
+    parser.add_argument('--max_slowdown', type=float, default=0,
+                        help='If positive, fails when a case is this many '
+                        'times slower than in the baseline.')
+    parser.add_argument('--mux', default='', help='Path of the cclvi mux.')
+    parser.add_argument('--dsd_mux', default='',
+                        help='Path of the cclvi dsd_mux.')
+    args = parser.parse_args()
+
+    out = os.path.join(args.work_dir, 'out')
+    os.makedirs(out, exist_ok=True)
+    inputs = make_inputs(args.work_dir, args.seconds)
+    if args.mux or args.dsd_mux:
+        make_mux_inputs(os.path.join(args.work_dir, 'mux'),
+                        os.path.join(args.work_dir, 'dsd_mux'))
+
+    results = []
+    for case in cases(args, inputs, out):
+        if args.only not in case[0]:
+            continue
+        if not os.path.exists(case[1][0]):
+            print('Skipping %s, %s is not built' % (case[0], case[1][0]))
+            continue
+        results.append(run(*case))
+
+    print('%-36s %8s %8s %9s' % ('case', 'seconds', 'RTF', 'peak MB'))
+    for r in results:
+        print('%-36s %8.2f %8.3f %9.1f' % (r['name'], r['wall_seconds'],
+                                           r['real_time_factor'],
+                                           r['peak_rss_mb']))
+    report = {'seconds': args.seconds, 'results': results}
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    baseline_path = args.baseline or os.path.join(args.work_dir,
+                                                  'baseline.json')
+    if args.update:
+        with open(baseline_path, 'w') as f:
+            json.dump(report, f, indent=2)
+        print('Wrote the baseline to %s' % baseline_path)
+        return 0
+    if not os.path.exists(baseline_path):
+        print('No baseline at %s; record one with --update' % baseline_path)
+        # A baseline that was asked for by name has to be there.
+        return 1 if args.baseline else 0
+    with open(baseline_path) as f:
+        baseline = json.load(f)
+    if baseline['seconds'] != args.seconds:
+        raise SystemExit('The baseline is of %g s inputs' % baseline['seconds'])
+    problems = compare(results, baseline, args.max_slowdown)
+    for problem in problems:
+        print(problem)
+    if problems:
+        return 1
+    print('All outputs match the baseline')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -33,20 +33,15 @@ run("(cd build; make -j 55)")
 
 file = sys.argv[1]
 print("playing", file)
-run('cp "' + file + '" /tmp/input.wav')
-
-run("sox /tmp/input.wav -b 24 /tmp/down-dry.wav gain -10 rate 48k")
-
-run("./build/revolve /tmp/down-dry.wav /tmp/16speakers.wav /tmp/stereo2.wav"); # & sleep 4; play --ignore-length - < /tmp/stereo2.wav")
-
-run("sox /tmp/stereo2.wav /tmp/stereo3.wav norm -2; play /tmp/stereo3.wav ");
-
-#run("sox /tmp/16speakers.wav -e float -b 32 /tmp/stereo.wav remix 1,2,3,4,5,6,7,8 9,10,11,12,13,14,15,16 norm -22")
-mix0 = ",".join(["%d,v%g" % (i + 1, (i + 1) / 256.0) for i in range(16)])
-mix1 = ",".join(["%d,v%g" % (i + 1, (16 - i) / 256.0) for i in range(16)])
-run("sox /tmp/16speakers.wav -e float -b 32 /tmp/stereo.wav remix " + mix1 + " " + mix0 + " norm -22")
-
-run("sox /tmp/16speakers.wav -b 24 /tmp/down3-norm.wav remix 0 0 1v1 2v1 3v1 4v1 5v1 6v1 7v1 8v1 0 0 9v1.0 10v1.0 11v1.0 12v1.0 13v1.0 14v1.0 15v1.0 16v1.0 norm -32")
+# Resampling, filtering, mixing and normalization run as one pipeline that
+# keeps the intermediate signals in memory.
+run('./build/revolve --pipeline --internal_samplerate=48000 '
+    '--input_gain_db=-10 --binaural_peak_db=-2 '
+    '--stereo_output=/tmp/stereo.wav --stereo_peak_db=-22 '
+    '--device_output=/tmp/down3-norm.wav --device_peak_db=-32 "' + file +
+    '" /tmp/16speakers.wav /tmp/stereo3.wav')
+
+run("play /tmp/stereo3.wav")
 
 #run("amixer --card 2 cset numid=3,iface=MIXER,name='UMC1820 Output Playback Volume' 127,127,127,127,127,127,127,127,121,121,121,121,121,121,121,121")
 run("amixer --card 2 cset numid=3,iface=MIXER,name='UMC1820 Output Playback Volume' 127,127,127,127,127,127,127,127,127,127,127,127,127,127,127,127")
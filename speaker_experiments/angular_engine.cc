@@ -0,0 +1,200 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "angular_engine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <mutex>  // NOLINT
+#include <vector>
+
+#include "absl/log/check.h"
+#include "fftw3.h"
+#include "trace.h"
+
+namespace tabuli {
+namespace angular {
+
+namespace {
+
+constexpr int kSubSourcePrecision = 10;
+
+// The FFTW planner is not thread-safe, while executing different plans is.
+std::mutex planner_mutex;
+
+float SquaredNorm(const fftwf_complex c) { return c[0] * c[0] + c[1] * c[1]; }
+
+float MicrophoneResponse(const float angle) {
+  return 0.5f * (1.25f + std::cos(angle));
+}
+
+float ExpectedLeftToRightRatio(const float angle) {
+  return (1e-3 + MicrophoneResponse(angle + M_PI / 4)) /
+         (1e-3 + MicrophoneResponse(angle - M_PI / 4));
+}
+
+float ActualLeftToRightRatio(const fftwf_complex left,
+                             const fftwf_complex right) {
+  return std::sqrt((1e-3 + SquaredNorm(left)) / (1e-3 + SquaredNorm(right)));
+}
+
+}  // namespace
+
+Engine::Engine(const int window_size, const int overlap,
+               const int output_channels,
+               const float distance_to_interval_ratio)
+    : window_size_(window_size),
+      overlap_(overlap),
+      output_channels_(output_channels),
+      normalizer_(2.f / (window_size * overlap)),
+      input_fft_(fftwf_alloc_complex(2 * (window_size / 2 + 1))),
+      output_fft_(fftwf_alloc_complex(output_channels * (window_size / 2 + 1))),
+      windowed_input_(fftwf_alloc_real(2 * window_size)),
+      synthesized_output_(fftwf_alloc_real(output_channels * window_size)),
+      input_(2 * window_size),
+      output_(output_channels * window_size) {
+  QCHECK_EQ(window_size % overlap, 0);
+  {
+    std::lock_guard<std::mutex> lock(planner_mutex);
+    left_right_fft_ = fftwf_plan_many_dft_r2c(
+        /*rank=*/1, /*n=*/&window_size, /*howmany=*/2,
+        /*in=*/windowed_input_.get(), /*inembed=*/nullptr, /*istride=*/2,
+        /*idist=*/1, /*out=*/input_fft_.get(), /*onembed=*/nullptr,
+        /*ostride=*/2, /*odist=*/1,
+        /*flags=*/FFTW_PATIENT | FFTW_DESTROY_INPUT);
+
+    output_ifft_ = fftwf_plan_many_dft_c2r(
+        /*rank=*/1, /*n=*/&window_size, /*howmany=*/output_channels,
+        /*in=*/output_fft_.get(), /*inembed=*/nullptr,
+        /*istride=*/output_channels, /*idist=*/1,
+        /*out=*/synthesized_output_.get(), /*onembed=*/nullptr,
+        /*ostride=*/output_channels, /*odist=*/1,
+        /*flags=*/FFTW_PATIENT | FFTW_DESTROY_INPUT);
+  }
+
+  speaker_to_ratio_table_.reserve(kSubSourcePrecision * (output_channels - 1) +
+                                  1);
+  for (int i = 0; i < kSubSourcePrecision * (output_channels - 1) + 1; ++i) {
+    const float x_div_interval = static_cast<float>(i) / kSubSourcePrecision -
+                                 0.5f * (output_channels - 1);
+    const float x_div_distance = x_div_interval / distance_to_interval_ratio;
+    const float angle = std::atan(x_div_distance);
+    speaker_to_ratio_table_.push_back(ExpectedLeftToRightRatio(angle));
+  }
+
+  window_function_.reserve(window_size);
+  for (int i = 0; i < window_size; ++i) {
+    const float sine = std::sin(i * M_PI / (window_size - 1));
+    window_function_.push_back(sine * sine);
+  }
+}
+
+Engine::~Engine() {
+  std::lock_guard<std::mutex> lock(planner_mutex);
+  fftwf_destroy_plan(left_right_fft_);
+  fftwf_destroy_plan(output_ifft_);
+}
+
+void Engine::Restart() {
+  std::fill(input_.begin(), input_.end(), 0.0f);
+  std::fill(output_.begin(), output_.end(), 0.0f);
+}
+
+void Engine::Synthesize() {
+  {
+    tabuli::ScopedStage stage(tabuli::kStageFilter);
+    for (int i = 0; i < window_size_; ++i) {
+      windowed_input_[2 * i] = window_function_[i] * input_[2 * i];
+      windowed_input_[2 * i + 1] = window_function_[i] * input_[2 * i + 1];
+    }
+
+    fftwf_execute(left_right_fft_);
+  }
+
+  {
+    tabuli::ScopedStage stage(tabuli::kStageMix);
+    for (int i = 0; i < output_channels_ * (window_size_ / 2 + 1); ++i) {
+      std::fill(std::begin(output_fft_[i]), std::end(output_fft_[i]), 0.f);
+    }
+
+    for (int i = 0; i < window_size_ / 2 + 1; ++i) {
+      const float ratio =
+          ActualLeftToRightRatio(input_fft_[2 * i], input_fft_[2 * i + 1]);
+      const int subspeaker_index =
+          std::lower_bound(speaker_to_ratio_table_.begin(),
+                           speaker_to_ratio_table_.end(), ratio,
+                           std::greater<>()) -
+          speaker_to_ratio_table_.begin();
+
+      // amp-kludge to make borders louder -- it is a virtual line array
+      // where the borders will be further away in rendering, so let's
+      // compensate for it here.
+
+      float distance_from_center =
+          (subspeaker_index - 0.5 * (output_channels_ - 1));
+      float assumed_distance_to_line = 0.75 * (output_channels_ - 1);
+      float distance_to_virtual =
+          sqrt(distance_from_center * distance_from_center +
+               assumed_distance_to_line * assumed_distance_to_line);
+      float dist_ratio =
+          distance_to_virtual * (1.0f / assumed_distance_to_line);
+      float amp = dist_ratio * dist_ratio;
+
+      const float index =
+          static_cast<float>(subspeaker_index) / kSubSourcePrecision;
+      float integral_index_f;
+      const float fractional_index = std::modf(index, &integral_index_f);
+      const int integral_index = integral_index_f;
+      const fftwf_complex source_coefficient = {
+          0.5f * (input_fft_[2 * i][0] + input_fft_[2 * i + 1][0]),
+          0.5f * (input_fft_[2 * i][1] + input_fft_[2 * i + 1][1])};
+      const float a = amp * (1 - fractional_index);
+      const float b = amp * (fractional_index);
+      output_fft_[i * output_channels_ + integral_index][0] =
+          a * source_coefficient[0];
+      output_fft_[i * output_channels_ + integral_index][1] =
+          a * source_coefficient[1];
+      output_fft_[i * output_channels_ + integral_index + 1][0] =
+          b * source_coefficient[0];
+      output_fft_[i * output_channels_ + integral_index + 1][1] =
+          b * source_coefficient[1];
+    }
+  }
+
+  {
+    tabuli::ScopedStage stage(tabuli::kStageFilter);
+    fftwf_execute(output_ifft_);
+
+    for (int i = 0; i < output_channels_ * window_size_; ++i) {
+      output_[i] += synthesized_output_[i];
+    }
+  }
+}
+
+void Engine::Advance() {
+  const int skip_size = window_size_ / overlap_;
+  std::copy(input_.begin() + 2 * skip_size, input_.begin() + 2 * window_size_,
+            input_.begin());
+  std::fill_n(input_.begin() + 2 * (window_size_ - skip_size), 2 * skip_size,
+              0);
+  std::copy(output_.begin() + output_channels_ * skip_size, output_.end(),
+            output_.begin());
+  std::fill_n(output_.begin() + output_channels_ * (window_size_ - skip_size),
+              output_channels_ * skip_size, 0);
+}
+
+}  // namespace angular
+}  // namespace tabuli
@@ -0,0 +1,121 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The upmixer of angular: each FFT bin of overlapping windows of a stereo
+// input is placed between the speakers of a line array by the level
+// difference of its channels, and the speaker feeds are synthesized by
+// inverse FFTs.
+
+#ifndef _TABULI_ANGULAR_ENGINE_H
+#define _TABULI_ANGULAR_ENGINE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "fftw3.h"
+#include "trace.h"
+
+namespace tabuli {
+namespace angular {
+
+struct FFTWDeleter {
+  void operator()(void* p) const { fftwf_free(p); }
+};
+template <typename T>
+using FFTWUniquePtr = std::unique_ptr<T, FFTWDeleter>;
+
+// The FFT plans and buffers of one window size and speaker count. Planning
+// with FFTW_PATIENT takes much longer than a short input, so a job reuses
+// them from the previous one after Restart.
+class Engine {
+ public:
+  Engine(int window_size, int overlap, int output_channels,
+         float distance_to_interval_ratio);
+  ~Engine();
+
+  Engine(const Engine&) = delete;
+  Engine& operator=(const Engine&) = delete;
+
+  int output_channels() const { return output_channels_; }
+
+  // Clears the windows of the previous input.
+  void Restart();
+
+  template <typename In, typename Out>
+  void Process(
+      In& input_stream, Out& output_stream,
+      const std::function<void()>& start_progress = [] {},
+      const std::function<void(int64_t)>& set_progress = [](int64_t written) {
+      }) {
+    const int skip_size = window_size_ / overlap_;
+    start_progress();
+    int64_t read = 0, written = 0, index = 0;
+    for (;;) {
+      {
+        tabuli::ScopedStage stage(tabuli::kStageRead);
+        read += input_stream.readf(
+            input_.data() + 2 * (window_size_ - skip_size), skip_size);
+      }
+
+      Synthesize();
+
+      if (index >= window_size_ - skip_size) {
+        for (int i = 0; i < output_channels_ * skip_size; ++i) {
+          output_[i] *= normalizer_;
+        }
+        const int64_t to_write = std::min<int64_t>(skip_size, read - written);
+        {
+          tabuli::ScopedStage stage(tabuli::kStageWrite);
+          output_stream.writef(output_.data(), to_write);
+        }
+        written += to_write;
+        set_progress(written);
+        if (written == read) break;
+      }
+
+      Advance();
+      index += skip_size;
+    }
+  }
+
+ private:
+  // Transforms the current window of the input, places its bins between the
+  // speakers, and adds their synthesis to the output.
+  void Synthesize();
+  // Moves the input and the output on by a hop.
+  void Advance();
+
+  int window_size_;
+  int overlap_;
+  int output_channels_;
+  float normalizer_;
+  FFTWUniquePtr<fftwf_complex[]> input_fft_;
+  FFTWUniquePtr<fftwf_complex[]> output_fft_;
+  FFTWUniquePtr<float[]> windowed_input_;
+  FFTWUniquePtr<float[]> synthesized_output_;
+  std::vector<float> input_;
+  std::vector<float> output_;
+  fftwf_plan left_right_fft_;
+  fftwf_plan output_ifft_;
+  std::vector<float> speaker_to_ratio_table_;
+  std::vector<float> window_function_;
+};
+
+}  // namespace angular
+}  // namespace tabuli
+
+#endif  // _TABULI_ANGULAR_ENGINE_H
@@ -0,0 +1,210 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "audio_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/log/check.h"
+#include "resampler.h"
+#include "sndfile.hh"
+
+namespace tabuli {
+
+namespace {
+
+// File layout: kMagic, kVersion, channels, sample rate and frame count in a
+// header of kHeaderSize bytes, then the float samples of each channel.
+constexpr uint32_t kMagic = 0x43444254;  // "TBDC"
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = 32;
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t channels;
+  uint32_t samplerate;
+  uint64_t frames;
+  uint64_t reserved;
+};
+static_assert(sizeof(Header) == kHeaderSize);
+
+uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// 64-bit hash of the contents of the file at path.
+uint64_t HashFile(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  QCHECK_GE(fd, 0) << path << ": " << strerror(errno);
+  struct stat st;
+  QCHECK_EQ(fstat(fd, &st), 0) << path << ": " << strerror(errno);
+  const size_t size = st.st_size;
+  uint64_t h = Mix(size ^ 0x9e3779b97f4a7c15ull);
+  if (size > 0) {
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    QCHECK(map != MAP_FAILED) << path << ": " << strerror(errno);
+    const uint8_t *bytes = static_cast<const uint8_t *>(map);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      uint64_t w;
+      memcpy(&w, bytes + i, 8);
+      h = Mix(h ^ w) + i;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    h = Mix(h ^ tail);
+    munmap(map, size);
+  }
+  close(fd);
+  return h;
+}
+
+}  // namespace
+
+std::string AudioCacheDir(const std::string &cache_dir) {
+  if (!cache_dir.empty()) return cache_dir;
+  const char *env = getenv("TABULI_AUDIO_CACHE");
+  return env ? env : "";
+}
+
+CachedReader::CachedReader(const std::string &path, size_t samplerate,
+                           const std::string &cache_dir) {
+  if (cache_dir.empty()) {
+    Decode(path, samplerate);
+    return;
+  }
+  if (samplerate == 0) {
+    // Opening the file only reads its header.
+    SndfileHandle file(path);
+    QCHECK(file) << path << ": " << file.strError();
+    samplerate = file.samplerate();
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%zu.f32",
+           static_cast<unsigned long long>(HashFile(path)), samplerate);
+  const std::string cache_path = cache_dir + name;
+  if (Map(cache_path)) {
+    hit_ = true;
+    return;
+  }
+  Decode(path, samplerate);
+  // Written under a name of its own and renamed, so that concurrent readers
+  // only ever map complete files.
+  const std::string temp_path =
+      cache_path + "." + std::to_string(getpid()) + "." +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  FILE *f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "Could not write %s, not caching %s\n", temp_path.c_str(),
+            path.c_str());
+    return;
+  }
+  const Header header = {kMagic, kVersion, static_cast<uint32_t>(channels_),
+                         static_cast<uint32_t>(samplerate_),
+                         static_cast<uint64_t>(frames_), 0};
+  const bool written =
+      fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(decoded_.data(), sizeof(float), decoded_.size(), f) ==
+          decoded_.size();
+  if (fclose(f) == 0 && written) {
+    QCHECK_EQ(rename(temp_path.c_str(), cache_path.c_str()), 0)
+        << cache_path << ": " << strerror(errno);
+  } else {
+    unlink(temp_path.c_str());
+  }
+}
+
+CachedReader::~CachedReader() {
+  if (map_) munmap(map_, map_size_);
+}
+
+void CachedReader::Decode(const std::string &path, size_t samplerate) {
+  SndfileHandle file(path);
+  QCHECK(file) << path << ": " << file.strError();
+  channels_ = file.channels();
+  std::vector<float> interleaved;
+  auto read_all = [&](auto &in) {
+    constexpr int64_t kChunk = 1 << 14;
+    std::vector<float> chunk(channels_ * kChunk);
+    int64_t read;
+    while ((read = in.readf(chunk.data(), kChunk)) > 0) {
+      interleaved.insert(interleaved.end(), chunk.begin(),
+                         chunk.begin() + channels_ * read);
+    }
+  };
+  if (samplerate != 0 && samplerate != file.samplerate()) {
+    ResamplingReader<SndfileHandle> resampled(file, samplerate);
+    read_all(resampled);
+    samplerate_ = samplerate;
+  } else {
+    read_all(file);
+    samplerate_ = file.samplerate();
+  }
+  frames_ = interleaved.size() / channels_;
+  decoded_.resize(interleaved.size());
+  for (int64_t i = 0; i < frames_; ++i) {
+    for (size_t c = 0; c < channels_; ++c) {
+      decoded_[c * frames_ + i] = interleaved[i * channels_ + c];
+    }
+  }
+  planar_ = decoded_.data();
+}
+
+bool CachedReader::Map(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  Header header;
+  const bool valid = fstat(fd, &st) == 0 &&
+                     pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     header.magic == kMagic && header.version == kVersion &&
+                     st.st_size == static_cast<off_t>(
+                                       kHeaderSize + sizeof(float) *
+                                                         header.channels *
+                                                         header.frames);
+  if (valid) {
+    map_size_ = st.st_size;
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_ == MAP_FAILED) map_ = nullptr;
+  }
+  close(fd);
+  if (!map_) return false;
+  channels_ = header.channels;
+  samplerate_ = header.samplerate;
+  frames_ = header.frames;
+  planar_ = reinterpret_cast<const float *>(static_cast<const uint8_t *>(map_) +
+                                            kHeaderSize);
+  return true;
+}
+
+}  // namespace tabuli
@@ -0,0 +1,96 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_AUDIO_CACHE_H
+#define _TABULI_AUDIO_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace tabuli {
+
+// Directory of the decoded-audio cache: cache_dir, or the environment
+// variable TABULI_AUDIO_CACHE if that is empty. Empty if neither is set.
+std::string AudioCacheDir(const std::string &cache_dir);
+
+// Input stream over a whole sound file that has been decoded to float, and
+// resampled if samplerate is not 0, with channels(), samplerate(), frames(),
+// seek() and readf() like SndfileHandle.
+//
+// With a cache directory, the decoded samples are kept there in a file named
+// after a hash of the contents of the sound file and the sample rate, and
+// the next reader of the same contents maps that file instead of decoding
+// again. The samples are planar, channel after channel. Without a cache
+// directory, the file is decoded into memory.
+class CachedReader {
+ public:
+  CachedReader(const std::string &path, size_t samplerate = 0,
+               const std::string &cache_dir = AudioCacheDir(""));
+  ~CachedReader();
+
+  CachedReader(const CachedReader &) = delete;
+  CachedReader &operator=(const CachedReader &) = delete;
+
+  size_t channels() const { return channels_; }
+  size_t samplerate() const { return samplerate_; }
+  int64_t frames() const { return frames_; }
+  // Whether the samples came from the cache rather than from decoding.
+  bool hit() const { return hit_; }
+
+  // Samples of channel c.
+  const float *channel(size_t c) const { return planar_ + c * frames_; }
+
+  int64_t seek(int64_t frame, int whence) {
+    if (whence == SEEK_CUR) frame += pos_;
+    if (whence == SEEK_END) frame += frames_;
+    pos_ = std::clamp<int64_t>(frame, 0, frames_);
+    return pos_;
+  }
+
+  template <typename T>
+  int64_t readf(T *data, int64_t nframes) {
+    nframes = std::min(nframes, frames_ - pos_);
+    for (size_t c = 0; c < channels_; ++c) {
+      const float *from = channel(c) + pos_;
+      for (int64_t i = 0; i < nframes; ++i) {
+        data[i * channels_ + c] = from[i];
+      }
+    }
+    pos_ += nframes;
+    return nframes;
+  }
+
+ private:
+  // Decodes the sound file into decoded_.
+  void Decode(const std::string &path, size_t samplerate);
+  // Maps the cache file at path, if it is complete.
+  bool Map(const std::string &path);
+
+  size_t channels_ = 0;
+  size_t samplerate_ = 0;
+  int64_t frames_ = 0;
+  bool hit_ = false;
+  const float *planar_ = nullptr;
+  std::vector<float> decoded_;
+  void *map_ = nullptr;
+  size_t map_size_ = 0;
+  int64_t pos_ = 0;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_AUDIO_CACHE_H
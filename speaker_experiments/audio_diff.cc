@@ -25,6 +25,7 @@
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/check.h"
+#include "denormals.h"
 #include "sndfile.hh"
 
 namespace {
@@ -105,8 +106,11 @@ double BarkFreq(double v) {
 }
 
 static constexpr int64_t kBlockSize = 32768;
-static const int kHistorySize = (1 << 18);
+// The advance of the rotators is at most 0xfff0, so the ring only has to
+// hold that much look-back behind the block being filtered.
+static const int kHistorySize = (1 << 17);
 static const int kHistoryMask = kHistorySize - 1;
+static_assert(0xfff0 + kBlockSize <= kHistorySize);
 
 class TaskExecutor {
  public:
@@ -114,8 +118,8 @@ class TaskExecutor {
   double error_ = 0;
 
   void Execute(size_t num_tasks, size_t read, size_t total,
-               const double* history, Rotator* rot_left, Rotator* rot_right,
-               size_t read2, size_t total2, const double* history2,
+               const float* history, Rotator* rot_left, Rotator* rot_right,
+               size_t read2, size_t total2, const float* history2,
                Rotator* rot_left2, Rotator* rot_right2) {
     read_ = read;
     total_ = total;
@@ -140,6 +144,7 @@ class TaskExecutor {
   }
 
   void Run(size_t thread) {
+    tabuli::ScopedFlushDenormals flush_denormals;
     while (true) {
       size_t my_task = next_task_++;
       if (my_task >= num_tasks_) return;
@@ -172,19 +177,19 @@ class TaskExecutor {
   int64_t total_;
   Rotator* rot_left_;
   Rotator* rot_right_;
-  const double* history_;
+  const float* history_;
   int64_t read2_;
   int64_t total2_;
   Rotator* rot_left2_;
   Rotator* rot_right2_;
-  const double* history2_;
+  const float* history2_;
   std::vector<std::vector<double>> thread_outputs_;
   std::atomic<size_t> next_task_{0};
 };
 
 template <typename In>
 void Process(In& input_stream, In& input_stream2, double* error) {
-  std::vector<double> history(input_stream.channels() * kHistorySize);
+  std::vector<float> history(input_stream.channels() * kHistorySize);
   std::vector<double> input(input_stream.channels() * kBlockSize);
 
   std::vector<Rotator> rot_left, rot_right;
@@ -196,7 +201,7 @@ void Process(In& input_stream, In& input_stream2, double* error) {
     rot_left.emplace_back(frequency, input_stream.samplerate());
     rot_right.emplace_back(frequency, input_stream.samplerate());
   }
-  std::vector<double> history2(input_stream2.channels() * kHistorySize);
+  std::vector<float> history2(input_stream2.channels() * kHistorySize);
   std::vector<double> input2(input_stream2.channels() * kBlockSize);
 
   std::vector<Rotator> rot_left2, rot_right2;
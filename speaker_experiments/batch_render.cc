@@ -0,0 +1,116 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Filters many short clips through the identity rotator bank at once, with
+// the clips side by side in the channels of one bank.
+//
+// Usage: batch_render <output_dir> <input.wav>...
+//
+// All inputs must have the same sample rate and channel count. Each output
+// has the file name of its input and is written as 24-bit PCM.
+
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "clip_batch.h"
+#include "fourier_bank.h"
+#include "sndfile.hh"
+
+ABSL_FLAG(int, slots, 16, "Number of clips that are filtered side by side.");
+ABSL_FLAG(int, num_threads, 1,
+          "Number of threads that filter groups of the slots in parallel.");
+ABSL_FLAG(double, gain, 1.0, "Global volume scaling.");
+
+namespace tabuli {
+namespace {
+
+std::string BaseName(const std::string &path) {
+  const size_t slash = path.find_last_of('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+int Run(int argc, char **argv) {
+  QCHECK_GE(argc, 3) << "Usage: " << argv[0]
+                     << " <output_dir> <input.wav>...";
+  const std::string output_dir = argv[1];
+  std::vector<std::string> paths(argv + 2, argv + argc);
+
+  size_t samplerate = 0;
+  size_t num_channels = 0;
+  std::vector<std::vector<float>> clips;
+  for (const std::string &path : paths) {
+    SndfileHandle input_file(path);
+    QCHECK(input_file) << path << ": " << input_file.strError();
+    if (clips.empty()) {
+      samplerate = input_file.samplerate();
+      num_channels = input_file.channels();
+    }
+    QCHECK_EQ(input_file.samplerate(), samplerate) << path;
+    QCHECK_EQ(input_file.channels(), num_channels) << path;
+    clips.emplace_back(num_channels * input_file.frames());
+    QCHECK_EQ(input_file.readf(clips.back().data(), input_file.frames()),
+              input_file.frames())
+        << path;
+  }
+
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  ClipBatcher batcher(absl::GetFlag(FLAGS_slots), num_channels, samplerate,
+                      absl::GetFlag(FLAGS_num_threads), filter_gains,
+                      absl::GetFlag(FLAGS_gain));
+  int64_t clip_frames = 0;
+  for (std::vector<float> &clip : clips) {
+    clip_frames += clip.size() / num_channels;
+    batcher.Add(std::move(clip));
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const std::vector<std::vector<float>> outputs = batcher.Run();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  fprintf(stderr,
+          "Filtered %zu clips of %.1f s in %.2f s, %.1fx real time, with "
+          "%.0f%% of the slot time in use\n",
+          paths.size(), static_cast<double>(clip_frames) / samplerate,
+          seconds, clip_frames / (seconds * samplerate),
+          100.0 * clip_frames /
+              (static_cast<double>(batcher.frames_filtered()) *
+               absl::GetFlag(FLAGS_slots)));
+
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const std::string path = output_dir + "/" + BaseName(paths[i]);
+    SndfileHandle output_file(path, /*mode=*/SFM_WRITE,
+                              /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
+                              num_channels, samplerate);
+    QCHECK(output_file) << path << ": " << output_file.strError();
+    output_file.writef(outputs[i].data(), outputs[i].size() / num_channels);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  std::vector<char *> posargs = absl::ParseCommandLine(argc, argv);
+  return tabuli::Run(posargs.size(), posargs.data());
+}
@@ -0,0 +1,149 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "clip_batch.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+ClipBatcher::ClipBatcher(size_t num_slots, size_t num_channels,
+                         size_t samplerate, size_t num_threads,
+                         const std::vector<float> &filter_gains,
+                         float global_gain)
+    : num_slots_(num_slots),
+      num_channels_(num_channels),
+      bank_(kNumRotators, num_slots * num_channels, samplerate, num_threads,
+            filter_gains, global_gain),
+      slots_(num_slots) {
+  QCHECK_GT(num_slots, 0);
+  QCHECK_GT(num_channels, 0);
+}
+
+size_t ClipBatcher::Add(std::vector<float> clip) {
+  QCHECK_EQ(clip.size() % num_channels_, 0);
+  clips_.push_back(std::move(clip));
+  return clips_.size() - 1;
+}
+
+void ClipBatcher::Start(size_t s, size_t clip) {
+  // A cleared channel with all its rotators idle, as after long silence.
+  PerChannel cleared;
+  std::fill(cleared.idle, cleared.idle + kNumRotators, true);
+  for (size_t c = 0; c < num_channels_; ++c) {
+    bank_.rotators_->channel[s * num_channels_ + c] = cleared;
+  }
+  slots_[s] = {/*busy=*/true, clip, total_in_};
+}
+
+std::vector<std::vector<float>> ClipBatcher::Run() {
+  const size_t bank_channels = num_slots_ * num_channels_;
+  const int64_t max_delay = bank_.max_delay_;
+  std::vector<std::vector<float>> outputs(clips_.size());
+  auto frames = [&](size_t clip) {
+    return static_cast<int64_t>(clips_[clip].size() / num_channels_);
+  };
+  // Longest first, so that the last clips to finish are short ones and the
+  // slots stay busy until the end.
+  std::vector<size_t> queue(clips_.size());
+  std::iota(queue.begin(), queue.end(), 0);
+  std::stable_sort(queue.begin(), queue.end(), [&](size_t a, size_t b) {
+    return frames(a) > frames(b);
+  });
+  size_t next = 0;
+  for (size_t clip : queue) {
+    outputs[clip].resize(clips_[clip].size());
+  }
+
+  std::vector<float> history(bank_channels * (bank_.history_mask_ + 1));
+  std::vector<float> output(bank_channels * kBlockSize);
+  while (true) {
+    bool busy = false;
+    for (size_t s = 0; s < num_slots_; ++s) {
+      while (!slots_[s].busy && next < queue.size()) {
+        if (frames(queue[next]) == 0) {
+          ++next;
+          continue;
+        }
+        Start(s, queue[next++]);
+      }
+      busy |= slots_[s].busy;
+    }
+    if (!busy) break;
+
+    // Slots change clips only between calls into the bank, so the block
+    // ends where the earliest slot has put out all of its clip.
+    int64_t len = kBlockSize;
+    for (const Slot &slot : slots_) {
+      if (!slot.busy) continue;
+      len = std::min(len, slot.start + frames(slot.clip) + max_delay -
+                              total_in_);
+    }
+    for (int64_t i = 0; i < len; ++i) {
+      const int64_t ix = total_in_ + i;
+      float *frame = &history[bank_channels * (ix & bank_.history_mask_)];
+      for (size_t s = 0; s < num_slots_; ++s) {
+        const Slot &slot = slots_[s];
+        const int64_t pos = ix - slot.start;
+        for (size_t c = 0; c < num_channels_; ++c) {
+          frame[s * num_channels_ + c] =
+              slot.busy && pos < frames(slot.clip)
+                  ? clips_[slot.clip][pos * num_channels_ + c]
+                  : 0.0f;
+        }
+      }
+    }
+    const int64_t out_len =
+        bank_.num_threads_ > 1
+            ? bank_.FilterAllChannelParallel(history.data(), total_in_, len,
+                                             output.data(), output.size())
+            : bank_.FilterAllSingleThreaded(history.data(), total_in_, len,
+                                            IDENTITY, output.data(),
+                                            output.size());
+    // Output frame i of this block is that of input frame first_out + i.
+    const int64_t first_out = total_in_ + len - out_len - max_delay;
+    for (size_t s = 0; s < num_slots_; ++s) {
+      const Slot &slot = slots_[s];
+      if (!slot.busy) continue;
+      const int64_t begin = std::max<int64_t>(0, slot.start - first_out);
+      const int64_t end =
+          std::min(out_len, slot.start + frames(slot.clip) - first_out);
+      std::vector<float> &clip_output = outputs[slot.clip];
+      for (int64_t i = begin; i < end; ++i) {
+        const int64_t pos = first_out + i - slot.start;
+        std::copy(&output[i * bank_channels + s * num_channels_],
+                  &output[i * bank_channels + (s + 1) * num_channels_],
+                  &clip_output[pos * num_channels_]);
+      }
+    }
+    total_in_ += len;
+    for (Slot &slot : slots_) {
+      if (slot.busy &&
+          total_in_ >= slot.start + frames(slot.clip) + max_delay) {
+        slot.busy = false;
+      }
+    }
+  }
+  clips_.clear();
+  return outputs;
+}
+
+}  // namespace tabuli
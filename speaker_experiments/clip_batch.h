@@ -0,0 +1,72 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_CLIP_BATCH_H
+#define _TABULI_CLIP_BATCH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+// Identity filtering of many independent clips with the same channel count
+// through one rotator bank. The bank has num_slots clips side by side as its
+// channels, so that the rotators load their coefficients and advance their
+// phases once per sample for all of them. A slot takes the next queued clip
+// as soon as the output of its previous one is complete.
+//
+// The output of a clip is that of a bank that filters it alone, up to the
+// rounding of the phases at which the clip starts.
+class ClipBatcher {
+ public:
+  ClipBatcher(size_t num_slots, size_t num_channels, size_t samplerate,
+              size_t num_threads, const std::vector<float> &filter_gains,
+              float global_gain);
+
+  // Queues a clip of interleaved frames, and returns its index in the
+  // result of Run().
+  size_t Add(std::vector<float> clip);
+
+  // Filters all queued clips, and returns the output of each with the delay
+  // of the bank removed, so that it has as many frames as the clip.
+  std::vector<std::vector<float>> Run();
+
+  // Frames that the bank has filtered, including the silence in free slots
+  // and after the end of each clip.
+  int64_t frames_filtered() const { return total_in_; }
+
+ private:
+  struct Slot {
+    bool busy = false;
+    size_t clip = 0;
+    // Input frame of the bank at which the clip starts.
+    int64_t start = 0;
+  };
+
+  // Puts the clip into slot s from the current frame on.
+  void Start(size_t s, size_t clip);
+
+  size_t num_slots_;
+  size_t num_channels_;
+  RotatorFilterBank bank_;
+  std::vector<std::vector<float>> clips_;
+  std::vector<Slot> slots_;
+  int64_t total_in_ = 0;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_CLIP_BATCH_H
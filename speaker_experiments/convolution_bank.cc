@@ -0,0 +1,249 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "convolution_bank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "denormals.h"
+#include "fftw3.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+namespace {
+
+// Every rotator's impulse response is cut when its envelope has decayed
+// this far below its peak.
+constexpr double kTailTolerance = 1e-6;
+
+// FFTW's planner keeps global state and is not thread-safe, while executing
+// distinct plans is. Banks of parallel segments make and destroy their plans
+// under this lock.
+std::mutex &PlannerMutex() {
+  static std::mutex *mutex = new std::mutex;
+  return *mutex;
+}
+
+}  // namespace
+
+ConvolutionResponse::ConvolutionResponse(
+    size_t num_rotators, size_t samplerate,
+    const std::vector<float> &filter_gains, float global_gain,
+    size_t partition_size) {
+  num_rotators_ = num_rotators;
+  partition_size_ = partition_size;
+  std::vector<float> freqs(num_rotators);
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (num_rotators_ - 1));
+  }
+  const Rotators rotators(0, freqs, filter_gains, samplerate, global_gain);
+  max_delay_ = rotators.max_delay_;
+  QCHECK_LE(max_delay_, kBlockSize);
+
+  std::vector<double> response;
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    const double w = rotators.window[i];
+    const double f = freqs[i] * 2.0 * M_PI / samplerate;
+    const std::complex<double> step(std::cos(f), std::sin(f));
+    // Peak of (j + 1) * (j + 2) / 2 * w^(j + 1).
+    const double peak_j = std::max(0.0, 2.0 / -std::log(w) - 1.5);
+    const double peak = (peak_j + 1) * (peak_j + 2) / 2 * std::pow(w, peak_j);
+    std::complex<double> carrier = step;
+    double decay = w;
+    for (int64_t j = 0;; ++j) {
+      const double envelope = (j + 1.0) * (j + 2.0) / 2 * decay;
+      if (j > peak_j && envelope < kTailTolerance * peak) break;
+      const size_t ix = rotators.advance[i] + j;
+      if (ix >= response.size()) response.resize(ix + 1);
+      response[ix] += rotators.gain[i] * carrier.real() * envelope;
+      carrier *= step;
+      decay *= w;
+    }
+  }
+  impulse_response_.assign(response.begin(), response.end());
+  num_partitions_ = (response.size() + partition_size_ - 1) / partition_size_;
+  fprintf(stderr, "Convolution bank: %zu taps in %zu partitions of %zu\n",
+          response.size(), num_partitions_, partition_size_);
+
+  const size_t fft_size = 2 * partition_size_;
+  const size_t num_bins = partition_size_ + 1;
+  float *fft_in = fftwf_alloc_real(fft_size);
+  fftwf_complex *fft_out = fftwf_alloc_complex(num_bins);
+  fftwf_plan forward;
+  {
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    forward = fftwf_plan_dft_r2c_1d(fft_size, fft_in, fft_out, FFTW_MEASURE);
+  }
+  partitions_.resize(num_partitions_ * num_bins);
+  const float scale = 1.0f / fft_size;
+  for (size_t p = 0; p < num_partitions_; ++p) {
+    std::fill(fft_in, fft_in + fft_size, 0.0f);
+    for (size_t k = 0; k < partition_size_; ++k) {
+      const size_t ix = p * partition_size_ + k;
+      if (ix < impulse_response_.size()) {
+        fft_in[k] = impulse_response_[ix] * scale;
+      }
+    }
+    fftwf_execute(forward);
+    const auto *spectrum = reinterpret_cast<std::complex<float> *>(fft_out);
+    std::copy(spectrum, spectrum + num_bins, &partitions_[p * num_bins]);
+  }
+  {
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    fftwf_destroy_plan(forward);
+  }
+  fftwf_free(fft_in);
+  fftwf_free(fft_out);
+}
+
+ConvolutionFilterBank::ConvolutionFilterBank(
+    std::shared_ptr<const ConvolutionResponse> response, size_t num_channels)
+    : response_(std::move(response)) {
+  num_channels_ = num_channels;
+  partition_size_ = response_->partition_size_;
+  max_delay_ = response_->max_delay_;
+  num_partitions_ = response_->num_partitions_;
+  history_mask_ =
+      HistorySize(std::max<int64_t>(max_delay_, 2 * partition_size_)) - 1;
+
+  const size_t fft_size = 2 * partition_size_;
+  const size_t num_bins = partition_size_ + 1;
+  fft_in_ = fftwf_alloc_real(fft_size);
+  fft_out_ = fftwf_alloc_complex(num_bins);
+  ifft_in_ = fftwf_alloc_complex(num_bins);
+  ifft_out_ = fftwf_alloc_real(fft_size);
+  {
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    forward_ =
+        fftwf_plan_dft_r2c_1d(fft_size, fft_in_, fft_out_, FFTW_MEASURE);
+    inverse_ =
+        fftwf_plan_dft_c2r_1d(fft_size, ifft_in_, ifft_out_, FFTW_MEASURE);
+  }
+  input_spectra_.resize(num_channels_ * num_partitions_ * num_bins);
+  block_output_.resize(num_channels_ * partition_size_);
+}
+
+ConvolutionFilterBank::~ConvolutionFilterBank() {
+  {
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    fftwf_destroy_plan(forward_);
+    fftwf_destroy_plan(inverse_);
+  }
+  fftwf_free(fft_in_);
+  fftwf_free(fft_out_);
+  fftwf_free(ifft_in_);
+  fftwf_free(ifft_out_);
+}
+
+void ConvolutionFilterBank::FilterBlock(const float *history,
+                                        int64_t block_start,
+                                        int64_t available_end) {
+  const int64_t block = block_start / partition_size_;
+  const size_t num_bins = partition_size_ + 1;
+  const size_t newest = block % num_partitions_;
+  for (size_t c = 0; c < num_channels_; ++c) {
+    // Overlap-save: transform the previous and the current block.
+    for (size_t k = 0; k < 2 * partition_size_; ++k) {
+      const int64_t ix = block_start - partition_size_ + k;
+      fft_in_[k] = ix >= 0 && ix < available_end
+                       ? history[num_channels_ * (ix & history_mask_) + c]
+                       : 0.0f;
+    }
+    fftwf_execute(forward_);
+    const auto *spectrum = reinterpret_cast<std::complex<float> *>(fft_out_);
+    std::complex<float> *spectra =
+        &input_spectra_[c * num_partitions_ * num_bins];
+    std::copy(spectrum, spectrum + num_bins, &spectra[newest * num_bins]);
+
+    auto *accu = reinterpret_cast<std::complex<float> *>(ifft_in_);
+    std::fill(accu, accu + num_bins, 0.0f);
+    for (int64_t p = 0; p < num_partitions_ && p <= block; ++p) {
+      const std::complex<float> *h = &response_->partitions_[p * num_bins];
+      const std::complex<float> *x =
+          &spectra[(block - p) % num_partitions_ * num_bins];
+      for (size_t k = 0; k < num_bins; ++k) {
+        accu[k] += h[k] * x[k];
+      }
+    }
+    fftwf_execute(inverse_);
+    std::copy(ifft_out_ + partition_size_, ifft_out_ + 2 * partition_size_,
+              &block_output_[c * partition_size_]);
+  }
+}
+
+int64_t ConvolutionFilterBank::FilterAll(const float *history,
+                                         int64_t total_in, int64_t len,
+                                         float *output, size_t output_size) {
+  ScopedFlushDenormals flush_denormals;
+  const int64_t end = total_in + len;
+  size_t out_ix = 0;
+  for (int64_t start = total_in - total_in % partition_size_; start < end;
+       start += partition_size_) {
+    // An incomplete block is filtered with the missing input as zeros, which
+    // is exact for the samples that are already there, and is filtered
+    // again once the rest of the block has arrived.
+    FilterBlock(history, start, end);
+    for (int64_t n = std::max(start, total_in);
+         n < std::min<int64_t>(start + partition_size_, end); ++n) {
+      if (n < max_delay_) continue;
+      for (size_t c = 0; c < num_channels_; ++c) {
+        output[out_ix * num_channels_ + c] =
+            HardClip(block_output_[c * partition_size_ + n - start]);
+      }
+      ++out_ix;
+    }
+  }
+  return out_ix;
+}
+
+double ConvolutionResponse::ImpulseResponseError(
+    size_t samplerate, const std::vector<float> &filter_gains,
+    float global_gain) const {
+  RotatorFilterBank rotbank(num_rotators_, 1, samplerate, /*num_threads=*/1,
+                            filter_gains, global_gain);
+  std::vector<float> history(rotbank.history_mask_ + 1);
+  std::vector<float> output(kBlockSize);
+  const int64_t len = impulse_response_.size();
+  double error = 0;
+  double norm = 0;
+  int64_t total_out = 0;
+  for (int64_t total_in = 0; total_in < len; total_in += kBlockSize) {
+    const int64_t block = std::min(kBlockSize, len - total_in);
+    for (int64_t ix = total_in; ix < total_in + block; ++ix) {
+      history[ix & rotbank.history_mask_] = ix == 0 ? 1.0f : 0.0f;
+    }
+    const int64_t output_len = rotbank.FilterAllSingleThreaded(
+        history.data(), total_in, block, IDENTITY, output.data(),
+        output.size());
+    for (int64_t i = 0; i < output_len; ++i) {
+      const double expected = impulse_response_[total_out + i + max_delay_];
+      error += (output[i] - expected) * (output[i] - expected);
+      norm += expected * expected;
+    }
+    total_out += output_len;
+  }
+  return std::sqrt(error / norm);
+}
+
+}  // namespace tabuli
@@ -0,0 +1,108 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_CONVOLUTION_BANK_H
+#define _TABULI_CONVOLUTION_BANK_H
+
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "fftw3.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+// In IDENTITY mode the rotator bank is linear and time invariant up to the
+// final HardClip: rotator i turns an impulse into
+//
+//   gain[i] * cos(f[i] * (j + 1)) * window[i]^(j + 1) * (j + 1) * (j + 2) / 2
+//
+// at j = n - advance[i] samples after it enters. This engine sums these
+// responses once and applies them with uniformly partitioned overlap-save
+// FFT convolution, which replaces 128 rotator updates per sample and channel
+// with a few complex multiply-adds per partition.
+//
+// The impulse response is truncated where every rotator has decayed below
+// kTailTolerance of its peak.
+//
+// The response and its partition spectra only depend on the parameters of
+// the bank, so ConvolutionResponse computes them once and any number of
+// banks, e.g. one per time segment, share them.
+struct ConvolutionResponse {
+  ConvolutionResponse(size_t num_rotators, size_t samplerate,
+                      const std::vector<float> &filter_gains,
+                      float global_gain, size_t partition_size = 2048);
+
+  // Runs an impulse through RotatorFilterBank::FilterAllSingleThreaded and
+  // returns the RMS difference to the derived impulse response, relative to
+  // the RMS of the response.
+  double ImpulseResponseError(size_t samplerate,
+                              const std::vector<float> &filter_gains,
+                              float global_gain) const;
+
+  size_t num_rotators_;
+  size_t partition_size_;
+  int64_t max_delay_;
+  std::vector<float> impulse_response_;
+  size_t num_partitions_;
+  // Spectra of the impulse response partitions, (partition_size_ + 1) bins
+  // each, already scaled by 1 / (2 * partition_size_).
+  std::vector<std::complex<float>> partitions_;
+};
+
+struct ConvolutionFilterBank {
+  ConvolutionFilterBank(std::shared_ptr<const ConvolutionResponse> response,
+                        size_t num_channels);
+  ~ConvolutionFilterBank();
+  ConvolutionFilterBank(const ConvolutionFilterBank &) = delete;
+  ConvolutionFilterBank &operator=(const ConvolutionFilterBank &) = delete;
+
+  // Same contract as RotatorFilterBank::FilterAllSingleThreaded in IDENTITY
+  // mode.
+  int64_t FilterAll(const float *history, int64_t total_in, int64_t len,
+                    float *output, size_t output_size);
+
+  size_t num_channels_;
+  size_t partition_size_;
+  int64_t max_delay_;
+  // Mask of the frame index in the input history, which also holds the
+  // partition before a block.
+  int64_t history_mask_;
+
+ private:
+  // Computes block_output_ for the partition_size_ samples from
+  // block_start, treating input from available_end on as zeros.
+  void FilterBlock(const float *history, int64_t block_start,
+                   int64_t available_end);
+
+  std::shared_ptr<const ConvolutionResponse> response_;
+  size_t num_partitions_;
+  // Frequency-domain delay line of input spectra, [channel][block][bin],
+  // where the spectrum of block b is kept at b % num_partitions_.
+  std::vector<std::complex<float>> input_spectra_;
+  // Time-domain output of the most recent block: [channel][sample].
+  std::vector<float> block_output_;
+  float *fft_in_;
+  fftwf_complex *fft_out_;
+  fftwf_complex *ifft_in_;
+  float *ifft_out_;
+  fftwf_plan forward_;
+  fftwf_plan inverse_;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_CONVOLUTION_BANK_H
@@ -0,0 +1,225 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "emphasizer_engine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <future>  // NOLINT
+#include <vector>
+
+#include "denormals.h"
+
+namespace tabuli {
+namespace emphasizer {
+
+namespace {
+
+double FindMedian3xLeaker(double window) {
+  return static_cast<int>(-2.32 / log(window));  // Approximate filter delay.
+}
+
+double CalcReverbRatio(double frequency) {
+  if (frequency < 500) {
+    return 0;  // no low frequency reverb
+  }
+  if (frequency < 1000) {
+    return (frequency - 500.0) / 500.0;  // ramp up to full reverb at 1 kHz
+  }
+  if (frequency < 1500) {
+    return 1.0;  // full
+  }
+  if (frequency < 2500) {
+    return 1.0 - 0.5 * fabs(frequency - 2000) / 500;  // dip here for 'notch'
+  }
+  if (frequency < 4000) {
+    return 1.0;  // full
+  }
+  if (frequency < 6000) {
+    return 0.1 + 0.9 * (6000 - frequency) / 2000;  // slope down 4 kHz to 6 kHz
+  }
+  if (frequency < 10000) {
+    return 0.1 * (10000 - frequency) / 4000;  // slope down 6 kHz to 10 kHz
+  }
+  return 0;
+}
+
+}  // namespace
+
+Rotator::Rotator(double frequency, const double sample_rate) {
+  window = pow(window, std::max(1.0, frequency / 40.0));
+  windowD = pow(windowD, std::max(1.0, frequency / 2000.0));
+  advance = 40000 - FindMedian3xLeaker(window);
+  if (advance < 1) {
+    advance = 1;
+  }
+  if (advance >= 0xfff0) {
+    advance = 0xfff0;
+  }
+  windowM1 = 1.0 - window;
+  windowDM1 = 1.0 - windowD;
+  frequency *= 2 * M_PI / sample_rate;
+  exp_mia = {std::cos(frequency), -std::sin(frequency)};
+  reverb_ratio = CalcReverbRatio(frequency);
+}
+
+void Rotator::Restart() {
+  rot[0] = {1, 0};
+  std::fill(rot + 1, rot + 5, 0);
+  ix = 0;
+}
+
+void Rotator::Increment(double audio) {
+  audio *= 0.01;
+  rot[0] *= exp_mia;
+  rot[1] *= window;
+  rot[2] *= window;
+  rot[3] *= window;
+  rot[4] *= windowD;
+
+  rot[1] += windowM1 * audio * rot[0];
+  rot[2] += windowM1 * rot[1];
+  rot[3] += windowM1 * rot[2];
+  rot[4] += windowDM1 * sqrt(std::norm(rot[3]));
+  ix++;
+}
+
+void Rotator::GetSample(double* v) {
+  double excess = (1.0 * sqrt(std::norm(rot[4]))) - sqrt((std::norm(rot[3])));
+  if (excess < 0) {
+    excess = 0;
+  }
+  float ratio_to_excess_init =
+      -excess / (sqrt(std::norm(rot[3])) + sqrt(std::norm(rot[4])) + 1e-8);
+
+  float ratio_to_excess = exp(8 * ratio_to_excess_init);  // most dry sound
+  float ratio_to_excess2 = exp(2 * ratio_to_excess_init);  // slightly less dry
+  if (ratio_to_excess < 0) {
+    ratio_to_excess = 0;
+  }
+  if (ratio_to_excess >= 1) {
+    ratio_to_excess = 1;
+  }
+  if (ratio_to_excess2 < 0) {
+    ratio_to_excess2 = 0;
+  }
+  if (ratio_to_excess2 >= 1) {
+    ratio_to_excess2 = 1;
+  }
+  double val = rot[0].real() * rot[3].real() + rot[0].imag() * rot[3].imag();
+
+  v[0] = ratio_to_excess * val;
+  v[1] = (ratio_to_excess2 - ratio_to_excess) * val;
+  v[2] = (1.0 - ratio_to_excess2) * val;
+
+  // Bring some of reverbed sound from v[1] and v[2] back to non-reverbed
+  // v[0] depending on the reverb_ratio.
+  v[0] += (1.0 - reverb_ratio) * (v[1] + v[2]);
+  v[1] *= reverb_ratio;
+  v[2] *= reverb_ratio;
+}
+
+double BarkFreq(double v) {
+  // should be larger for human hearing, around 0.165, but bass quality seems to
+  // suffer
+  constexpr double linlogsplit = 0.1;
+  if (v < linlogsplit) {
+    return 20.0 + (v / linlogsplit) * 20.0;  // Linear 20-40 Hz.
+  } else {
+    float normalized_v = (v - linlogsplit) * (1.0 / (1.0 - linlogsplit));
+    return 40.0 * pow(500.0, normalized_v);  // Logarithmic 40-20000 Hz.
+  }
+}
+
+TaskExecutor::TaskExecutor(size_t num_threads, size_t output_channels)
+    : thread_outputs_(num_threads) {
+  output_channels_ = output_channels;
+  for (std::vector<double>& output : thread_outputs_) {
+    output.resize(output_channels * kBlockSize, 0.f);
+  }
+}
+
+void TaskExecutor::Execute(size_t num_tasks, size_t read, size_t total,
+                           const float* history, Rotator* rot_left,
+                           Rotator* rot_right) {
+  read_ = read;
+  total_ = total;
+  history_ = history;
+  rot_left_ = rot_left;
+  rot_right_ = rot_right;
+  num_tasks_ = num_tasks;
+  next_task_ = 0;
+  std::vector<std::future<void>> futures;
+  size_t num_threads = thread_outputs_.size();
+  futures.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    futures.push_back(
+        std::async(std::launch::async, &TaskExecutor::Run, this, i));
+  }
+  for (size_t i = 0; i < num_threads; ++i) futures[i].get();
+}
+
+void TaskExecutor::Run(size_t thread) {
+  tabuli::ScopedFlushDenormals flush_denormals;
+  while (true) {
+    size_t my_task = next_task_++;
+    if (my_task >= num_tasks_) return;
+    std::vector<double>& thread_output = thread_outputs_[thread];
+    for (int i = 0; i < read_; ++i) {
+      int delayed_ix = total_ + i - rot_left_[my_task].advance;
+      float delayed_r = history_[2 * (delayed_ix & kHistoryMask) + 0];
+      float delayed_g = history_[2 * (delayed_ix & kHistoryMask) + 1];
+
+      rot_left_[my_task].Increment(delayed_r);
+      rot_right_[my_task].Increment(delayed_g);
+      double left[3] = {0};
+      double right[3] = {0};
+      rot_left_[my_task].GetSample(&left[0]);
+      rot_right_[my_task].GetSample(&right[0]);
+
+      thread_output[i * output_channels_ + 0] += left[0];
+      thread_output[i * output_channels_ + 1] += right[0];
+      thread_output[i * output_channels_ + 2] += left[1];
+      thread_output[i * output_channels_ + 3] += right[1];
+      thread_output[i * output_channels_ + 4] += left[2];
+      thread_output[i * output_channels_ + 5] += right[2];
+    }
+  }
+}
+
+Engine::Engine(size_t samplerate, int output_channels, size_t num_threads)
+    : history_(2 * kHistorySize),
+      input_(2 * kBlockSize),
+      output_(output_channels * kBlockSize),
+      pool_(num_threads, output_channels) {
+  rot_left_.reserve(kNumRotators);
+  rot_right_.reserve(kNumRotators);
+  for (int i = 0; i < kNumRotators; ++i) {
+    const double frequency =
+        BarkFreq(static_cast<double>(i) / (kNumRotators - 1));
+    rot_left_.emplace_back(frequency, samplerate);
+    rot_right_.emplace_back(frequency, samplerate);
+  }
+}
+
+void Engine::Restart() {
+  std::fill(history_.begin(), history_.end(), 0.0f);
+  for (Rotator& rot : rot_left_) rot.Restart();
+  for (Rotator& rot : rot_right_) rot.Restart();
+}
+
+}  // namespace emphasizer
+}  // namespace tabuli
@@ -0,0 +1,155 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The renderer of emphasizer: a bank of rotators splits each channel of a
+// stereo input into frequency bands, and each band into its dry and its
+// reverberant parts by how its envelope follows its level.
+
+#ifndef _TABULI_EMPHASIZER_ENGINE_H
+#define _TABULI_EMPHASIZER_ENGINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <complex>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "trace.h"
+
+namespace tabuli {
+namespace emphasizer {
+
+constexpr int64_t kNumRotators = 128;
+
+static constexpr int64_t kBlockSize = 32768;
+// The advance of the rotators is at most 0xfff0, so the ring only has to
+// hold that much look-back behind the block being filtered.
+static const int kHistorySize = (1 << 17);
+static const int kHistoryMask = kHistorySize - 1;
+static_assert(0xfff0 + kBlockSize <= kHistorySize);
+
+struct Rotator {
+  std::complex<double> rot[5] = {{1, 0}, 0};
+  double window = 0.9996;  // at 40 Hz.
+  double windowM1 = 1 - window;
+  double windowD = 0.99995;
+  double windowDM1 = 1 - windowD;
+  std::complex<double> exp_mia;
+  int ix = 0;
+  double advance = 0;
+  double reverb_ratio = 0;
+
+  Rotator(double frequency, const double sample_rate);
+
+  // Clears the state, as before the first input.
+  void Restart();
+
+  void Increment(double audio);
+  void GetSample(double* v);
+  double SquaredAmplitude() const { return std::norm(rot[3]); }
+};
+
+double BarkFreq(double v);
+
+class TaskExecutor {
+ public:
+  TaskExecutor(size_t num_threads, size_t output_channels);
+
+  void Execute(size_t num_tasks, size_t read, size_t total,
+               const float* history, Rotator* rot_left, Rotator* rot_right);
+
+  void Run(size_t thread);
+
+  int64_t read_;
+  int64_t total_;
+  size_t num_tasks_;
+  size_t output_channels_;
+  Rotator* rot_left_;
+  Rotator* rot_right_;
+  const float* history_;
+  std::vector<std::vector<double>> thread_outputs_;
+  std::atomic<size_t> next_task_{0};
+};
+
+// The rotators of both channels at a sample rate, and the buffers of their
+// input and output, which a job reuses from the previous one after Restart.
+class Engine {
+ public:
+  Engine(size_t samplerate, int output_channels, size_t num_threads);
+
+  void Restart();
+
+  template <typename In, typename Out>
+  void Process(
+      In& input_stream, Out& output_stream,
+      const std::function<void()>& start_progress = [] {},
+      const std::function<void(int64_t)>& set_progress = [](int64_t written) {
+      }) {
+    start_progress();
+    int64_t total = 0;
+    for (;;) {
+      int64_t read;
+      {
+        tabuli::ScopedStage stage(tabuli::kStageRead);
+        read = input_stream.readf(input_.data(), kBlockSize);
+      }
+      {
+        tabuli::ScopedStage stage(tabuli::kStageHistory);
+        for (int i = 0; i < read; ++i) {
+          int input_ix = i + total;
+          history_[2 * (input_ix & kHistoryMask) + 0] = input_[2 * i];
+          history_[2 * (input_ix & kHistoryMask) + 1] = input_[2 * i + 1];
+        }
+      }
+      if (read == 0) break;
+
+      {
+        tabuli::ScopedStage stage(tabuli::kStageFilter);
+        pool_.Execute(kNumRotators, read, total, history_.data(),
+                      rot_left_.data(), rot_right_.data());
+      }
+
+      {
+        tabuli::ScopedStage stage(tabuli::kStageMix);
+        std::fill(output_.begin(), output_.end(), 0);
+        for (std::vector<double>& thread_output : pool_.thread_outputs_) {
+          for (int i = 0; i < output_.size(); ++i) {
+            output_[i] += thread_output[i];
+            thread_output[i] = 0.f;
+          }
+        }
+      }
+      {
+        tabuli::ScopedStage stage(tabuli::kStageWrite);
+        output_stream.writef(output_.data(), read);
+      }
+      total += read;
+      set_progress(total);
+    }
+  }
+
+ private:
+  std::vector<float> history_;
+  std::vector<double> input_;
+  std::vector<double> output_;
+  std::vector<Rotator> rot_left_;
+  std::vector<Rotator> rot_right_;
+  TaskExecutor pool_;
+};
+
+}  // namespace emphasizer
+}  // namespace tabuli
+
+#endif  // _TABULI_EMPHASIZER_ENGINE_H
@@ -0,0 +1,264 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Derives the coefficients of the fixed-point rotator bank of the piccolo
+// target from the float bank, and compares the two on test signals.
+//
+// Usage: fixed_rotators_check [<input.wav>] [--emit_params=<header>]
+//
+// Without an input, runs noise, a sine sweep and a quiet passage that
+// exercises the block floating state. Fails if the SNR of the fixed-point
+// output against the float output is below --min_snr.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "fixed_rotators.h"
+#include "fourier_bank.h"
+#include "sndfile.hh"
+
+ABSL_FLAG(int, samplerate, 48000,
+          "Sample rate of the generated signals and the emitted params.");
+ABSL_FLAG(double, min_snr, 60, "Lowest accepted SNR in dB.");
+ABSL_FLAG(std::string, emit_params, "",
+          "If set, writes the coefficients as a C header for the target.");
+
+namespace tabuli {
+namespace {
+
+// Splits v into a mantissa in [2^14, 2^15) and the shift of v * 2^15 against
+// it, so that v = mantissa * 2^-(15 + shift). When v rounds up to 2^-shift,
+// the mantissa is halved to 2^14 and the shift is one lower, which is -1 for
+// v just below 1.
+void Normalize(double v, int16_t *mantissa, int *shift) {
+  QCHECK(v > 0 && v < 1) << v;
+  *shift = 0;
+  while (v * (int64_t{1} << *shift) < 0.5) ++*shift;
+  const int64_t rounded = std::llround(v * (int64_t{1} << (15 + *shift)));
+  if (rounded == int64_t{1} << 15) {
+    *mantissa = 1 << 14;
+    --*shift;
+  } else {
+    *mantissa = rounded;
+  }
+}
+
+// Checks Normalize on the edges of the mantissa range, including values that
+// round up to the next power of two.
+void CheckNormalize() {
+  struct Case {
+    double v;
+    int16_t mantissa;
+    int shift;
+  };
+  const Case cases[] = {
+      {0.5, 1 << 14, 0},
+      {0.75, 3 << 13, 0},
+      {0.25, 1 << 14, 1},
+      {std::ldexp(0x7fff, -15), 0x7fff, 0},
+      {std::ldexp(0x7fff, -20), 0x7fff, 5},
+      {1 - std::ldexp(1, -17), 1 << 14, -1},
+      {(1 - std::ldexp(1, -17)) / 8, 1 << 14, 2},
+      {std::ldexp(3, -12), 3 << 13, 10},
+  };
+  for (const Case &c : cases) {
+    int16_t mantissa;
+    int shift;
+    Normalize(c.v, &mantissa, &shift);
+    QCHECK(mantissa == c.mantissa && shift == c.shift)
+        << c.v << ": " << mantissa << " * 2^-(15 + " << shift << "), expected "
+        << c.mantissa << " * 2^-(15 + " << c.shift << ")";
+  }
+}
+
+std::vector<FixedRotatorParams> ComputeParams(
+    size_t samplerate, const std::vector<float> &filter_gains) {
+  std::vector<float> freqs(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
+  }
+  const Rotators rotators(0, freqs, filter_gains, samplerate, 1.0f);
+  QCHECK_LT(rotators.max_delay_, FIXED_ROTATORS_HISTORY);
+  std::vector<FixedRotatorParams> params(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    FixedRotatorParams &p = params[i];
+    p.phase_step = std::llround(static_cast<double>(freqs[i]) / samplerate *
+                                4294967296.0);
+    int shift;
+    Normalize(1.0 - rotators.window[i], &p.leak, &shift);
+    QCHECK_GE(shift, 0);
+    p.leak_shift = shift;
+    p.advance = rotators.advance[i];
+    // The filter gain as adapted to the sample rate. It is below 8, so that
+    // the output stays within 2^30.
+    const double gain =
+        rotators.gain[i] / std::pow(1.0 - rotators.window[i], 3.0);
+    if (gain == 0) continue;  // Above the Nyquist frequency.
+    QCHECK(gain > 0 && gain < 8) << gain;
+    int gain_shift = 0;
+    while (gain >= (1 << gain_shift)) ++gain_shift;
+    Normalize(gain / (1 << gain_shift), &p.gain, &shift);
+    if (shift > gain_shift) {
+      // The target only shifts the gain left, so a gain below 1/2 keeps a
+      // mantissa below 2^14.
+      p.gain = std::lround(gain * (1 << 15));
+      shift = gain_shift;
+    }
+    p.gain_shift = gain_shift - shift;
+  }
+  return params;
+}
+
+void EmitParams(const std::string &path, size_t samplerate,
+                const std::vector<FixedRotatorParams> &params) {
+  FILE *f = fopen(path.c_str(), "w");
+  QCHECK(f) << "Cannot write " << path;
+  fprintf(f,
+          "// Generated by fixed_rotators_check for %zu Hz.\n"
+          "#include \"fixed_rotators.h\"\n\n"
+          "static const FixedRotatorParams kFixedRotatorParams[%d] = {\n",
+          samplerate, FIXED_ROTATORS_NUM);
+  for (const FixedRotatorParams &p : params) {
+    fprintf(f, "    {%uu, %d, %d, %d, %d, %d},\n", p.phase_step, p.leak,
+            p.leak_shift, p.gain, p.gain_shift, p.advance);
+  }
+  fprintf(f, "};\n");
+  fclose(f);
+}
+
+// Runs both banks over the input and returns the SNR of the fixed-point
+// output against the float output in dB.
+double CompareBanks(const std::vector<FixedRotatorParams> &params,
+                    const std::vector<float> &filter_gains, size_t samplerate,
+                    size_t num_channels, const std::vector<float> &input) {
+  QCHECK_LE(num_channels, FIXED_ROTATORS_MAX_CHANNELS);
+  const int64_t num_frames = input.size() / num_channels;
+  RotatorFilterBank rotbank(kNumRotators, num_channels, samplerate,
+                            /*num_threads=*/1, filter_gains,
+                            /*global_gain=*/1.0f);
+  std::vector<float> history(num_channels * (rotbank.history_mask_ + 1));
+  std::vector<float> expected;
+  std::vector<float> output(num_channels * kBlockSize);
+  // Run over trailing zeros too, so that both outputs cover all the input.
+  const int64_t total = num_frames + rotbank.max_delay_;
+  for (int64_t total_in = 0; total_in < total; total_in += kBlockSize) {
+    const int64_t len = std::min(kBlockSize, total - total_in);
+    for (int64_t i = 0; i < len; ++i) {
+      const int64_t ix = total_in + i;
+      for (size_t c = 0; c < num_channels; ++c) {
+        history[num_channels * (ix & rotbank.history_mask_) + c] =
+            ix < num_frames ? input[ix * num_channels + c] : 0.0f;
+      }
+    }
+    const int64_t output_len = rotbank.FilterAllSingleThreaded(
+        history.data(), total_in, len, IDENTITY, output.data(), output.size());
+    expected.insert(expected.end(), output.begin(),
+                    output.begin() + output_len * num_channels);
+  }
+
+  auto bank = std::make_unique<FixedRotators>();
+  fixed_rotators_init(bank.get(), params.data(), num_channels);
+  std::vector<int32_t> fixed_in(num_channels * total);
+  for (int64_t i = 0; i < num_frames * static_cast<int64_t>(num_channels);
+       ++i) {
+    fixed_in[i] = std::lround(std::clamp(input[i], -1.0f, 1.0f) * 8388607);
+  }
+  std::vector<int32_t> fixed_out(fixed_in.size());
+  fixed_rotators_process(bank.get(), fixed_in.data(), fixed_out.data(), total);
+
+  double signal = 0;
+  double noise = 0;
+  for (int64_t i = 0; i < num_frames * static_cast<int64_t>(num_channels);
+       ++i) {
+    const double want = expected[i];
+    const double got =
+        fixed_out[i + rotbank.max_delay_ * num_channels] / 8388608.0;
+    signal += want * want;
+    noise += (want - got) * (want - got);
+  }
+  return 10 * std::log10(signal / std::max(noise, 1e-30));
+}
+
+std::vector<float> Noise(size_t len, float amplitude) {
+  std::mt19937 rng(0);
+  std::normal_distribution<float> dist(0, amplitude);
+  std::vector<float> v(len);
+  for (float &x : v) x = dist(rng);
+  return v;
+}
+
+std::vector<float> Sweep(size_t len, size_t samplerate, float amplitude) {
+  std::vector<float> v(len);
+  double phase = 0;
+  for (size_t i = 0; i < len; ++i) {
+    const double f = 20.0 * std::pow(1000.0, static_cast<double>(i) / len);
+    phase += 2 * M_PI * f / samplerate;
+    v[i] = amplitude * std::sin(phase);
+  }
+  return v;
+}
+
+int Run(int argc, char **argv) {
+  CheckNormalize();
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  size_t samplerate = absl::GetFlag(FLAGS_samplerate);
+  std::vector<std::pair<std::string, std::vector<float>>> signals;
+  size_t num_channels = 1;
+  if (argc > 1) {
+    SndfileHandle input_file(argv[1]);
+    QCHECK(input_file) << input_file.strError();
+    samplerate = input_file.samplerate();
+    num_channels = input_file.channels();
+    std::vector<float> input(num_channels * input_file.frames());
+    input_file.readf(input.data(), input_file.frames());
+    signals.push_back({argv[1], std::move(input)});
+  } else {
+    signals.push_back({"noise -20 dB", Noise(2 * samplerate, 0.1f)});
+    signals.push_back({"noise -70 dB", Noise(2 * samplerate, 3e-4f)});
+    signals.push_back({"sweep -6 dB", Sweep(4 * samplerate, samplerate, 0.5f)});
+  }
+  const std::vector<FixedRotatorParams> params =
+      ComputeParams(samplerate, filter_gains);
+  if (!absl::GetFlag(FLAGS_emit_params).empty()) {
+    EmitParams(absl::GetFlag(FLAGS_emit_params), samplerate, params);
+  }
+  bool ok = true;
+  for (const auto &[name, input] : signals) {
+    const double snr = CompareBanks(params, filter_gains, samplerate,
+                                    num_channels, input);
+    fprintf(stdout, "%s: SNR %.2f dB\n", name.c_str(), snr);
+    ok &= snr >= absl::GetFlag(FLAGS_min_snr);
+  }
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  std::vector<char *> posargs = absl::ParseCommandLine(argc, argv);
+  return tabuli::Run(posargs.size(), posargs.data());
+}
@@ -14,10 +14,45 @@
 
 #include "absl/log/check.h"
 #include "absl/strings/str_split.h"
+#include "denormals.h"
 #include "sndfile.hh"
 
 namespace tabuli {
 
+namespace {
+
+// Number of samples between the checks for idle rotators.
+constexpr int64_t kActivityBlock = 256;
+
+// Bytes of delayed input that are staged at once. Staging runs of frames
+// that overflow the L1 cache is slower than staging one frame at a time.
+constexpr size_t kStagedBytes = 16 << 10;
+
+int64_t StagedFrames(size_t num_channels) {
+  return std::max<size_t>(
+      1, kStagedBytes / (num_channels * kNumRotators * sizeof(float)));
+}
+
+// A rotator goes idle when its accumulators cannot produce more than this
+// output anymore, far below the resolution of 24-bit output.
+constexpr float kIdleLevel = 1e-10f;
+
+// last_nonzero_ before any input has been seen.
+constexpr int64_t kNoInput = -(int64_t{1} << 40);
+
+// Steps the leaking integrators of rotator k in accu, after its input has
+// been added.
+template <typename T, size_t N>
+inline void Leak(T (&accu)[6][N], int k, float w) {
+  for (int j = 0; j < 6; ++j) accu[j][k] *= w;
+  accu[2][k] += accu[0][k];
+  accu[3][k] += accu[1][k];
+  accu[4][k] += accu[2][k];
+  accu[5][k] += accu[3][k];
+}
+
+}  // namespace
+
 float GetRotatorGains(int i) {
   static const float kRotatorGains[kNumRotators] = {
       1.050645, 1.948438, 3.050339, 3.967913, 4.818584, 5.303335, 5.560281,
@@ -53,37 +88,201 @@ int Rotators::FindMedian3xLeaker(float window) {
   return static_cast<int>(kMagic / log(window) + kAlmostHalfForRounding);
 }
 
+namespace {
+
+// Response at hz of the identity output of a rotator with unit gain. It
+// contributes sum_m h[m] cos(f * (m + 1)) x[n - advance - m], where h is the
+// impulse response w / (1 - w z^-1)^3 of the leaking integrators.
+std::complex<double> RotatorResponse(double frequency, double window,
+                                     int advance, float sample_rate,
+                                     double hz) {
+  const double omega = 2 * M_PI * hz / sample_rate;
+  const double f = 2 * M_PI * frequency / sample_rate;
+  auto leaker = [&](double theta) {
+    const std::complex<double> d =
+        1.0 - window * std::exp(std::complex<double>(0, -theta));
+    return window / (d * d * d);
+  };
+  return std::exp(std::complex<double>(0, -omega * advance)) * 0.5 *
+         (std::exp(std::complex<double>(0, f)) * leaker(omega - f) +
+          std::exp(std::complex<double>(0, -f)) * leaker(omega + f));
+}
+
+}  // namespace
+
 Rotators::Rotators(int num_channels, std::vector<float> frequency,
                    std::vector<float> filter_gains, const float sample_rate,
-                   float global_gain) {
+                   float global_gain, int64_t max_delay,
+                   LatencyFit latency_fit) {
   channel.resize(num_channels);
+  bool over_budget = false;
+  const double rate_ratio = sample_rate / kReferenceSampleRate;
   for (int i = 0; i < kNumRotators; ++i) {
     // The parameter relates to the frequency shape overlap and window length
     // of triple leaking integrator.
     float kWindow = 0.9996;
     float w40Hz = std::pow(kWindow, 128.0 / kNumRotators);  // at 40 Hz.
-    window[i] = pow(w40Hz, std::max(1.0, frequency[i] / 40.0));
-    delay[i] = FindMedian3xLeaker(window[i]);
+    // Windows and delays are tuned at the reference rate, and keep their
+    // length in seconds at other rates.
+    const float reference_window =
+        pow(w40Hz, std::max(1.0, frequency[i] / 40.0));
+    window[i] = std::pow(reference_window, 1.0 / rate_ratio);
+    const int64_t median =
+        std::lround(FindMedian3xLeaker(reference_window) * rate_ratio);
+    QCHECK_LT(median, kBlockSize)
+        << "Sample rate " << sample_rate
+        << " is too high for the rotator delays, use a lower internal rate.";
+    delay[i] = median;
+    if (max_delay > 0 && delay[i] > max_delay) {
+      if (latency_fit == SHORTEN_WINDOW) {
+        // The delay is inversely proportional to the log of the window.
+        window[i] = std::pow(window[i],
+                             static_cast<double>(delay[i]) / max_delay);
+      }
+      delay[i] = max_delay;
+      over_budget = true;
+    }
     float windowM1 = 1.0f - window[i];
     max_delay_ = std::max(max_delay_, delay[i]);
     float f = frequency[i] * 2.0f * M_PI / sample_rate;
-    gain[i] = filter_gains[i] * global_gain * pow(windowM1, 3.0);
+    const float filter_gain =
+        frequency[i] < 0.5f * sample_rate ? filter_gains[i] : 0.0f;
+    gain[i] = filter_gain * global_gain * pow(windowM1, 3.0);
+    const double f_exact = frequency[i] * 2.0 * M_PI / sample_rate;
+    step[0][i] = std::cos(f_exact);
+    step[1][i] = -std::sin(f_exact);
     rot[0][i] = float(std::cos(f));
     rot[1][i] = float(-std::sin(f));
-    rot[2][i] = sqrt(gain[i]);
+    phase[0][i] = std::sqrt(static_cast<double>(gain[i]));
+    phase[1][i] = 0.0;
+    rot[2][i] = phase[0][i];
     rot[3][i] = 0.0f;
   }
   for (size_t i = 0; i < kNumRotators; ++i) {
     advance[i] = max_delay_ - delay[i];
   }
+  if (sample_rate != kReferenceSampleRate || over_budget) {
+    AdaptGains(frequency, filter_gains, sample_rate, global_gain);
+  }
+}
+
+void Rotators::AdaptGains(const std::vector<float> &frequency,
+                          const std::vector<float> &filter_gains,
+                          float sample_rate, float global_gain) {
+  const Rotators reference(0, frequency, filter_gains, kReferenceSampleRate,
+                           global_gain);
+  // response[j * kNumRotators + i] is the response of rotator i at the
+  // frequency of rotator j, for unit gain.
+  std::vector<std::complex<double>> response(kNumRotators * kNumRotators);
+  std::vector<double> target(kNumRotators);
+  for (int j = 0; j < kNumRotators; ++j) {
+    if (gain[j] == 0.0f) continue;
+    std::complex<double> reference_response = 0;
+    for (int i = 0; i < kNumRotators; ++i) {
+      reference_response +=
+          static_cast<double>(reference.gain[i]) *
+          RotatorResponse(frequency[i], reference.window[i],
+                          reference.advance[i], kReferenceSampleRate,
+                          frequency[j]);
+      if (gain[i] == 0.0f) continue;
+      response[j * kNumRotators + i] = RotatorResponse(
+          frequency[i], window[i], advance[i], sample_rate, frequency[j]);
+    }
+    target[j] = std::abs(reference_response);
+  }
+  std::vector<double> adapted(gain, gain + kNumRotators);
+  std::vector<double> scale(kNumRotators);
+  for (int iter = 0; iter < 100; ++iter) {
+    for (int j = 0; j < kNumRotators; ++j) {
+      if (adapted[j] == 0) continue;
+      std::complex<double> sum = 0;
+      for (int i = 0; i < kNumRotators; ++i) {
+        sum += adapted[i] * response[j * kNumRotators + i];
+      }
+      // Damped, as each gain also moves the response at its neighbours.
+      scale[j] = std::sqrt(target[j] / std::abs(sum));
+    }
+    for (int j = 0; j < kNumRotators; ++j) {
+      if (adapted[j] != 0) adapted[j] *= scale[j];
+    }
+  }
+  for (int i = 0; i < kNumRotators; ++i) {
+    gain[i] = adapted[i];
+    phase[0][i] = std::sqrt(static_cast<double>(gain[i]));
+    phase[1][i] = 0.0;
+    rot[2][i] = phase[0][i];
+    rot[3][i] = 0.0f;
+  }
+}
+
+std::vector<BandLatencyError> LatencyErrors(
+    size_t samplerate, const std::vector<float> &filter_gains,
+    int64_t max_delay, LatencyFit latency_fit) {
+  std::vector<float> freqs(kNumRotators);
+  for (int i = 0; i < kNumRotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
+  }
+  const Rotators unbounded(0, freqs, filter_gains, samplerate, 1.0f);
+  const Rotators bounded(0, freqs, filter_gains, samplerate, 1.0f, max_delay,
+                         latency_fit);
+  auto response = [&](const Rotators &rotators, double hz) {
+    std::complex<double> sum = 0;
+    for (int i = 0; i < kNumRotators; ++i) {
+      if (rotators.gain[i] == 0.0f) continue;
+      sum += static_cast<double>(rotators.gain[i]) *
+             RotatorResponse(freqs[i], rotators.window[i], rotators.advance[i],
+                             samplerate, hz);
+    }
+    // Takes out the output delay, which is a pure phase.
+    return sum * std::exp(std::complex<double>(
+                     0, 2 * M_PI * hz / samplerate * rotators.max_delay_));
+  };
+  std::vector<BandLatencyError> errors;
+  for (int i = 0; i < kNumRotators; ++i) {
+    if (unbounded.gain[i] == 0.0f) continue;
+    const std::complex<double> ratio =
+        response(bounded, freqs[i]) / response(unbounded, freqs[i]);
+    const int64_t late = latency_fit == CAP_ADVANCE
+                             ? unbounded.delay[i] - bounded.delay[i]
+                             : 0;
+    errors.push_back({freqs[i], unbounded.delay[i],
+                      static_cast<float>(20 * std::log10(std::abs(ratio))),
+                      static_cast<float>(std::arg(ratio) * 180 / M_PI), late});
+  }
+  return errors;
+}
+
+void Rotators::Clear() {
+  std::fill(channel.begin(), channel.end(), PerChannel());
+  for (int i = 0; i < kNumRotators; ++i) {
+    phase[0][i] = std::sqrt(static_cast<double>(gain[i]));
+    phase[1][i] = 0.0;
+    rot[2][i] = phase[0][i];
+    rot[3][i] = 0.0f;
+  }
+}
+
+void Rotators::RotatePhase(int i) {
+  const double tr = step[0][i] * phase[0][i] - step[1][i] * phase[1][i];
+  const double tc = step[0][i] * phase[1][i] + step[1][i] * phase[0][i];
+  phase[0][i] = tr;
+  phase[1][i] = tc;
+  rot[2][i] = tr;
+  rot[3][i] = tc;
 }
 
 void Rotators::Increment(int c, int i, float audio) {
-  if (c == 0) {
-    float tr = rot[0][i] * rot[2][i] - rot[1][i] * rot[3][i];
-    float tc = rot[0][i] * rot[3][i] + rot[1][i] * rot[2][i];
-    rot[2][i] = tr;
-    rot[3][i] = tc;
+  if (c == 0) RotatePhase(i);
+  if (i < kNumPreciseRotators) {
+    double(&a)[6][kNumPreciseRotators] = channel[c].precise_accu;
+    for (int j = 0; j < 6; ++j) a[j][i] *= window[i];
+    a[0][i] += static_cast<double>(rot[2][i]) * audio;
+    a[1][i] += static_cast<double>(rot[3][i]) * audio;
+    a[2][i] += a[0][i];
+    a[3][i] += a[1][i];
+    a[4][i] += a[2][i];
+    a[5][i] += a[3][i];
+    return;
   }
   channel[c].accu[0][i] *= window[i];
   channel[c].accu[1][i] *= window[i];
@@ -100,56 +299,99 @@ void Rotators::Increment(int c, int i, float audio) {
 }
 
 void Rotators::AddAudio(int c, int i, float audio) {
+  if (i < kNumPreciseRotators) {
+    channel[c].precise_accu[0][i] += static_cast<double>(rot[2][i]) * audio;
+    channel[c].precise_accu[1][i] += static_cast<double>(rot[3][i]) * audio;
+    return;
+  }
   channel[c].accu[0][i] += rot[2][i] * audio;
   channel[c].accu[1][i] += rot[3][i] * audio;
 }
+void Rotators::AddAudioAll(int c, const float *audio) {
+  PerChannel &ch = channel[c];
+  for (int i = 0; i < kNumPreciseRotators; ++i) {
+    ch.precise_accu[0][i] += static_cast<double>(rot[2][i]) * audio[i];
+    ch.precise_accu[1][i] += static_cast<double>(rot[3][i]) * audio[i];
+  }
+  for (int i = kNumPreciseRotators; i < kNumRotators; ++i) {
+    ch.accu[0][i] += rot[2][i] * audio[i];
+    ch.accu[1][i] += rot[3][i] * audio[i];
+  }
+}
 void Rotators::OccasionallyRenormalize() {
   for (int i = 0; i < kNumRotators; ++i) {
-    float norm =
-        sqrt(gain[i] / (rot[2][i] * rot[2][i] + rot[3][i] * rot[3][i]));
-    rot[2][i] *= norm;
-    rot[3][i] *= norm;
+    if (gain[i] == 0.0f) continue;  // Above the Nyquist frequency.
+    const double norm =
+        std::sqrt(gain[i] / (phase[0][i] * phase[0][i] +
+                             phase[1][i] * phase[1][i]));
+    phase[0][i] *= norm;
+    phase[1][i] *= norm;
+    rot[2][i] = phase[0][i];
+    rot[3][i] = phase[1][i];
   }
 }
 void Rotators::IncrementAll() {
   for (int i = 0; i < kNumRotators; i++) {
-    const float tr = rot[0][i] * rot[2][i] - rot[1][i] * rot[3][i];
-    const float tc = rot[0][i] * rot[3][i] + rot[1][i] * rot[2][i];
-    rot[2][i] = tr;
-    rot[3][i] = tc;
+    RotatePhase(i);
   }
   for (int c = 0; c < channel.size(); ++c) {
-    for (int i = 0; i < kNumRotators; i++) {
-      const float w = window[i];
-      channel[c].accu[0][i] *= w;
-      channel[c].accu[1][i] *= w;
-      channel[c].accu[2][i] *= w;
-      channel[c].accu[3][i] *= w;
-      channel[c].accu[4][i] *= w;
-      channel[c].accu[5][i] *= w;
-      channel[c].accu[2][i] += channel[c].accu[0][i];
-      channel[c].accu[3][i] += channel[c].accu[1][i];
-      channel[c].accu[4][i] += channel[c].accu[2][i];
-      channel[c].accu[5][i] += channel[c].accu[3][i];
+    for (int i = 0; i < kNumPreciseRotators; i++) {
+      Leak(channel[c].precise_accu, i, window[i]);
+    }
+    for (int i = kNumPreciseRotators; i < kNumRotators; i++) {
+      Leak(channel[c].accu, i, window[i]);
     }
   }
 }
 float Rotators::GetSampleAll(int c) {
+  const PerChannel &ch = channel[c];
+  double precise = 0;
+  for (int i = 0; i < kNumPreciseRotators; ++i) {
+    precise += rot[2][i] * ch.precise_accu[4][i] +
+               rot[3][i] * ch.precise_accu[5][i];
+  }
   float retval = 0;
-  for (int i = 0; i < kNumRotators; ++i) {
-    retval +=
-        (rot[2][i] * channel[c].accu[4][i] + rot[3][i] * channel[c].accu[5][i]);
+  for (int i = kNumPreciseRotators; i < kNumRotators; ++i) {
+    retval += (rot[2][i] * ch.accu[4][i] + rot[3][i] * ch.accu[5][i]);
   }
-  return retval;
+  return retval + precise;
 }
 float Rotators::GetSample(int c, int i, FilterMode mode) const {
-  return (
-      mode == IDENTITY ? (rot[2][i] * channel[c].accu[4][i] +
-                          rot[3][i] * channel[c].accu[5][i])
-      : mode == AMPLITUDE
-          ? std::sqrt(gain[i] * (channel[c].accu[4][i] * channel[c].accu[4][i] +
-                                 channel[c].accu[5][i] * channel[c].accu[5][i]))
-          : std::atan2(channel[c].accu[4][i], channel[c].accu[5][i]));
+  const double re = Accu(c, 4, i);
+  const double im = Accu(c, 5, i);
+  return (mode == IDENTITY    ? (rot[2][i] * re + rot[3][i] * im)
+          : mode == AMPLITUDE ? std::sqrt(gain[i] * (re * re + im * im))
+                              : std::atan2(re, im));
+}
+
+double Rotators::Accu(int c, int j, int i) const {
+  return i < kNumPreciseRotators ? channel[c].precise_accu[j][i]
+                                 : channel[c].accu[j][i];
+}
+
+void Rotators::AdvancePhase(int i, int64_t n) {
+  const std::complex<double> advanced =
+      std::complex<double>(phase[0][i], phase[1][i]) *
+      std::pow(std::complex<double>(step[0][i], step[1][i]), n);
+  phase[0][i] = advanced.real();
+  phase[1][i] = advanced.imag();
+  rot[2][i] = phase[0][i];
+  rot[3][i] = phase[1][i];
+}
+
+float Rotators::ResidualBound(int c, int i) const {
+  // Each integration stage amplifies what is fed into it by at most
+  // 1 / (1 - window).
+  auto a = [&](int j) { return std::abs(Accu(c, j, i)); };
+  const float m = 1.0f / (1.0f - window[i]);
+  return std::sqrt(gain[i]) *
+         (a(4) + a(5) + m * (a(2) + a(3) + m * (a(0) + a(1))));
+}
+
+int64_t HistorySize(int64_t look_back) {
+  int64_t size = 1;
+  while (size < look_back + kBlockSize) size *= 2;
+  return size;
 }
 
 float BarkFreq(float v) {
@@ -167,27 +409,50 @@ float HardClip(float v) { return std::max(-1.0f, std::min(1.0f, v)); }
 RotatorFilterBank::RotatorFilterBank(size_t num_rotators, size_t num_channels,
                                      size_t samplerate, size_t num_threads,
                                      const std::vector<float> &filter_gains,
-                                     float global_gain) {
+                                     float global_gain, int64_t max_delay,
+                                     LatencyFit latency_fit) {
   num_rotators_ = num_rotators;
   num_channels_ = num_channels;
   num_threads_ = num_threads;
-  std::vector<float> freqs(num_rotators);
+  samplerate_ = samplerate;
+  latency_budget_ = max_delay;
+  latency_fit_ = latency_fit;
+  frequencies_.resize(num_rotators);
   for (size_t i = 0; i < num_rotators_; ++i) {
-    freqs[i] = BarkFreq(static_cast<float>(i) / (num_rotators_ - 1));
-    // printf("%d %g\n", i, freqs[i]);
+    frequencies_[i] = BarkFreq(static_cast<float>(i) / (num_rotators_ - 1));
+    // printf("%d %g\n", i, frequencies_[i]);
   }
-  rotators_.reset(
-      new Rotators(num_channels, freqs, filter_gains, samplerate, global_gain));
+  rotators_.reset(new Rotators(num_channels, frequencies_, filter_gains,
+                               samplerate, global_gain, latency_budget_,
+                               latency_fit_));
 
   max_delay_ = rotators_->max_delay_;
   QCHECK_LE(max_delay_, kBlockSize);
+  history_mask_ = HistorySize(max_delay_) - 1;
   fprintf(stderr, "Rotator bank output delay: %zu\n", max_delay_);
+  last_nonzero_.assign(num_channels_, kNoInput);
+  staged_input_.resize(StagedFrames(num_channels_) * num_channels_ *
+                       kNumRotators);
   filter_outputs_.resize(num_rotators);
   for (std::vector<float> &output : filter_outputs_) {
     output.resize(num_channels_ * kBlockSize, 0.f);
   }
 }
 
+void RotatorFilterBank::Reset(const std::vector<float> &filter_gains,
+                              float global_gain) {
+  rotators_.reset(new Rotators(num_channels_, frequencies_, filter_gains,
+                               samplerate_, global_gain, latency_budget_,
+                               latency_fit_));
+  QCHECK_EQ(rotators_->max_delay_, max_delay_);
+  last_nonzero_.assign(num_channels_, kNoInput);
+}
+
+void RotatorFilterBank::Restart() {
+  rotators_->Clear();
+  last_nonzero_.assign(num_channels_, kNoInput);
+}
+
 // TODO(jyrki): filter all at once in the generic case, filtering one
 // is not memory friendly in this memory tabulation.
 void RotatorFilterBank::FilterOne(size_t f_ix, const float *history,
@@ -196,7 +461,7 @@ void RotatorFilterBank::FilterOne(size_t f_ix, const float *history,
   size_t out_ix = 0;
   for (int64_t i = 0; i < len; ++i) {
     int64_t delayed_ix = total_in + i - rotators_->advance[f_ix];
-    size_t histo_ix = num_channels_ * (delayed_ix & kHistoryMask);
+    size_t histo_ix = num_channels_ * (delayed_ix & history_mask_);
     for (size_t c = 0; c < num_channels_; ++c) {
       float delayed = history[histo_ix + c];
       rotators_->Increment(c, f_ix, delayed);
@@ -216,28 +481,239 @@ int64_t RotatorFilterBank::FilterAllSingleThreaded(const float *history,
                                                    int64_t len, FilterMode mode,
                                                    float *output,
                                                    size_t output_size) {
+  return FilterChannels(*rotators_, 0, history, total_in, len,
+                        staged_input_.data(), output);
+}
+
+int64_t RotatorFilterBank::FilterAllChannelParallel(const float *history,
+                                                    int64_t total_in,
+                                                    int64_t len, float *output,
+                                                    size_t output_size) {
+  Rotators &r = *rotators_;
+  std::vector<PerChannel> channels;
+  channels.swap(r.channel);
+  const size_t num_groups = std::min(num_threads_, num_channels_);
+  std::vector<size_t> first(num_groups + 1);
+  for (size_t g = 0; g <= num_groups; ++g) {
+    first[g] = g * num_channels_ / num_groups;
+  }
+  // Each group has a copy of the phases, and the accumulators of its
+  // channels.
+  std::vector<Rotators> groups(num_groups, r);
+  std::vector<std::vector<float>> outputs(num_groups);
+  for (size_t g = 0; g < num_groups; ++g) {
+    groups[g].channel.assign(channels.begin() + first[g],
+                             channels.begin() + first[g + 1]);
+  }
+  auto run = [&](size_t g) {
+    const size_t group_channels = first[g + 1] - first[g];
+    std::vector<float> staged(StagedFrames(group_channels) * group_channels *
+                              kNumRotators);
+    // Written apart from the other groups, as interleaved output frames
+    // would share cache lines between the threads.
+    outputs[g].resize(group_channels * len);
+    return FilterChannels(groups[g], first[g], history, total_in, len,
+                          staged.data(), outputs[g].data());
+  };
+  std::vector<std::future<int64_t>> futures;
+  futures.reserve(num_groups);
+  for (size_t g = 0; g < num_groups; ++g) {
+    futures.push_back(std::async(std::launch::async, run, g));
+  }
+  int64_t out_len = 0;
+  for (size_t g = 0; g < num_groups; ++g) {
+    out_len = futures[g].get();
+  }
+  for (size_t g = 0; g < num_groups; ++g) {
+    const size_t group_channels = first[g + 1] - first[g];
+    std::copy(groups[g].channel.begin(), groups[g].channel.end(),
+              channels.begin() + first[g]);
+    for (int64_t i = 0; i < out_len; ++i) {
+      std::copy(&outputs[g][i * group_channels],
+                &outputs[g][(i + 1) * group_channels],
+                &output[i * num_channels_ + first[g]]);
+    }
+  }
+  r.channel.swap(channels);
+  // The groups skip idle rotators independently, so their phases agree up
+  // to rounding. The ones of the first group carry on.
+  std::copy(groups[0].rot[2], groups[0].rot[2] + kNumRotators, r.rot[2]);
+  std::copy(groups[0].rot[3], groups[0].rot[3] + kNumRotators, r.rot[3]);
+  std::copy(&groups[0].phase[0][0], &groups[0].phase[0][0] + 2 * kNumRotators,
+            &r.phase[0][0]);
+  return out_len;
+}
+
+int64_t RotatorFilterBank::FilterChannels(Rotators &r, size_t first_channel,
+                                          const float *history,
+                                          int64_t total_in, int64_t len,
+                                          float *staged, float *output) {
+  ScopedFlushDenormals flush_denormals;
+  const size_t num_channels = r.channel.size();
+  int64_t *last_nonzero = &last_nonzero_[first_channel];
   size_t out_ix = 0;
-  for (size_t c = 0; c < num_channels_; ++c) {
-    rotators_->OccasionallyRenormalize();
+  for (size_t c = 0; c < num_channels; ++c) {
+    for (int64_t ix = total_in + len - 1; ix >= total_in; --ix) {
+      if (history[num_channels_ * (ix & history_mask_) + first_channel + c] !=
+          0.0f) {
+        last_nonzero[c] = ix;
+        break;
+      }
+    }
   }
-  for (int64_t i = 0; i < len; ++i) {
-    for (size_t c = 0; c < num_channels_; ++c) {
-      for (int k = 0; k < kNumRotators; ++k) {
-        int64_t delayed_ix = total_in + i - rotators_->advance[k];
-        size_t histo_ix = num_channels_ * (delayed_ix & kHistoryMask);
-        float delayed = history[histo_ix + c];
-        rotators_->AddAudio(c, k, delayed);
+  // Samples by which the phase of rotators that are idle on all channels is
+  // behind.
+  int64_t skipped[kNumRotators] = {0};
+  std::vector<std::vector<int>> active(num_channels);
+  std::vector<int> rotating;
+  for (int64_t start = 0; start < len; start += kActivityBlock) {
+    const int64_t end = std::min(len, start + kActivityBlock);
+    // |cos f + i sin f| in float is off from 1 by up to 2^-24, which would
+    // modulate the lowest bands by 1e-3 over a whole block.
+    r.OccasionallyRenormalize();
+    // Wake up the rotators that non-zero input may reach in this block.
+    bool all_active = true;
+    rotating.clear();
+    for (int k = 0; k < kNumRotators; ++k) {
+      bool rotates = false;
+      for (size_t c = 0; c < num_channels; ++c) {
+        bool &idle = r.channel[c].idle[k];
+        if (idle && total_in + start - r.advance[k] <= last_nonzero[c]) {
+          idle = false;
+        }
+        rotates |= !idle;
+        all_active &= !idle;
+      }
+      if (!rotates) {
+        skipped[k] += end - start;
+        continue;
       }
+      if (skipped[k] != 0) {
+        r.AdvancePhase(k, skipped[k]);
+        skipped[k] = 0;
+      }
+      rotating.push_back(k);
     }
-    rotators_->IncrementAll();
-    if (total_in + i >= max_delay_) {
-      for (size_t c = 0; c < num_channels_; ++c) {
-        output[out_ix * num_channels_ + c] =
-            HardClip(rotators_->GetSampleAll(c));
+
+    // The delayed input of a rotator over staged_frames frames is a run of
+    // consecutive history frames, split at most once where the history wraps
+    // around. The runs are staged by frame, channel and rotator, so that the
+    // rotators of a channel read their input of a sample in order.
+    const size_t frame_stride = num_channels * kNumRotators;
+    const int64_t staged_frames = StagedFrames(num_channels);
+    auto stage = [&](int64_t from, int64_t n) {
+      for (int k : rotating) {
+        int64_t ix = (total_in + from - r.advance[k]) & history_mask_;
+        float *to = staged + k;
+        for (int64_t j = 0; j < n;) {
+          const int64_t run = std::min(n - j, history_mask_ + 1 - ix);
+          const float *frame = &history[num_channels_ * ix + first_channel];
+          for (int64_t m = 0; m < run; ++m) {
+            for (size_t c = 0; c < num_channels; ++c) {
+              to[c * kNumRotators] = frame[c];
+            }
+            frame += num_channels_;
+            to += frame_stride;
+          }
+          j += run;
+          ix = 0;
+        }
+      }
+    };
+    if (all_active) {
+      for (int64_t i = start; i < end; ++i) {
+        if ((i - start) % staged_frames == 0) {
+          stage(i, std::min(staged_frames, end - i));
+        }
+        const float *frame_staged =
+            &staged[((i - start) % staged_frames) * frame_stride];
+        for (size_t c = 0; c < num_channels; ++c) {
+          r.AddAudioAll(c, &frame_staged[c * kNumRotators]);
+        }
+        r.IncrementAll();
+        if (total_in + i >= max_delay_) {
+          for (size_t c = 0; c < num_channels; ++c) {
+            const float sample = r.GetSampleAll(c);
+            output[out_ix * num_channels + c] =
+                clip_output_ ? HardClip(sample) : sample;
+          }
+          ++out_ix;
+        }
+      }
+    } else {
+      // Same arithmetic as above, restricted to the active rotators.
+      for (size_t c = 0; c < num_channels; ++c) {
+        active[c].clear();
+        for (int k = 0; k < kNumRotators; ++k) {
+          if (!r.channel[c].idle[k]) active[c].push_back(k);
+        }
+      }
+      for (int64_t i = start; i < end; ++i) {
+        if ((i - start) % staged_frames == 0) {
+          stage(i, std::min(staged_frames, end - i));
+        }
+        const float *frame_staged =
+            &staged[((i - start) % staged_frames) * frame_stride];
+        for (size_t c = 0; c < num_channels; ++c) {
+          for (int k : active[c]) {
+            r.AddAudio(c, k, frame_staged[c * kNumRotators + k]);
+          }
+        }
+        for (int k : rotating) r.RotatePhase(k);
+        for (size_t c = 0; c < num_channels; ++c) {
+          PerChannel &ch = r.channel[c];
+          for (int k : active[c]) {
+            if (k < kNumPreciseRotators) {
+              Leak(ch.precise_accu, k, r.window[k]);
+            } else {
+              Leak(ch.accu, k, r.window[k]);
+            }
+          }
+        }
+        if (total_in + i >= max_delay_) {
+          for (size_t c = 0; c < num_channels; ++c) {
+            const PerChannel &ch = r.channel[c];
+            double precise = 0;
+            float sample = 0;
+            for (int k : active[c]) {
+              if (k < kNumPreciseRotators) {
+                precise += r.rot[2][k] * ch.precise_accu[4][k] +
+                           r.rot[3][k] * ch.precise_accu[5][k];
+              } else {
+                sample += r.rot[2][k] * ch.accu[4][k] +
+                          r.rot[3][k] * ch.accu[5][k];
+              }
+            }
+            output[out_ix * num_channels + c] =
+                clip_output_ ? HardClip(sample + precise) : sample + precise;
+          }
+          ++out_ix;
+        }
+      }
+    }
+
+    // Rotators that have taken in all their non-zero input and have decayed
+    // go idle.
+    for (size_t c = 0; c < num_channels; ++c) {
+      PerChannel &channel = r.channel[c];
+      for (int k = 0; k < kNumRotators; ++k) {
+        if (channel.idle[k] ||
+            total_in + end - r.advance[k] <= last_nonzero[c] ||
+            r.ResidualBound(c, k) >= kIdleLevel) {
+          continue;
+        }
+        for (int j = 0; j < 6; ++j) channel.accu[j][k] = 0.0f;
+        if (k < kNumPreciseRotators) {
+          for (int j = 0; j < 6; ++j) channel.precise_accu[j][k] = 0.0;
+        }
+        channel.idle[k] = true;
       }
-      ++out_ix;
     }
   }
+  // Keep the phases exact at block boundaries, where snapshots are taken.
+  for (int k = 0; k < kNumRotators; ++k) {
+    if (skipped[k] != 0) r.AdvancePhase(k, skipped[k]);
+  }
   size_t out_len = total_in < max_delay_
                        ? std::max<int64_t>(0, len - (max_delay_ - total_in))
                        : len;
@@ -248,6 +724,7 @@ int64_t RotatorFilterBank::FilterAll(const float *history, int64_t total_in,
                                      int64_t len, FilterMode mode,
                                      float *output, size_t output_size) {
   auto run = [&](size_t thread) {
+    ScopedFlushDenormals flush_denormals;
     while (true) {
       size_t my_task = next_task_++;
       if (my_task >= num_rotators_) return;
@@ -278,4 +755,76 @@ int64_t RotatorFilterBank::FilterAll(const float *history, int64_t total_in,
   return out_len;
 }
 
+BankSnapshot RotatorFilterBank::Snapshot(const float *history,
+                                         int64_t total_in) const {
+  BankSnapshot snapshot;
+  snapshot.position = total_in;
+  const Rotators &r = *rotators_;
+  snapshot.state.insert(snapshot.state.end(), r.rot[2], r.rot[2] + kNumRotators);
+  snapshot.state.insert(snapshot.state.end(), r.rot[3], r.rot[3] + kNumRotators);
+  for (int j = 0; j < 2; ++j) {
+    snapshot.precise.insert(snapshot.precise.end(), r.phase[j],
+                            r.phase[j] + kNumRotators);
+  }
+  for (const PerChannel &c : r.channel) {
+    snapshot.state.insert(snapshot.state.end(), &c.accu[0][0],
+                          &c.accu[0][0] + 6 * kNumRotators);
+    snapshot.state.insert(snapshot.state.end(), c.idle,
+                          c.idle + kNumRotators);
+    snapshot.precise.insert(snapshot.precise.end(), &c.precise_accu[0][0],
+                            &c.precise_accu[0][0] + 6 * kNumPreciseRotators);
+  }
+  snapshot.history.resize(num_channels_ * max_delay_);
+  for (int64_t i = 0; i < max_delay_; ++i) {
+    const int64_t ix = total_in - max_delay_ + i;
+    for (size_t c = 0; c < num_channels_; ++c) {
+      snapshot.history[i * num_channels_ + c] =
+          ix < 0 ? 0.0f : history[num_channels_ * (ix & history_mask_) + c];
+    }
+  }
+  return snapshot;
+}
+
+void RotatorFilterBank::Restore(const BankSnapshot &snapshot, float *history) {
+  Rotators &r = *rotators_;
+  QCHECK_EQ(snapshot.state.size(), (2 + 7 * r.channel.size()) * kNumRotators);
+  QCHECK_EQ(snapshot.precise.size(),
+            2 * kNumRotators + 6 * r.channel.size() * kNumPreciseRotators);
+  QCHECK_EQ(snapshot.history.size(), num_channels_ * max_delay_);
+  const float *state = snapshot.state.data();
+  std::copy(state, state + kNumRotators, r.rot[2]);
+  state += kNumRotators;
+  std::copy(state, state + kNumRotators, r.rot[3]);
+  state += kNumRotators;
+  const double *precise = snapshot.precise.data();
+  for (int j = 0; j < 2; ++j) {
+    std::copy(precise, precise + kNumRotators, r.phase[j]);
+    precise += kNumRotators;
+  }
+  for (PerChannel &c : r.channel) {
+    std::copy(state, state + 6 * kNumRotators, &c.accu[0][0]);
+    state += 6 * kNumRotators;
+    for (int k = 0; k < kNumRotators; ++k) {
+      c.idle[k] = state[k] != 0.0f;
+    }
+    state += kNumRotators;
+    std::copy(precise, precise + 6 * kNumPreciseRotators,
+              &c.precise_accu[0][0]);
+    precise += 6 * kNumPreciseRotators;
+  }
+  // Input older than the saved history has reached every rotator already.
+  last_nonzero_.assign(num_channels_, kNoInput);
+  for (int64_t i = 0; i < max_delay_; ++i) {
+    const int64_t ix = snapshot.position - max_delay_ + i;
+    if (ix < 0) continue;
+    for (size_t c = 0; c < num_channels_; ++c) {
+      history[num_channels_ * (ix & history_mask_) + c] =
+          snapshot.history[i * num_channels_ + c];
+      if (snapshot.history[i * num_channels_ + c] != 0.0f) {
+        last_nonzero_[c] = ix;
+      }
+    }
+  }
+}
+
 }  // namespace tabuli
\ No newline at end of file
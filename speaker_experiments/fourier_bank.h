@@ -21,6 +21,11 @@ namespace tabuli {
 
 constexpr int64_t kNumRotators = 128;
 
+// Sample rate for which the window constants and GetRotatorGains are tuned.
+// At other rates the windows keep the same time constants, and the gains are
+// adapted so that the bank keeps its frequency response.
+constexpr float kReferenceSampleRate = 48000;
+
 float GetRotatorGains(int i);
 
 enum FilterMode {
@@ -31,11 +36,31 @@ enum FilterMode {
 
 float BarkFreq(float v);
 
+// How a rotator whose delay exceeds the latency budget of a bank is fit into
+// it.
+enum LatencyFit {
+  // The window is shortened until the delay fits, which widens the band.
+  SHORTEN_WINDOW,
+  // The advance is reduced, and the band comes late by the excess delay.
+  CAP_ADVANCE,
+};
+
+// The lowest rotators keep their leaking integrators in double precision.
+// Their windows are the closest to 1, and float rounding over their long
+// integration limits them to about 113 dB SNR, against 120-140 dB above.
+constexpr int kNumPreciseRotators = 16;
+
 struct PerChannel {
   // [0..1] is for real and imag of 1st leaking accumulation
   // [2..3] is for real and imag of 2nd leaking accumulation
   // [4..5] is for real and imag of 3rd leaking accumulation
   float accu[6][kNumRotators] = {0};
+  // accu of the rotators below kNumPreciseRotators, whose entries in accu
+  // are unused.
+  double precise_accu[6][kNumPreciseRotators] = {0};
+  // Set when all accumulators of a rotator have been zeroed after silence;
+  // idle rotators are skipped until non-zero input reaches them.
+  bool idle[kNumRotators] = {false};
 };
 
 struct Rotators {
@@ -46,6 +71,11 @@ struct Rotators {
   // input and output, leading to a total gain multiplication if the length is
   // at sqrt(gain).
   float rot[4][kNumRotators] = {0};
+  // rot[0..1] and rot[2..3] in double precision, with rot[2..3] rounded from
+  // phase after every change. A float phasor drifts in phase between the
+  // input and the output of the slowest rotators.
+  double step[2][kNumRotators] = {{0}};
+  double phase[2][kNumRotators] = {{0}};
   std::vector<PerChannel> channel;
   // Accu has the channel related data, everything else the same between
   // channels.
@@ -58,49 +88,160 @@ struct Rotators {
   int FindMedian3xLeaker(float window);
 
   Rotators() = default;
+  // Rotators at or above the Nyquist frequency of sample_rate get a zero
+  // gain, so that they do not alias into the output. If max_delay is
+  // positive, the output delay is at most max_delay samples, with the slower
+  // rotators fit into it by latency_fit.
   Rotators(int num_channels, std::vector<float> frequency,
            std::vector<float> filter_gains, const float sample_rate,
-           float global_gain);
+           float global_gain, int64_t max_delay = 0,
+           LatencyFit latency_fit = SHORTEN_WINDOW);
+
+  // The filter gains are tuned for how the responses of neighbouring
+  // rotators add up at kReferenceSampleRate. Delay rounding and the
+  // discretization of the leaking integrators change that at other rates,
+  // and so does a latency budget, so the gains are refined until the
+  // response at the rotator frequencies matches the one at the reference
+  // rate without a budget.
+  void AdaptGains(const std::vector<float> &frequency,
+                  const std::vector<float> &filter_gains, float sample_rate,
+                  float global_gain);
+
+  // Clears the accumulators of all channels and rewinds the phases, as
+  // after construction.
+  void Clear();
 
   void Increment(int c, int i, float audio);
+  // Advances the phase of rotator i by one sample.
+  void RotatePhase(int i);
 
   void AddAudio(int c, int i, float audio);
+  // Adds audio[i] to rotator i on channel c, for all rotators.
+  void AddAudioAll(int c, const float *audio);
   void OccasionallyRenormalize();
   void IncrementAll();
   float GetSampleAll(int c);
   float GetSample(int c, int i, FilterMode mode = IDENTITY) const;
+  // Accumulator j of rotator i on channel c, wherever it is kept.
+  double Accu(int c, int j, int i) const;
+
+  // Rotates rot[2..3] of rotator i by n samples at once.
+  void AdvancePhase(int i, int64_t n);
+  // Upper bound of the output that the accumulators of rotator i on
+  // channel c can still produce without further input.
+  float ResidualBound(int c, int i) const;
 };
 
 static constexpr int64_t kBlockSize = 1 << 15;
-static const int kHistorySize = (1 << 18);
-static const int kHistoryMask = kHistorySize - 1;
+
+// Frames of an input history ring that holds a block of up to kBlockSize
+// frames and the look_back frames before it, rounded up to a power of two.
+int64_t HistorySize(int64_t look_back);
 
 float HardClip(float v);
 
+// Time-varying state of a RotatorFilterBank between two blocks. Restoring it
+// continues filtering from 'position' exactly as if the bank had run over all
+// the input before it.
+struct BankSnapshot {
+  int64_t position = 0;
+  // rot[2..3] of all rotators, followed by the accumulators and the idle
+  // flags (as 0 or 1) of each channel.
+  std::vector<float> state;
+  // The double phasors of all rotators, followed by the double accumulators
+  // of each channel, so that they are restored bit for bit.
+  std::vector<double> precise;
+  // The max_delay_ input frames before position, interleaved by channel,
+  // which the rotators still read through their advance.
+  std::vector<float> history;
+};
+
+// Deviation of a bank with a latency budget from the bank without one, at
+// the frequency of a rotator, with the output delays taken out.
+struct BandLatencyError {
+  float frequency;
+  // Group delay of the rotator, in samples.
+  int64_t delay;
+  float magnitude_db;
+  float phase_degrees;
+  // Samples by which the band comes late when its advance is capped.
+  int64_t late;
+};
+
+std::vector<BandLatencyError> LatencyErrors(
+    size_t samplerate, const std::vector<float> &filter_gains,
+    int64_t max_delay, LatencyFit latency_fit);
+
 struct RotatorFilterBank {
   RotatorFilterBank(size_t num_rotators, size_t num_channels, size_t samplerate,
                     size_t num_threads, const std::vector<float> &filter_gains,
-                    float global_gain);
+                    float global_gain, int64_t max_delay = 0,
+                    LatencyFit latency_fit = SHORTEN_WINDOW);
   ~RotatorFilterBank() = default;
 
+  // Restarts the bank from silence with other filter gains, as if it was
+  // constructed again with them.
+  void Reset(const std::vector<float> &filter_gains, float global_gain);
+  // Restarts the bank from silence with the gains it has, which is much
+  // cheaper than Reset when the gains were adapted to the sample rate.
+  void Restart();
+
   // TODO(jyrki): filter all at once in the generic case, filtering one
   // is not memory friendly in this memory tabulation.
   void FilterOne(size_t f_ix, const float *history, int64_t total_in,
                  int64_t len, FilterMode mode, float *output);
 
+  // Rotators whose accumulators have decayed below audibility in silence are
+  // zeroed and skipped per channel, and are woken when non-zero input reaches
+  // them through their advance.
   int64_t FilterAllSingleThreaded(const float *history, int64_t total_in,
                                   int64_t len, FilterMode mode, float *output,
                                   size_t output_size);
 
+  // Identity filtering like FilterAllSingleThreaded, with the channels split
+  // into num_threads_ groups that are filtered in parallel. Each group
+  // advances its own copy of the shared phases.
+  int64_t FilterAllChannelParallel(const float *history, int64_t total_in,
+                                   int64_t len, float *output,
+                                   size_t output_size);
+
   int64_t FilterAll(const float *history, int64_t total_in, int64_t len,
                     FilterMode mode, float *output, size_t output_size);
 
+  // Captures the state after the input up to total_in has been filtered.
+  BankSnapshot Snapshot(const float *history, int64_t total_in) const;
+  // Restores a snapshot, including its part of the input history.
+  void Restore(const BankSnapshot &snapshot, float *history);
+
+  // Identity filtering of the channels of r, which are the channels from
+  // first_channel on of the history. The output is interleaved by the
+  // channels of r.
+  int64_t FilterChannels(Rotators &r, size_t first_channel,
+                         const float *history, int64_t total_in, int64_t len,
+                         float *staged, float *output);
+
   size_t num_rotators_;
   size_t num_channels_;
   size_t num_threads_;
+  size_t samplerate_;
+  int64_t latency_budget_;
+  LatencyFit latency_fit_;
+  std::vector<float> frequencies_;
   std::unique_ptr<Rotators> rotators_;
   int64_t max_delay_;
+  // Mask of the frame index in the input history, which has
+  // HistorySize(max_delay_) frames.
+  int64_t history_mask_;
   std::vector<std::vector<float>> filter_outputs_;
+  // Whether identity filtering clips its output to [-1, 1]. Off when a
+  // limiter follows the bank.
+  bool clip_output_ = true;
+  // Index of the latest input sample of each channel that may be non-zero.
+  std::vector<int64_t> last_nonzero_;
+  // The delayed input of rotator k on channel c for sample i of a run of
+  // staged frames, at (i * num_channels_ + c) * kNumRotators + k, so that
+  // the rotators read it with unit stride.
+  std::vector<float> staged_input_;
   std::atomic<size_t> next_task_{0};
 };
 
@@ -20,15 +20,27 @@
 #include <cstdlib>
 #include <functional>
 #include <future>  // NOLINT
+#include <limits>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/check.h"
 #include "absl/strings/str_split.h"
+#include "audio_cache.h"
+#include "convolution_bank.h"
 #include "fourier_bank.h"
+#include "multirate_bank.h"
+#include "normalize.h"
+#include "output_file.h"
+#include "pipeline.h"
+#include "render_cache.h"
+#include "resampler.h"
+#include "segment_render.h"
+#include "trace.h"
 #include "sndfile.hh"
 
 ABSL_FLAG(bool, plot_input, false, "If set, plots the input signal.");
@@ -39,6 +51,73 @@ ABSL_FLAG(int, plot_from, -1, "If non-negative, start plot from here.");
 ABSL_FLAG(int, plot_to, -1, "If non-negative, end plot here.");
 ABSL_FLAG(double, gain, 1.0, "Global volume scaling.");
 ABSL_FLAG(std::string, filter_mode, "identity", "Filter mode.");
+ABSL_FLAG(bool, multirate, false,
+          "If set, runs the low-frequency rotators at decimated sample rates "
+          "in identity mode.");
+ABSL_FLAG(bool, fft_convolution, false,
+          "If set, applies the bank's impulse response with partitioned FFT "
+          "convolution in identity mode.");
+ABSL_FLAG(int, fft_partition_size, 2048,
+          "Partition length of the FFT convolution.");
+ABSL_FLAG(int, num_threads, 1,
+          "Number of threads of the rotator bank. In identity mode they "
+          "filter groups of channels in parallel.");
+ABSL_FLAG(int, internal_samplerate, 0,
+          "If positive, a wav input at another sample rate is resampled to "
+          "this rate before filtering, and the output is written at it.");
+ABSL_FLAG(double, max_latency_ms, 0,
+          "If positive, caps the output delay of the rotator bank at this "
+          "many milliseconds, for interactive use.");
+ABSL_FLAG(std::string, latency_fit, "window",
+          "How the rotators that are slower than --max_latency_ms are fit "
+          "into it: 'window' shortens their windows, 'advance' lets them "
+          "come late.");
+ABSL_FLAG(double, segment_seconds, 0,
+          "If positive, renders a wav input in independent time segments of "
+          "this length in parallel.");
+ABSL_FLAG(int, segment_threads, 8,
+          "Number of segments rendered concurrently.");
+ABSL_FLAG(double, warmup_tolerance, 1e-4,
+          "Residual of the filter state, relative to its peak response, "
+          "that is accepted at the start of each segment.");
+ABSL_FLAG(std::string, render_cache, "",
+          "If set, bank snapshots of an identity render are stored in this "
+          "file, and --rerender_from resumes from them.");
+ABSL_FLAG(double, snapshot_seconds, 10,
+          "Interval between the snapshots of the render cache.");
+ABSL_FLAG(double, rerender_from, -1,
+          "If non-negative, re-renders the existing output from the latest "
+          "cached snapshot before this time, in seconds. Only the input may "
+          "have changed: the parameters have to be those of the cached "
+          "render.");
+ABSL_FLAG(double, rerender_to, -1,
+          "If non-negative, the input is unchanged after this time, and "
+          "re-rendering stops once the output agrees with the previous "
+          "render again.");
+ABSL_FLAG(double, peak_db, 0,
+          "If negative, normalizes the output file to this peak level in "
+          "dBFS, in place after rendering.");
+ABSL_FLAG(double, limiter_ms, 0,
+          "If positive, a peak limiter with this lookahead keeps the "
+          "identity output within full scale, instead of hard clipping.");
+ABSL_FLAG(std::string, output_format, "wav",
+          "Container of the output: wav, rf64 or w64 for files over 4 GB, or "
+          "raw.");
+ABSL_FLAG(std::string, sample_format, "pcm24",
+          "Samples of the output: pcm16, pcm24 or float.");
+ABSL_FLAG(bool, split_output, false,
+          "If set, writes one mono file per output channel, numbered before "
+          "the extension.");
+ABSL_FLAG(std::string, audio_cache, "",
+          "Directory of decoded inputs that are shared between runs; "
+          "defaults to $TABULI_AUDIO_CACHE. Inputs are decoded and resampled "
+          "again without one.");
+ABSL_FLAG(bool, trace, false,
+          "If set, prints the time spent in each stage and the real-time "
+          "factor.");
+ABSL_FLAG(std::string, trace_json, "",
+          "If set, also writes the spans of the stages to this file as a "
+          "Chrome trace.");
 
 namespace tabuli {
 
@@ -108,12 +187,43 @@ FilterMode GetFilterMode() {
   QCHECK(0);
 }
 
-float SquareError(const float* input_history, const float* output,
-                  size_t num_channels, size_t total, size_t output_len) {
+LatencyFit GetLatencyFit() {
+  std::string desc = absl::GetFlag(FLAGS_latency_fit);
+  if (desc == "window") {
+    return SHORTEN_WINDOW;
+  } else if (desc == "advance") {
+    return CAP_ADVANCE;
+  }
+  QCHECK(0) << "Unknown latency fit " << desc;
+}
+
+// Output delay budget of the rotator bank in samples, or 0 for none.
+int64_t LatencyBudget(size_t samplerate) {
+  return std::llround(absl::GetFlag(FLAGS_max_latency_ms) * 1e-3 * samplerate);
+}
+
+void PrintLatencyErrors(size_t samplerate,
+                        const std::vector<float>& filter_gains) {
+  const int64_t budget = LatencyBudget(samplerate);
+  fprintf(stderr, "Latency budget: %zu samples\n", static_cast<size_t>(budget));
+  for (const BandLatencyError& e :
+       LatencyErrors(samplerate, filter_gains, budget, GetLatencyFit())) {
+    if (e.delay <= budget) continue;
+    fprintf(stderr,
+            "%8.1f Hz  delay %5zu  magnitude %+6.2f dB  phase %+7.1f deg"
+            "  late %5zu\n",
+            e.frequency, static_cast<size_t>(e.delay), e.magnitude_db,
+            e.phase_degrees, static_cast<size_t>(e.late));
+  }
+}
+
+float SquareError(const float* input_history, int64_t history_mask,
+                  const float* output, size_t num_channels, size_t total,
+                  size_t output_len) {
   float res = 0.0;
   for (size_t i = 0; i < output_len; ++i) {
     int input_ix = i + total;
-    size_t histo_ix = num_channels * (input_ix & kHistoryMask);
+    size_t histo_ix = num_channels * (input_ix & history_mask);
     for (size_t c = 0; c < num_channels; ++c) {
       float in = input_history[histo_ix + c];
       float out = output[num_channels * i + c];
@@ -129,11 +239,27 @@ class InputSignal {
   InputSignal(const std::string& desc) {
     std::vector<std::string> params = absl::StrSplit(desc, ":");
     if (params.size() == 1) {
-      input_file_ = std::make_unique<SndfileHandle>(params[0].c_str());
-      QCHECK(*input_file_) << input_file_->strError();
-      channels_ = input_file_->channels();
-      samplerate_ = input_file_->samplerate();
       signal_type_ = SignalType::WAV;
+      const size_t internal_samplerate =
+          std::max(0, absl::GetFlag(FLAGS_internal_samplerate));
+      const std::string cache_dir =
+          AudioCacheDir(absl::GetFlag(FLAGS_audio_cache));
+      if (!cache_dir.empty()) {
+        cached_file_ = std::make_unique<CachedReader>(
+            params[0], internal_samplerate, cache_dir);
+        channels_ = cached_file_->channels();
+        samplerate_ = cached_file_->samplerate();
+      } else {
+        input_file_ = std::make_unique<SndfileHandle>(params[0].c_str());
+        QCHECK(*input_file_) << input_file_->strError();
+        channels_ = input_file_->channels();
+        samplerate_ = input_file_->samplerate();
+        if (internal_samplerate > 0 && internal_samplerate != samplerate_) {
+          resampled_file_ = std::make_unique<ResamplingReader<SndfileHandle>>(
+              *input_file_, internal_samplerate);
+          samplerate_ = internal_samplerate;
+        }
+      }
     } else {
       channels_ = 1;
       samplerate_ = 48000;
@@ -163,8 +289,10 @@ class InputSignal {
   size_t samplerate() const { return samplerate_; }
 
   int64_t readf(float* data, size_t nframes) {
-    if (input_file_) {
-      int64_t read = input_file_->readf(data, nframes);
+    if (signal_type_ == SignalType::WAV) {
+      int64_t read = cached_file_      ? cached_file_->readf(data, nframes)
+                     : resampled_file_ ? resampled_file_->readf(data, nframes)
+                                       : input_file_->readf(data, nframes);
       if (signal_f_) {
         for (size_t i = 0; i < read; ++i) {
           if (CheckPosition(input_ix_)) {
@@ -213,6 +341,8 @@ class InputSignal {
   size_t channels_;
   size_t samplerate_;
   std::unique_ptr<SndfileHandle> input_file_;
+  std::unique_ptr<ResamplingReader<SndfileHandle>> resampled_file_;
+  std::unique_ptr<CachedReader> cached_file_;
 };
 
 class OutputSignal {
@@ -225,18 +355,53 @@ class OutputSignal {
         save_output_(save_output) {}
 
   void writef(const float* data, size_t nframes) {
-    if (output_file_) {
-      output_file_->writef(data, nframes);
-    }
-    if (save_output_) {
-      output_.insert(output_.end(), data, data + nframes * frame_size());
+    if (limiter_) {
+      limited_.clear();
+      limiter_->Process(data, nframes, &limited_);
+      Emit(limited_.data(), limited_.size() / frame_size());
+    } else {
+      Emit(data, nframes);
     }
   }
 
   void SetWavFile(const char* fn) {
-    output_file_ = std::make_unique<SndfileHandle>(
-        fn, /*mode=*/SFM_WRITE, /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
-        channels_, samplerate_);
+    const int format = OutputFormat(absl::GetFlag(FLAGS_output_format),
+                                    absl::GetFlag(FLAGS_sample_format));
+    if (absl::GetFlag(FLAGS_peak_db) < 0) {
+      QCHECK((absl::GetFlag(FLAGS_output_format) == "wav" ||
+              absl::GetFlag(FLAGS_output_format) == "rf64") &&
+             !absl::GetFlag(FLAGS_split_output))
+          << "Normalization rewrites a single WAV or RF64 file.";
+      normalizing_file_ = std::make_unique<NormalizingWriter>(
+          fn, format, channels_, samplerate_, absl::GetFlag(FLAGS_peak_db));
+      async_normalizing_file_ =
+          std::make_unique<AsyncWriter<NormalizingWriter>>(*normalizing_file_,
+                                                           channels_);
+    } else {
+      output_file_ = std::make_unique<OutputFile>(
+          fn, format, channels_, samplerate_,
+          absl::GetFlag(FLAGS_split_output));
+      async_output_file_ = std::make_unique<AsyncWriter<OutputFile>>(
+          *output_file_, channels_);
+    }
+  }
+
+  // Passes the output of the bank through a lookahead limiter.
+  void SetLimiter(double lookahead_ms) {
+    limiter_ = std::make_unique<LookaheadLimiter>(
+        frame_size(), samplerate_, /*ceiling=*/1.0f, lookahead_ms);
+  }
+
+  // Writes what the limiter still holds, and normalizes the output file.
+  void Finish() {
+    if (limiter_) {
+      limited_.clear();
+      limiter_->Flush(&limited_);
+      Emit(limited_.data(), limited_.size() / frame_size());
+    }
+    if (async_output_file_) async_output_file_->Close();
+    if (async_normalizing_file_) async_normalizing_file_->Close();
+    if (normalizing_file_) normalizing_file_->Finish();
   }
 
   void DumpSignal(FILE* f) {
@@ -276,28 +441,118 @@ class OutputSignal {
   size_t num_frames() const { return output_.size() / frame_size(); }
 
  private:
+  void Emit(const float* data, size_t nframes) {
+    if (async_output_file_) {
+      async_output_file_->writef(data, nframes);
+    }
+    if (async_normalizing_file_) {
+      async_normalizing_file_->writef(data, nframes);
+    }
+    if (save_output_) {
+      output_.insert(output_.end(), data, data + nframes * frame_size());
+    }
+  }
+
   size_t channels_;
   size_t freq_channels_;
   size_t samplerate_;
   bool save_output_;
   std::vector<float> output_;
-  std::unique_ptr<SndfileHandle> output_file_;
+  std::unique_ptr<OutputFile> output_file_;
+  std::unique_ptr<NormalizingWriter> normalizing_file_;
+  // Encode on threads of their own; after the files, so that they are
+  // closed first.
+  std::unique_ptr<AsyncWriter<OutputFile>> async_output_file_;
+  std::unique_ptr<AsyncWriter<NormalizingWriter>> async_normalizing_file_;
+  std::unique_ptr<LookaheadLimiter> limiter_;
+  std::vector<float> limited_;
 };
 
+// Snapshots are taken between full blocks, so that a render resumed from one
+// splits the input into the same blocks as the original render.
+int64_t SnapshotInterval(size_t samplerate) {
+  return kBlockSize *
+         std::max<int64_t>(1, std::llround(absl::GetFlag(FLAGS_snapshot_seconds) *
+                                           samplerate / kBlockSize));
+}
+
+// Fingerprint of the parameters that the snapshots of a render depend on.
+uint64_t CacheFingerprint(size_t samplerate, size_t num_channels,
+                          const std::vector<float>& filter_gains) {
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  std::vector<double> params = {
+      static_cast<double>(samplerate),
+      static_cast<double>(num_channels),
+      absl::GetFlag(FLAGS_gain),
+      static_cast<double>(LatencyBudget(samplerate)),
+      static_cast<double>(GetLatencyFit()),
+      // The channel groups of FilterAllChannelParallel, or 0 for
+      // FilterAllSingleThreaded. Each group skips idle rotators on its own
+      // copy of the phases, so the state depends on the grouping.
+      num_threads > 1 ? static_cast<double>(std::min<size_t>(num_threads,
+                                                             num_channels))
+                      : 0.0};
+  params.insert(params.end(), filter_gains.begin(), filter_gains.end());
+  return RenderFingerprint(params);
+}
+
+// Derives the impulse response of the identity bank for --fft_convolution
+// and checks it against the rotators.
+std::shared_ptr<const ConvolutionResponse> MakeConvolutionResponse(
+    size_t samplerate, const std::vector<float>& filter_gains) {
+  auto response = std::make_shared<const ConvolutionResponse>(
+      kNumRotators, samplerate, filter_gains, absl::GetFlag(FLAGS_gain),
+      absl::GetFlag(FLAGS_fft_partition_size));
+  const double error = response->ImpulseResponseError(
+      samplerate, filter_gains, absl::GetFlag(FLAGS_gain));
+  fprintf(stderr, "Impulse response error: %g\n", error);
+  QCHECK_LT(error, 1e-3);
+  return response;
+}
+
+// Returns the mean square difference between the input and the output.
+// With --fft_convolution, the response is derived here unless one is given.
 template <typename In, typename Out>
-void Process(
+double Process(
     In& input_stream, Out& output_stream, FilterMode mode,
     const std::vector<float>& filter_gains = {},
     const std::function<void()>& start_progress = [] {},
-    const std::function<void(int64_t)>& set_progress = [](int64_t written) {}) {
+    const std::function<void(int64_t)>& set_progress = [](int64_t written) {},
+    RenderCache* cache = nullptr,
+    std::shared_ptr<const ConvolutionResponse> convolution_response =
+        nullptr) {
   const size_t num_channels = input_stream.channels();
-  std::vector<float> history(num_channels * kHistorySize);
   std::vector<float> input(num_channels * kBlockSize);
   std::vector<float> output(output_stream.frame_size() * kBlockSize);
 
   RotatorFilterBank rotbank(kNumRotators, num_channels,
-                            input_stream.samplerate(), /*num_threads=*/1,
-                            filter_gains, absl::GetFlag(FLAGS_gain));
+                            input_stream.samplerate(),
+                            absl::GetFlag(FLAGS_num_threads), filter_gains,
+                            absl::GetFlag(FLAGS_gain),
+                            LatencyBudget(input_stream.samplerate()),
+                            GetLatencyFit());
+  rotbank.clip_output_ = absl::GetFlag(FLAGS_limiter_ms) <= 0;
+  std::unique_ptr<ConvolutionFilterBank> convolution_bank;
+  if (mode == IDENTITY && absl::GetFlag(FLAGS_fft_convolution)) {
+    if (!convolution_response) {
+      convolution_response =
+          MakeConvolutionResponse(input_stream.samplerate(), filter_gains);
+    }
+    convolution_bank = std::make_unique<ConvolutionFilterBank>(
+        std::move(convolution_response), num_channels);
+  }
+  std::unique_ptr<MultirateRotatorFilterBank> multirate_bank;
+  if (mode == IDENTITY && absl::GetFlag(FLAGS_multirate)) {
+    multirate_bank = std::make_unique<MultirateRotatorFilterBank>(
+        kNumRotators, num_channels, input_stream.samplerate(), filter_gains,
+        absl::GetFlag(FLAGS_gain));
+  }
+  // Sized for the look-back of the bank that filters.
+  const int64_t history_mask =
+      convolution_bank ? convolution_bank->history_mask_
+      : multirate_bank ? multirate_bank->history_mask_
+                       : rotbank.history_mask_;
+  std::vector<float> history(num_channels * (history_mask + 1));
 
   start_progress();
   int64_t total_in = 0;
@@ -305,40 +560,268 @@ void Process(
   bool done = false;
   double err = 0.0;
   while (!done) {
-    int64_t read = input_stream.readf(input.data(), kBlockSize);
+    int64_t read;
+    {
+      ScopedStage stage(kStageRead);
+      read = input_stream.readf(input.data(), kBlockSize);
+    }
     if (read == 0) {
       done = true;
       read = total_in - total_out;
-      std::fill(input.begin(), input.begin() + read, 0);
+      std::fill(input.begin(), input.begin() + read * num_channels, 0);
     }
-    for (int i = 0; i < read; ++i) {
-      int input_ix = i + total_in;
-      size_t histo_ix = num_channels * (input_ix & kHistoryMask);
-      for (size_t c = 0; c < num_channels; ++c) {
-        history[histo_ix + c] = input[num_channels * i + c];
+    {
+      ScopedStage stage(kStageHistory);
+      for (int i = 0; i < read; ++i) {
+        int input_ix = i + total_in;
+        size_t histo_ix = num_channels * (input_ix & history_mask);
+        for (size_t c = 0; c < num_channels; ++c) {
+          history[histo_ix + c] = input[num_channels * i + c];
+        }
       }
     }
     int64_t output_len = 0;
-    if (mode == IDENTITY) {
-      output_len = rotbank.FilterAllSingleThreaded(
-          history.data(), total_in, read, mode, output.data(), output.size());
-    } else {
-      output_len = rotbank.FilterAll(history.data(), total_in, read, mode,
-                                     output.data(), output.size());
+    {
+      ScopedStage stage(kStageFilter);
+      if (convolution_bank) {
+        output_len = convolution_bank->FilterAll(history.data(), total_in, read,
+                                                 output.data(), output.size());
+      } else if (multirate_bank) {
+        output_len = multirate_bank->FilterAll(history.data(), total_in, read,
+                                               output.data(), output.size());
+      } else if (mode == IDENTITY && absl::GetFlag(FLAGS_num_threads) > 1) {
+        output_len = rotbank.FilterAllChannelParallel(
+            history.data(), total_in, read, output.data(), output.size());
+      } else if (mode == IDENTITY) {
+        output_len = rotbank.FilterAllSingleThreaded(
+            history.data(), total_in, read, mode, output.data(), output.size());
+      } else {
+        output_len = rotbank.FilterAll(history.data(), total_in, read, mode,
+                                       output.data(), output.size());
+      }
+    }
+    {
+      ScopedStage stage(kStageWrite);
+      output_stream.writef(output.data(), output_len);
     }
-    output_stream.writef(output.data(), output_len);
-    err += SquareError(history.data(), output.data(), num_channels, total_out,
-                       output_len);
+    err += SquareError(history.data(), history_mask, output.data(),
+                       num_channels, total_out, output_len);
     total_in += read;
     total_out += output_len;
+    if (cache && read == kBlockSize &&
+        total_in % SnapshotInterval(input_stream.samplerate()) == 0) {
+      cache->Add(rotbank.Snapshot(history.data(), total_in));
+    }
     set_progress(total_in);
   }
-  err /= total_out;
+  if (cache) {
+    cache->DropAfter(total_in);
+    cache->Save();
+  }
+  return err / total_out;
+}
+
+void PrintScore(double err) {
   float psnr = -10.0 * std::log(err) / std::log(10.0);
   fprintf(stdout, "score=%.15g\n", err);
   fprintf(stderr, "MSE: %f  PSNR: %f\n", err, psnr);
 }
 
+// Number of samples that the state of the bank needs from a cleared start to
+// converge, and how far its output looks ahead into the input.
+void SegmentWarmupAndLookahead(size_t samplerate,
+                               const std::vector<float>& filter_gains,
+                               int64_t* warmup, int64_t* lookahead) {
+  std::vector<float> freqs(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
+  }
+  const Rotators rotators(0, freqs, filter_gains, samplerate,
+                          absl::GetFlag(FLAGS_gain), LatencyBudget(samplerate),
+                          GetLatencyFit());
+  const float slowest = *std::max_element(rotators.window,
+                                          rotators.window + kNumRotators);
+  *warmup =
+      WarmupSamples(slowest, 3, absl::GetFlag(FLAGS_warmup_tolerance));
+  *lookahead = rotators.max_delay_;
+  if (absl::GetFlag(FLAGS_multirate) && !absl::GetFlag(FLAGS_fft_convolution)) {
+    *lookahead = MultirateRotatorFilterBank(kNumRotators, 1, samplerate,
+                                            filter_gains,
+                                            absl::GetFlag(FLAGS_gain))
+                     .max_delay_;
+  }
+}
+
+// Renders the wav file at input_path in parallel time segments and writes
+// them to output in order. Each segment starts from a cleared bank that is
+// run over the preceding warm-up samples, so the stitched output matches a
+// single pass up to the warm-up tolerance. Returns the mean square error
+// averaged over the segments, including their warm-up.
+double ProcessSegments(const std::string& input_path, FilterMode mode,
+                       const std::vector<float>& filter_gains,
+                       OutputSignal& output) {
+  SndfileHandle input_file(input_path.c_str());
+  QCHECK(input_file) << input_file.strError();
+  const size_t samplerate = input_file.samplerate();
+  int64_t warmup, lookahead;
+  SegmentWarmupAndLookahead(samplerate, filter_gains, &warmup, &lookahead);
+  const int64_t segment_frames =
+      absl::GetFlag(FLAGS_segment_seconds) * samplerate;
+  fprintf(stderr, "Segments of %zu frames, warm-up %zu\n",
+          static_cast<size_t>(segment_frames), static_cast<size_t>(warmup));
+  struct Segment {
+    std::vector<float> frames;
+    double err;
+  };
+  // The segments share one response instead of deriving it each.
+  std::shared_ptr<const ConvolutionResponse> convolution_response;
+  if (mode == IDENTITY && absl::GetFlag(FLAGS_fft_convolution)) {
+    convolution_response = MakeConvolutionResponse(samplerate, filter_gains);
+  }
+  double err = 0.0;
+  int64_t written = 0;
+  RenderSegments(
+      input_file.frames(), segment_frames, warmup, lookahead,
+      absl::GetFlag(FLAGS_segment_threads),
+      [&](int64_t input_begin, int64_t input_end, int64_t skip, int64_t keep) {
+        SegmentReader in(input_path, input_begin, input_end);
+        SegmentWriter<float> out(output.frame_size(), skip, keep);
+        const double segment_err =
+            Process(in, out, mode, filter_gains, [] {}, [](int64_t) {},
+                    /*cache=*/nullptr, convolution_response);
+        QCHECK_EQ(out.num_frames(), keep);
+        return Segment{out.frames(), segment_err * keep};
+      },
+      [&](const Segment& segment) {
+        output.writef(segment.frames.data(),
+                      segment.frames.size() / output.frame_size());
+        err += segment.err;
+        written += segment.frames.size() / output.frame_size();
+        TraceProgress(written);
+      });
+  return err / input_file.frames();
+}
+
+// Renders the identity bank again over an edited part of the input, and
+// overwrites that part of the existing output. Rendering starts from the
+// latest cached snapshot before --rerender_from and continues to the end of
+// the input, or until the output after --rerender_to agrees with the existing
+// output for a whole block. The new output is spliced in up to where that
+// agreement starts. The snapshots of the re-rendered span are replaced in the
+// cache and the later ones are kept, except after the end of the input.
+//
+// The cached snapshots hold the state of the bank for the parameters of the
+// cached render, and the existing output was rendered with them too. Other
+// gains or latency settings need a full render.
+void Rerender(const std::string& input_path, const std::string& output_path,
+              const std::vector<float>& filter_gains, RenderCache& cache) {
+  SndfileHandle input_file(input_path.c_str());
+  QCHECK(input_file) << input_file.strError();
+  SndfileHandle output_file(output_path.c_str(), SFM_RDWR);
+  QCHECK(output_file) << output_file.strError();
+  const size_t num_channels = input_file.channels();
+  const size_t samplerate = input_file.samplerate();
+  QCHECK_EQ(output_file.channels(), num_channels);
+  std::vector<float> input(num_channels * kBlockSize);
+  std::vector<float> output(num_channels * kBlockSize);
+  std::vector<float> previous(num_channels * kBlockSize);
+  QCHECK(!cache.mismatched())
+      << "The render cache is from a render with other parameters, so the "
+         "output has to be rendered again in full.";
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  RotatorFilterBank rotbank(kNumRotators, num_channels, samplerate,
+                            num_threads, filter_gains,
+                            absl::GetFlag(FLAGS_gain),
+                            LatencyBudget(samplerate), GetLatencyFit());
+  std::vector<float> history(num_channels * (rotbank.history_mask_ + 1));
+
+  int64_t total_in = 0;
+  const BankSnapshot* snapshot =
+      cache.Find(absl::GetFlag(FLAGS_rerender_from) * samplerate);
+  if (snapshot) {
+    rotbank.Restore(*snapshot, history.data());
+    total_in = snapshot->position;
+  }
+  int64_t total_out = std::max<int64_t>(0, total_in - rotbank.max_delay_);
+  QCHECK_EQ(input_file.seek(total_in, SEEK_SET), total_in);
+  // Output frames from here on depend on the edited input only through the
+  // state of the bank.
+  const int64_t unchanged_from =
+      absl::GetFlag(FLAGS_rerender_to) >= 0
+          ? absl::GetFlag(FLAGS_rerender_to) * samplerate
+          : std::numeric_limits<int64_t>::max();
+  // Frames within a step of the sample format of the output agree with it,
+  // which also covers the rounding of reading the existing output back.
+  const float tolerance =
+      (output_file.format() & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16
+          ? 1.0f / (1 << 15)
+          : 1.0f / (1 << 23);
+  // Start of the run of output frames that agree with the existing output.
+  int64_t agreeing_from = unchanged_from;
+  fprintf(stderr, "Re-rendering from frame %zu\n",
+          static_cast<size_t>(total_in));
+
+  const int64_t snapshot_interval = SnapshotInterval(samplerate);
+  bool done = false;
+  bool converged = false;
+  while (!done && !converged) {
+    int64_t read = input_file.readf(input.data(), kBlockSize);
+    if (read == 0) {
+      done = true;
+      read = total_in - total_out;
+      std::fill(input.begin(), input.begin() + read * num_channels, 0);
+    }
+    for (int i = 0; i < read; ++i) {
+      size_t histo_ix =
+          num_channels * ((i + total_in) & rotbank.history_mask_);
+      for (size_t c = 0; c < num_channels; ++c) {
+        history[histo_ix + c] = input[num_channels * i + c];
+      }
+    }
+    // The same path as the render that filled the cache.
+    const int64_t output_len =
+        num_threads > 1
+            ? rotbank.FilterAllChannelParallel(history.data(), total_in, read,
+                                               output.data(), output.size())
+            : rotbank.FilterAllSingleThreaded(history.data(), total_in, read,
+                                              IDENTITY, output.data(),
+                                              output.size());
+    int64_t write_len = output_len;
+    if (total_out + output_len > unchanged_from) {
+      QCHECK_EQ(output_file.seek(total_out, SEEK_SET | SFM_READ), total_out);
+      const int64_t previous_len =
+          output_file.readf(previous.data(), output_len);
+      for (int64_t i = std::max<int64_t>(0, unchanged_from - total_out);
+           i < output_len; ++i) {
+        bool agrees = i < previous_len;
+        for (size_t c = 0; agrees && c < num_channels; ++c) {
+          agrees = std::abs(output[i * num_channels + c] -
+                            previous[i * num_channels + c]) < tolerance;
+        }
+        if (!agrees) agreeing_from = total_out + i + 1;
+      }
+      if (total_out + output_len - agreeing_from >= kBlockSize) {
+        converged = true;
+        write_len = std::max<int64_t>(0, agreeing_from - total_out);
+      }
+    }
+    QCHECK_EQ(output_file.seek(total_out, SEEK_SET | SFM_WRITE), total_out);
+    output_file.writef(output.data(), write_len);
+    total_in += read;
+    total_out += write_len;
+    if (read == kBlockSize && total_in % snapshot_interval == 0) {
+      cache.Add(rotbank.Snapshot(history.data(), total_in));
+    }
+  }
+  fprintf(stderr, "Re-rendered up to frame %zu%s\n",
+          static_cast<size_t>(total_out),
+          converged ? ", where it agrees with the previous render" : "");
+  // The later snapshots were taken after the bank converged back to the
+  // same state, unless the input now ends before them.
+  if (done) cache.DropAfter(total_in);
+  cache.Save();
+}
+
 void RecomputeFilterGains(std::vector<float>& filter_gains) {
   for (int iter = 0; iter < 10000; ++iter) {
     float optsum = 0;
@@ -486,14 +969,14 @@ using namespace tabuli;
 int main(int argc, char** argv) {
   std::vector<char*> posargs = absl::ParseCommandLine(argc, argv);
   QCHECK_GE(posargs.size(), 2) << "Usage: " << argv[0] << " <input> [<output>]";
+  if (absl::GetFlag(FLAGS_trace) || !absl::GetFlag(FLAGS_trace_json).empty()) {
+    EnableTracing(absl::GetFlag(FLAGS_trace_json));
+  }
   FilterMode mode = GetFilterMode();
   InputSignal input(posargs[1]);
   size_t freq_channels = mode == IDENTITY ? 1 : kNumRotators;
   OutputSignal output(input.channels(), freq_channels, input.samplerate(),
                       absl::GetFlag(FLAGS_plot_output));
-  if (posargs.size() > 2) {
-    output.SetWavFile(posargs[2]);
-  }
 
   std::vector<float> filter_gains;
   for (int i = 0; i < kNumRotators; ++i) {
@@ -501,6 +984,68 @@ int main(int argc, char** argv) {
   }
   //  RecomputeFilterGains(filter_gains);
 
-  Process(input, output, mode, filter_gains);
+  if (absl::GetFlag(FLAGS_internal_samplerate) > 0) {
+    QCHECK(absl::GetFlag(FLAGS_segment_seconds) <= 0 &&
+           absl::GetFlag(FLAGS_rerender_from) < 0)
+        << "Segmented rendering and re-rendering read the input at its own "
+           "sample rate, without --internal_samplerate.";
+  }
+  if (absl::GetFlag(FLAGS_max_latency_ms) > 0) {
+    QCHECK(!absl::GetFlag(FLAGS_multirate) &&
+           !absl::GetFlag(FLAGS_fft_convolution))
+        << "The latency budget applies to the plain rotator bank.";
+    PrintLatencyErrors(input.samplerate(), filter_gains);
+  }
+  const std::string render_cache = absl::GetFlag(FLAGS_render_cache);
+  if (!render_cache.empty()) {
+    QCHECK(mode == IDENTITY && !absl::GetFlag(FLAGS_multirate) &&
+           !absl::GetFlag(FLAGS_fft_convolution))
+        << "The render cache only holds the state of the rotator bank.";
+  }
+  if (absl::GetFlag(FLAGS_segment_seconds) > 0) {
+    QCHECK(render_cache.empty() && absl::GetFlag(FLAGS_audio_cache).empty())
+        << "Segmented rendering reads the input file directly and keeps no "
+           "snapshots, so it does not use --render_cache or --audio_cache.";
+  }
+  if (absl::GetFlag(FLAGS_limiter_ms) > 0) {
+    QCHECK(mode == IDENTITY && !absl::GetFlag(FLAGS_multirate) &&
+           !absl::GetFlag(FLAGS_fft_convolution))
+        << "The limiter follows the identity output of the rotator bank.";
+    output.SetLimiter(absl::GetFlag(FLAGS_limiter_ms));
+  }
+  if (absl::GetFlag(FLAGS_rerender_from) >= 0) {
+    QCHECK(!render_cache.empty() && posargs.size() > 2)
+        << "Re-rendering needs --render_cache and an existing output.";
+    QCHECK(absl::GetFlag(FLAGS_peak_db) >= 0 &&
+           absl::GetFlag(FLAGS_limiter_ms) <= 0 &&
+           !absl::GetFlag(FLAGS_split_output))
+        << "Re-rendering patches the output as it was rendered.";
+    RenderCache cache(render_cache, CacheFingerprint(input.samplerate(),
+                                                     input.channels(),
+                                                     filter_gains));
+    Rerender(posargs[1], posargs[2], filter_gains, cache);
+    return 0;
+  }
+  if (posargs.size() > 2) {
+    output.SetWavFile(posargs[2]);
+  }
+  if (absl::GetFlag(FLAGS_segment_seconds) > 0) {
+    QCHECK(std::string(posargs[1]).find(':') == std::string::npos)
+        << "Segmented rendering needs a wav input.";
+    PrintScore(ProcessSegments(posargs[1], mode, filter_gains, output));
+  } else {
+    std::unique_ptr<RenderCache> cache;
+    if (!render_cache.empty()) {
+      cache = std::make_unique<RenderCache>(
+          render_cache,
+          CacheFingerprint(input.samplerate(), input.channels(), filter_gains));
+    }
+    // Decodes and resamples ahead on a thread of its own.
+    AsyncReader<InputSignal> async_input(input);
+    PrintScore(Process(async_input, output, mode, filter_gains, [] {},
+                       TraceProgress, cache.get()));
+  }
+  output.Finish();
+  ReportTracing(input.samplerate());
   CreatePlot(input, output, mode);
 }
@@ -0,0 +1,374 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Times the inner kernels of the renderers one at a time and reads the
+// hardware performance counters around them, to tell whether a kernel is
+// bound by computation or by memory:
+//
+//   increment_all   Rotators::IncrementAll, once per frame
+//   get_sample_all  Rotators::GetSampleAll, once per frame and channel
+//   gather          the history gather of FilterAllSingleThreaded, which
+//                   stages the delayed input of each rotator
+//   filter_all      RotatorFilterBank::FilterAllSingleThreaded as a whole
+//   stft            the windowed FFT and the inverse FFT of angular
+//   mux_transpose   the bit transpose of the cclvi mux, 256 channels
+//
+// Usage: kernel_benchmark [--kernels=gather,stft] [--seconds=10]
+//
+// For each kernel it prints the time, cycles, cache and branch misses per
+// input frame, the instructions per cycle, the bytes of data that the kernel
+// touches per frame and the bytes that it brings in from memory, estimated
+// from the last level cache misses. A low IPC with memory traffic close to
+// the touched bytes points at memory; a low IPC without it at dependency
+// chains. Without counters (in containers or on other systems), only the
+// times are printed.
+
+#include <fftw3.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "absl/strings/str_split.h"
+#include "denormals.h"
+#include "fourier_bank.h"
+#include "perf_counters.h"
+
+ABSL_FLAG(std::string, kernels, "all",
+          "Comma-separated kernels to run, or all.");
+ABSL_FLAG(double, seconds, 10, "Length of audio that each kernel processes.");
+ABSL_FLAG(int, channels, 2, "Number of channels of the rotator kernels.");
+ABSL_FLAG(int, samplerate, 48000, "Sample rate.");
+ABSL_FLAG(int, window_size, 4096, "FFT window size of the stft kernel.");
+ABSL_FLAG(int, overlap, 64, "How much the FFTs of the stft kernel overlap.");
+ABSL_FLAG(int, stft_output_channels, 120,
+          "Number of output channels of the stft kernel.");
+ABSL_FLAG(bool, counters, true,
+          "If set, reads the hardware performance counters.");
+
+namespace tabuli {
+namespace {
+
+// Keeps the results of the kernels alive.
+volatile float sink;
+
+struct Kernel {
+  const char *name;
+  // Bytes of input, output and state that one frame reads or writes.
+  double bytes_per_frame;
+  // Processes the given number of frames.
+  std::function<void(int64_t frames)> run;
+};
+
+std::vector<float> Noise(size_t n) {
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0, 0.1);
+  std::vector<float> v(n);
+  for (float &x : v) x = noise(rng);
+  return v;
+}
+
+// Bank over one second of noise, so that its accumulators are not silent.
+std::unique_ptr<RotatorFilterBank> WarmBank(size_t num_channels,
+                                            size_t samplerate) {
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  auto bank = std::make_unique<RotatorFilterBank>(
+      kNumRotators, num_channels, samplerate, /*num_threads=*/1, filter_gains,
+      /*global_gain=*/1.0);
+  const std::vector<float> history =
+      Noise(num_channels * (bank->history_mask_ + 1));
+  std::vector<float> output(num_channels * kBlockSize);
+  for (int64_t total_in = 0; total_in < samplerate; total_in += kBlockSize) {
+    bank->FilterAllSingleThreaded(history.data(), total_in, kBlockSize,
+                                  IDENTITY, output.data(), output.size());
+  }
+  return bank;
+}
+
+std::vector<Kernel> RotatorKernels(size_t num_channels, size_t samplerate) {
+  std::shared_ptr<RotatorFilterBank> bank = WarmBank(num_channels, samplerate);
+  Rotators &r = *bank->rotators_;
+  const double shared_state = sizeof(r.rot) + sizeof(r.step) +
+                              sizeof(r.phase) + sizeof(r.window);
+  const double accu_state = num_channels * (sizeof(PerChannel::accu) +
+                                            sizeof(PerChannel::precise_accu));
+  auto history = std::make_shared<std::vector<float>>(
+      Noise(num_channels * (bank->history_mask_ + 1)));
+  auto staged = std::make_shared<std::vector<float>>(bank->staged_input_);
+  auto output =
+      std::make_shared<std::vector<float>>(num_channels * kBlockSize);
+  return {
+      {"increment_all", shared_state + 2 * accu_state,
+       [bank](int64_t frames) {
+         ScopedFlushDenormals flush_denormals;
+         for (int64_t i = 0; i < frames; ++i) bank->rotators_->IncrementAll();
+         sink = bank->rotators_->channel[0].accu[4][kNumRotators - 1];
+       }},
+      {"get_sample_all", accu_state / 3 + sizeof(r.rot) / 2,
+       [bank, num_channels](int64_t frames) {
+         float sum = 0;
+         for (int64_t i = 0; i < frames; ++i) {
+           for (size_t c = 0; c < num_channels; ++c) {
+             sum += bank->rotators_->GetSampleAll(c);
+           }
+         }
+         sink = sum;
+       }},
+      // As in FilterChannels, with all rotators active.
+      {"gather",
+       sizeof(r.advance) + 2.0 * num_channels * kNumRotators * sizeof(float),
+       [bank, history, staged, num_channels](int64_t frames) {
+         const int16_t *advance = bank->rotators_->advance;
+         const int64_t mask = bank->history_mask_;
+         const size_t frame_stride = num_channels * kNumRotators;
+         const int64_t staged_frames = staged->size() / frame_stride;
+         for (int64_t i = 0; i < frames; i += staged_frames) {
+           const int64_t n = std::min(staged_frames, frames - i);
+           for (int k = 0; k < kNumRotators; ++k) {
+             int64_t ix = (i - advance[k]) & mask;
+             float *to = &(*staged)[k];
+             for (int64_t j = 0; j < n;) {
+               const int64_t run = std::min(n - j, mask + 1 - ix);
+               const float *frame = &(*history)[num_channels * ix];
+               for (int64_t m = 0; m < run; ++m) {
+                 for (size_t c = 0; c < num_channels; ++c) {
+                   to[c * kNumRotators] = frame[c];
+                 }
+                 frame += num_channels;
+                 to += frame_stride;
+               }
+               j += run;
+               ix = 0;
+             }
+           }
+           sink = (*staged)[i % staged->size()];
+         }
+       }},
+      {"filter_all",
+       shared_state + 2 * accu_state + sizeof(r.advance) +
+           2.0 * num_channels * kNumRotators * sizeof(float) +
+           2.0 * num_channels * sizeof(float),
+       [bank, history, output](int64_t frames) {
+         for (int64_t total_in = 0; total_in < frames;
+              total_in += kBlockSize) {
+           const int64_t len = std::min(kBlockSize, frames - total_in);
+           bank->FilterAllSingleThreaded(history->data(), total_in, len,
+                                         IDENTITY, output->data(),
+                                         output->size());
+         }
+       }},
+  };
+}
+
+struct FFTWDeleter {
+  void operator()(void *p) const { fftwf_free(p); }
+};
+
+// The FFTs of angular.cc, with the panning between them reduced to a copy of
+// each bin to one of the output channels.
+Kernel StftKernel() {
+  const int window_size = absl::GetFlag(FLAGS_window_size);
+  const int skip_size = window_size / absl::GetFlag(FLAGS_overlap);
+  const int output_channels = absl::GetFlag(FLAGS_stft_output_channels);
+  QCHECK_GT(skip_size, 0);
+  struct Buffers {
+    std::unique_ptr<fftwf_complex[], FFTWDeleter> input_fft, output_fft;
+    std::unique_ptr<float[], FFTWDeleter> windowed_input, synthesized_output;
+    std::vector<float> input, window_function;
+    fftwf_plan fft, ifft;
+  };
+  auto b = std::make_shared<Buffers>();
+  b->input_fft.reset(fftwf_alloc_complex(2 * (window_size / 2 + 1)));
+  b->output_fft.reset(
+      fftwf_alloc_complex(output_channels * (window_size / 2 + 1)));
+  b->windowed_input.reset(fftwf_alloc_real(2 * window_size));
+  b->synthesized_output.reset(fftwf_alloc_real(output_channels * window_size));
+  b->input = Noise(2 * window_size);
+  for (int i = 0; i < window_size; ++i) {
+    const float sine = std::sin(i * M_PI / (window_size - 1));
+    b->window_function.push_back(sine * sine);
+  }
+  b->fft = fftwf_plan_many_dft_r2c(
+      /*rank=*/1, /*n=*/&window_size, /*howmany=*/2,
+      /*in=*/b->windowed_input.get(), /*inembed=*/nullptr, /*istride=*/2,
+      /*idist=*/1, /*out=*/b->input_fft.get(), /*onembed=*/nullptr,
+      /*ostride=*/2, /*odist=*/1, /*flags=*/FFTW_MEASURE | FFTW_DESTROY_INPUT);
+  b->ifft = fftwf_plan_many_dft_c2r(
+      /*rank=*/1, /*n=*/&window_size, /*howmany=*/output_channels,
+      /*in=*/b->output_fft.get(), /*inembed=*/nullptr,
+      /*istride=*/output_channels, /*idist=*/1,
+      /*out=*/b->synthesized_output.get(), /*onembed=*/nullptr,
+      /*ostride=*/output_channels, /*odist=*/1,
+      /*flags=*/FFTW_MEASURE | FFTW_DESTROY_INPUT);
+  // Each hop windows and transforms the two input channels and transforms
+  // back all output channels.
+  const double bytes_per_hop =
+      sizeof(float) * (2 * 2 * window_size + window_size +
+                       2 * 2 * (window_size / 2 + 1) +
+                       2 * output_channels * (window_size / 2 + 1) +
+                       output_channels * window_size);
+  return {"stft", bytes_per_hop / skip_size,
+          [b, window_size, skip_size, output_channels](int64_t frames) {
+            for (int64_t hop = 0; hop < frames; hop += skip_size) {
+              for (int i = 0; i < window_size; ++i) {
+                b->windowed_input[2 * i] =
+                    b->window_function[i] * b->input[2 * i];
+                b->windowed_input[2 * i + 1] =
+                    b->window_function[i] * b->input[2 * i + 1];
+              }
+              fftwf_execute(b->fft);
+              std::fill_n(&b->output_fft[0][0],
+                          2 * output_channels * (window_size / 2 + 1), 0.f);
+              for (int i = 0; i < window_size / 2 + 1; ++i) {
+                std::copy_n(b->input_fft[2 * i], 2,
+                            b->output_fft[i * output_channels +
+                                          i % output_channels]);
+              }
+              fftwf_execute(b->ifft);
+            }
+            sink = b->synthesized_output[0];
+          }};
+}
+
+// The transpose of tools/cclvi_v1/mux.cc, which is built on its own: for
+// each group of 16 channels, word w holds bit 15 - w of the sample of each
+// channel.
+Kernel MuxTransposeKernel() {
+  constexpr size_t kNumChannels = 256;
+  constexpr size_t kChannelsPerGroup = 16;
+  constexpr int64_t kFrames = 1 << 12;
+  auto input = std::make_shared<std::vector<uint16_t>>(kNumChannels * kFrames);
+  std::mt19937 rng(0);
+  for (uint16_t &v : *input) v = rng();
+  auto output = std::make_shared<std::vector<uint8_t>>(2 * kNumChannels *
+                                                       kFrames);
+  return {"mux_transpose", 4.0 * kNumChannels,
+          [input, output](int64_t frames) {
+            for (int64_t f = 0; f < frames; ++f) {
+              const int64_t s = f % kFrames;
+              const uint16_t *src = &(*input)[s * kNumChannels];
+              uint8_t *dst = &(*output)[s * 2 * kNumChannels];
+              for (size_t c = 0; c < kNumChannels / kChannelsPerGroup; ++c) {
+                const uint16_t *samples = src + c * kChannelsPerGroup;
+                for (size_t w = 0; w < 16; ++w) {
+                  uint16_t result = 0;
+                  for (size_t p = 0; p < kChannelsPerGroup; ++p) {
+                    result |= ((samples[p] >> (15 - w)) & 1) << p;
+                  }
+                  dst[c * 32 + 2 * w] = result & 0xFF;
+                  dst[c * 32 + 2 * w + 1] = result >> 8;
+                }
+              }
+            }
+            sink = (*output)[0];
+          }};
+}
+
+void Run() {
+  const size_t num_channels = absl::GetFlag(FLAGS_channels);
+  const size_t samplerate = absl::GetFlag(FLAGS_samplerate);
+  const int64_t frames = absl::GetFlag(FLAGS_seconds) * samplerate;
+  const std::string selection = absl::GetFlag(FLAGS_kernels);
+  const std::vector<std::string> selected =
+      absl::StrSplit(selection, ',', absl::SkipEmpty());
+  auto wanted = [&](const char *name) {
+    return selection == "all" ||
+           std::find(selected.begin(), selected.end(), name) != selected.end();
+  };
+
+  std::vector<Kernel> kernels;
+  if (wanted("increment_all") || wanted("get_sample_all") ||
+      wanted("gather") || wanted("filter_all")) {
+    for (Kernel &kernel : RotatorKernels(num_channels, samplerate)) {
+      if (wanted(kernel.name)) kernels.push_back(std::move(kernel));
+    }
+  }
+  if (wanted("stft")) kernels.push_back(StftKernel());
+  if (wanted("mux_transpose")) kernels.push_back(MuxTransposeKernel());
+  QCHECK(!kernels.empty()) << "No kernel in --kernels=" << selection;
+
+  std::unique_ptr<PerfCounters> counters;
+  if (absl::GetFlag(FLAGS_counters)) {
+    counters = std::make_unique<PerfCounters>();
+    if (!counters->available()) {
+      fprintf(stderr,
+              "Hardware counters are not available (perf_event_open: %s), "
+              "timing only.\n",
+              strerror(counters->error()));
+      counters.reset();
+    }
+  }
+
+  fprintf(stdout, "%-15s %9s %9s %6s %9s %9s %9s %9s %9s\n", "kernel",
+          "ns/frame", "cyc/frame", "IPC", "L1d/frame", "LLC/frame",
+          "br/frame", "B/frame", "mem/frame");
+  for (const Kernel &kernel : kernels) {
+    // Once to fault in the buffers and settle the clock.
+    kernel.run(std::min<int64_t>(frames, samplerate / 10));
+    if (counters) counters->Start();
+    const auto start = std::chrono::steady_clock::now();
+    kernel.run(frames);
+    const double ns = std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    const PerfCounts counts = counters ? counters->Stop() : PerfCounts();
+    auto per_frame = [&](PerfEvent event, char *buf) {
+      if (!counts.valid[event]) return strcpy(buf, "-");
+      snprintf(buf, 16, "%.2f", static_cast<double>(counts.value[event]) /
+                                    frames);
+      return buf;
+    };
+    char cycles[16], l1d[16], llc[16], branches[16], ipc[16] = "-",
+                                                     memory[16] = "-";
+    if (counts.valid[kPerfCycles] && counts.valid[kPerfInstructions] &&
+        counts.value[kPerfCycles] > 0) {
+      snprintf(ipc, sizeof(ipc), "%.2f",
+               static_cast<double>(counts.value[kPerfInstructions]) /
+                   counts.value[kPerfCycles]);
+    }
+    if (counts.valid[kPerfLlcMisses]) {
+      // A miss brings in a cache line.
+      snprintf(memory, sizeof(memory), "%.1f",
+               64.0 * counts.value[kPerfLlcMisses] / frames);
+    }
+    fprintf(stdout, "%-15s %9.2f %9s %6s %9s %9s %9s %9.0f %9s\n",
+            kernel.name, ns / frames, per_frame(kPerfCycles, cycles), ipc,
+            per_frame(kPerfL1dMisses, l1d), per_frame(kPerfLlcMisses, llc),
+            per_frame(kPerfBranchMisses, branches), kernel.bytes_per_frame,
+            memory);
+  }
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  tabuli::Run();
+}
@@ -0,0 +1,104 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Runs LookaheadLimiter over transients and noise above its ceiling, and
+// checks that no output sample exceeds the ceiling, including a full-scale
+// transient at the first frame, and that the output is the input delayed by
+// the lookahead and scaled by a gain of at most 1.
+//
+// Usage: limiter_check [--lookahead_ms=5] [--ceiling_db=-1]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "normalize.h"
+
+ABSL_FLAG(double, lookahead_ms, 5, "Lookahead of the limiter.");
+ABSL_FLAG(double, ceiling_db, -1, "Ceiling of the limiter in dBFS.");
+
+namespace tabuli {
+namespace {
+
+constexpr size_t kSampleRate = 48000;
+constexpr size_t kChannels = 2;
+
+// Limits input in blocks of block_frames, and returns whether the output is
+// below the ceiling and a gained copy of the delayed input.
+bool CheckSignal(const std::string &name, const std::vector<float> &input,
+                 int64_t block_frames) {
+  const float ceiling = std::pow(10.0, absl::GetFlag(FLAGS_ceiling_db) / 20);
+  LookaheadLimiter limiter(kChannels, kSampleRate, ceiling,
+                           absl::GetFlag(FLAGS_lookahead_ms));
+  std::vector<float> output;
+  const int64_t num_frames = input.size() / kChannels;
+  for (int64_t i = 0; i < num_frames; i += block_frames) {
+    const int64_t n = std::min(block_frames, num_frames - i);
+    limiter.Process(&input[i * kChannels], n, &output);
+  }
+  limiter.Flush(&output);
+  bool ok = output.size() == input.size();
+  float peak = 0;
+  float worst_gain = 0;
+  for (size_t i = 0; ok && i < output.size(); ++i) {
+    peak = std::max(peak, std::abs(output[i]));
+    if (std::abs(input[i]) > 1e-6f) {
+      worst_gain = std::max(worst_gain, output[i] / input[i]);
+    }
+  }
+  // The window sum is a running double, which may round above the lowest
+  // gain by a few ulp.
+  ok &= peak <= ceiling * (1 + 1e-5f) && worst_gain <= 1 + 1e-5f;
+  fprintf(stdout, "%-20s peak %.6f (ceiling %.6f), gain at most %.6f: %s\n",
+          name.c_str(), peak, ceiling, worst_gain, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int Run() {
+  const int64_t lookahead = std::lround(absl::GetFlag(FLAGS_lookahead_ms) *
+                                        1e-3 * kSampleRate);
+  const int64_t num_frames = kSampleRate / 2;
+  bool ok = true;
+  for (const int64_t at : {int64_t{0}, int64_t{1}, lookahead / 2, lookahead,
+                           lookahead + 1, int64_t{1000}}) {
+    std::vector<float> input(kChannels * num_frames, 0.01f);
+    input[kChannels * at] = 1.0f;
+    input[kChannels * at + 1] = -1.0f;
+    for (const int64_t block : {int64_t{1}, int64_t{256}, num_frames}) {
+      ok &= CheckSignal("transient at " + std::to_string(at) + "/" +
+                            std::to_string(block),
+                        input, block);
+    }
+  }
+  std::mt19937 rng(0);
+  std::normal_distribution<float> dist(0, 0.5f);
+  std::vector<float> noise(kChannels * num_frames);
+  for (float &x : noise) x = dist(rng);
+  ok &= CheckSignal("noise", noise, 1000);
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  return tabuli::Run();
+}
@@ -0,0 +1,295 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "multirate_bank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "denormals.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+namespace {
+
+// Halfband lowpass used both for decimation and interpolation. Every other
+// tap is zero apart from the center one, so the polyphase implementation
+// only multiplies with the odd taps.
+constexpr int kHalfbandTaps = 15;
+constexpr int kHalfbandDelay = (kHalfbandTaps - 1) / 2;
+
+// Interpolated samples of level + 1 are consumed this many samples late, so
+// that the deeper level has always produced the samples needed.
+constexpr int64_t kInterpolationLag = 2;
+
+// Ring size of the combined tier outputs; must hold kHalfbandTaps / 2 +
+// kInterpolationLag samples of the deeper level.
+constexpr int64_t kCombinedSize = 32;
+constexpr int64_t kCombinedMask = kCombinedSize - 1;
+
+// A rotator runs at level L only if its frequency is at most
+// (samplerate >> L) / kTierHeadroom, which leaves the halfband transition
+// band and the integrator skirts out of the aliased range.
+constexpr float kTierHeadroom = 8.0f;
+
+const float *HalfbandFilter() {
+  static const std::vector<float> *filter = [] {
+    // Blackman-windowed sinc with cutoff at a quarter of the sample rate.
+    auto *taps = new std::vector<float>(kHalfbandTaps);
+    double sum = 0;
+    for (int k = 0; k < kHalfbandTaps; ++k) {
+      const int offset = k - kHalfbandDelay;
+      double sinc = 0.5;
+      if (offset != 0) {
+        if (offset % 2 == 0) continue;
+        sinc = std::sin(0.5 * M_PI * offset) / (M_PI * offset);
+      }
+      const double x = (k + 1.0) / (kHalfbandTaps + 1.0);
+      const double window = 0.42 - 0.5 * std::cos(2 * M_PI * x) +
+                            0.08 * std::cos(4 * M_PI * x);
+      (*taps)[k] = sinc * window;
+      sum += (*taps)[k];
+    }
+    for (float &tap : *taps) tap /= sum;
+    return taps;
+  }();
+  return filter->data();
+}
+
+// Delay in input samples of a signal that goes down to the given level and
+// is interpolated back to the input rate.
+int64_t DecimationChainDelay(int level) {
+  return (2 * kHalfbandDelay + 1) * ((int64_t{1} << level) - 1);
+}
+
+int64_t NextPowerOfTwo(int64_t v) {
+  int64_t p = 1;
+  while (p < v) p <<= 1;
+  return p;
+}
+
+}  // namespace
+
+MultirateRotatorFilterBank::MultirateRotatorFilterBank(
+    size_t num_rotators, size_t num_channels, size_t samplerate,
+    const std::vector<float> &filter_gains, float global_gain, int max_level) {
+  num_rotators_ = num_rotators;
+  num_channels_ = num_channels;
+  std::vector<float> freqs(num_rotators);
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (num_rotators_ - 1));
+  }
+  // The full-rate bank defines windows, gains and the band alignment that
+  // the tiers reproduce.
+  const Rotators reference(0, freqs, filter_gains, samplerate, global_gain);
+
+  std::vector<int> level(num_rotators_);
+  int num_levels = 1;
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    int l = 0;
+    while (l < max_level &&
+           freqs[i] * kTierHeadroom * (2 << l) <= samplerate) {
+      ++l;
+    }
+    level[i] = l;
+    num_levels = std::max(num_levels, l + 1);
+  }
+
+  // Extra delay so that even the slowest rotator has a non-negative advance
+  // after the decimation chain delay is taken out.
+  int64_t extra_delay = 0;
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    extra_delay = std::max(extra_delay, DecimationChainDelay(level[i]) -
+                                            reference.advance[i]);
+  }
+  max_delay_ = reference.max_delay_ + extra_delay;
+  QCHECK_LE(max_delay_, kBlockSize);
+  history_mask_ = HistorySize(max_delay_) - 1;
+  fprintf(stderr, "Multirate rotator bank output delay: %zu\n", max_delay_);
+
+  tiers_.resize(num_levels);
+  for (int l = 0; l < num_levels; ++l) tiers_[l].level = l;
+  for (size_t i = 0; i < num_rotators_; ++i) {
+    RotatorTier &tier = tiers_[level[i]];
+    const int64_t decimation = int64_t{1} << tier.level;
+    const double w = reference.window[i];
+    const double wd = std::pow(w, decimation);
+    // Each leaking integrator has a DC gain of 1 / (1 - window), and the
+    // first one also sees one extra window multiplication.
+    const double gain = reference.gain[i] * (w / wd) *
+                        std::pow((1.0 - wd) / (1.0 - w), 3.0);
+    const double f = freqs[i] * 2.0 * M_PI / samplerate;
+    // The mean delay of the triple leaking integration is 3 w / (1 - w), and
+    // shrinks slightly when the integration runs at the decimated rate.
+    const double envelope_delay =
+        3.0 * w / (1.0 - w) - decimation * 3.0 * wd / (1.0 - wd);
+    const double advance = reference.advance[i] + extra_delay -
+                           DecimationChainDelay(tier.level) + envelope_delay;
+    const int64_t decimated_advance = std::floor(advance / decimation);
+    // The fractional advance in decimated samples and the one sample phase
+    // lead of the output rotator, which is one decimated step long here, are
+    // compensated by rotating the carrier on output. The envelope delay
+    // must not move the carrier.
+    const double carrier_delay = advance - decimated_advance * decimation +
+                                 (decimation - 1) - envelope_delay;
+    tier.index.push_back(i);
+    tier.rot[0].push_back(std::cos(f * decimation));
+    tier.rot[1].push_back(-std::sin(f * decimation));
+    tier.rot[2].push_back(std::sqrt(gain));
+    tier.rot[3].push_back(0.0f);
+    tier.window.push_back(wd);
+    tier.gain.push_back(gain);
+    tier.out_rot[0].push_back(std::cos(f * carrier_delay));
+    tier.out_rot[1].push_back(std::sin(f * carrier_delay));
+    tier.advance.push_back(decimated_advance);
+  }
+  for (RotatorTier &tier : tiers_) {
+    tier.accu.resize(num_channels_ * 6 * tier.size());
+    tier.combined.resize(num_channels_ * kCombinedSize);
+    if (tier.level == 0) continue;
+    int64_t max_advance = 0;
+    for (int64_t advance : tier.advance) {
+      max_advance = std::max(max_advance, advance);
+    }
+    const int64_t size = NextPowerOfTwo(max_advance + kHalfbandTaps + 1);
+    tier.history.resize(num_channels_ * size);
+    tier.history_mask = size - 1;
+  }
+  tier_output_.resize(num_channels_);
+}
+
+void MultirateRotatorFilterBank::Step(size_t level, int64_t ix,
+                                      const float *history,
+                                      int64_t history_mask) {
+  const size_t nc = num_channels_;
+  const float *halfband = HalfbandFilter();
+  RotatorTier &tier = tiers_[level];
+
+  // Decimate: every odd sample of this level produces one of the next.
+  if (level + 1 < tiers_.size() && (ix & 1)) {
+    RotatorTier &next = tiers_[level + 1];
+    const int64_t next_ix = ix >> 1;
+    float *dst = &next.history[nc * (next_ix & next.history_mask)];
+    std::fill(dst, dst + nc, 0.0f);
+    for (int k = 0; k < kHalfbandTaps; ++k) {
+      if (halfband[k] == 0) continue;
+      const float *src = &history[nc * ((ix - k) & history_mask)];
+      for (size_t c = 0; c < nc; ++c) {
+        dst[c] += halfband[k] * src[c];
+      }
+    }
+    Step(level + 1, next_ix, next.history.data(), next.history_mask);
+  }
+
+  float *out = level == 0 ? tier_output_.data()
+                          : &tier.combined[nc * (ix & kCombinedMask)];
+  std::fill(out, out + nc, 0.0f);
+
+  const size_t n = tier.size();
+  if (n != 0) {
+    for (size_t c = 0; c < nc; ++c) {
+      float *accu = &tier.accu[c * 6 * n];
+      for (size_t k = 0; k < n; ++k) {
+        const float delayed =
+            history[nc * ((ix - tier.advance[k]) & history_mask) + c];
+        accu[0 * n + k] += tier.rot[2][k] * delayed;
+        accu[1 * n + k] += tier.rot[3][k] * delayed;
+      }
+    }
+    for (size_t k = 0; k < n; ++k) {
+      const float tr =
+          tier.rot[0][k] * tier.rot[2][k] - tier.rot[1][k] * tier.rot[3][k];
+      const float tc =
+          tier.rot[0][k] * tier.rot[3][k] + tier.rot[1][k] * tier.rot[2][k];
+      tier.rot[2][k] = tr;
+      tier.rot[3][k] = tc;
+    }
+    for (size_t c = 0; c < nc; ++c) {
+      float *accu = &tier.accu[c * 6 * n];
+      for (size_t k = 0; k < n; ++k) {
+        const float w = tier.window[k];
+        accu[0 * n + k] *= w;
+        accu[1 * n + k] *= w;
+        accu[2 * n + k] *= w;
+        accu[3 * n + k] *= w;
+        accu[4 * n + k] *= w;
+        accu[5 * n + k] *= w;
+        accu[2 * n + k] += accu[0 * n + k];
+        accu[3 * n + k] += accu[1 * n + k];
+        accu[4 * n + k] += accu[2 * n + k];
+        accu[5 * n + k] += accu[3 * n + k];
+      }
+    }
+    for (size_t k = 0; k < n; ++k) {
+      const float re = tier.rot[2][k] * tier.out_rot[0][k] -
+                       tier.rot[3][k] * tier.out_rot[1][k];
+      const float im = tier.rot[2][k] * tier.out_rot[1][k] +
+                       tier.rot[3][k] * tier.out_rot[0][k];
+      for (size_t c = 0; c < nc; ++c) {
+        const float *accu = &tier.accu[c * 6 * n];
+        out[c] += re * accu[4 * n + k] + im * accu[5 * n + k];
+      }
+    }
+  }
+
+  // Interpolate the deeper levels: zero-stuffed upsampling by two, so only
+  // the taps with the parity of the output index contribute.
+  if (level + 1 < tiers_.size()) {
+    const RotatorTier &next = tiers_[level + 1];
+    const int64_t q = ix - kInterpolationLag;
+    for (int k = q & 1; k < kHalfbandTaps; k += 2) {
+      if (halfband[k] == 0) continue;
+      const float *src =
+          &next.combined[nc * (((q - k) >> 1) & kCombinedMask)];
+      for (size_t c = 0; c < nc; ++c) {
+        out[c] += 2.0f * halfband[k] * src[c];
+      }
+    }
+  }
+}
+
+int64_t MultirateRotatorFilterBank::FilterAll(const float *history,
+                                              int64_t total_in, int64_t len,
+                                              float *output,
+                                              size_t output_size) {
+  ScopedFlushDenormals flush_denormals;
+  for (RotatorTier &tier : tiers_) {
+    for (size_t k = 0; k < tier.size(); ++k) {
+      if (tier.gain[k] == 0.0f) continue;  // Above the Nyquist frequency.
+      const float norm =
+          std::sqrt(tier.gain[k] / (tier.rot[2][k] * tier.rot[2][k] +
+                                    tier.rot[3][k] * tier.rot[3][k]));
+      tier.rot[2][k] *= norm;
+      tier.rot[3][k] *= norm;
+    }
+  }
+  size_t out_ix = 0;
+  for (int64_t i = 0; i < len; ++i) {
+    Step(0, total_in + i, history, history_mask_);
+    if (total_in + i >= max_delay_) {
+      for (size_t c = 0; c < num_channels_; ++c) {
+        output[out_ix * num_channels_ + c] = HardClip(tier_output_[c]);
+      }
+      ++out_ix;
+    }
+  }
+  return out_ix;
+}
+
+}  // namespace tabuli
@@ -0,0 +1,137 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares MultirateRotatorFilterBank with the full-rate bank on noise at
+// several sample rates. Below about 40 kHz the highest rotators are above
+// the Nyquist frequency and have zero gain, which the multirate bank has to
+// skip like the full-rate one.
+//
+// Usage: multirate_check [--samplerates=32000,44100,48000]
+//
+// Fails if the state of any tier is not finite, or if the difference to the
+// full-rate output is above --max_error_db.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "fourier_bank.h"
+#include "multirate_bank.h"
+
+ABSL_FLAG(std::string, samplerates, "32000,44100,48000",
+          "Comma-separated sample rates to check.");
+ABSL_FLAG(double, seconds, 2, "Length of the noise input.");
+ABSL_FLAG(double, max_error_db, -45,
+          "Highest accepted difference to the full-rate output, in dB of "
+          "its power.");
+
+namespace tabuli {
+namespace {
+
+bool TiersFinite(const MultirateRotatorFilterBank &bank) {
+  for (const RotatorTier &tier : bank.tiers_) {
+    for (const std::vector<float> *v :
+         {&tier.rot[0], &tier.rot[1], &tier.rot[2], &tier.rot[3],
+          &tier.accu}) {
+      for (const float x : *v) {
+        if (!std::isfinite(x)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Runs both banks over noise and returns the power of their difference
+// relative to the full-rate output in dB. Sets *finite to whether the
+// multirate state stayed finite.
+double CompareBanks(size_t samplerate, const std::vector<float> &filter_gains,
+                    bool *finite) {
+  const int64_t num_frames = absl::GetFlag(FLAGS_seconds) * samplerate;
+  std::mt19937 rng(0);
+  std::normal_distribution<float> dist(0, 0.05f);
+  std::vector<float> input(num_frames);
+  for (float &x : input) x = dist(rng);
+
+  RotatorFilterBank rotbank(kNumRotators, 1, samplerate, /*num_threads=*/1,
+                            filter_gains, /*global_gain=*/1.0f);
+  MultirateRotatorFilterBank multirate(kNumRotators, 1, samplerate,
+                                       filter_gains, /*global_gain=*/1.0f);
+  const int64_t history_mask =
+      std::max(rotbank.history_mask_, multirate.history_mask_);
+  std::vector<float> history(history_mask + 1);
+  std::vector<float> output(kBlockSize);
+  std::vector<float> expected;
+  std::vector<float> actual;
+  *finite = true;
+  for (int64_t total_in = 0; total_in < num_frames; total_in += kBlockSize) {
+    const int64_t len = std::min(kBlockSize, num_frames - total_in);
+    for (int64_t i = 0; i < len; ++i) {
+      history[(total_in + i) & history_mask] = input[total_in + i];
+    }
+    int64_t output_len = rotbank.FilterAllSingleThreaded(
+        history.data(), total_in, len, IDENTITY, output.data(), output.size());
+    expected.insert(expected.end(), output.begin(),
+                    output.begin() + output_len);
+    output_len = multirate.FilterAll(history.data(), total_in, len,
+                                     output.data(), output.size());
+    actual.insert(actual.end(), output.begin(), output.begin() + output_len);
+    *finite &= TiersFinite(multirate);
+  }
+
+  // Both banks compensate their own delay, so the outputs are aligned.
+  double signal = 0;
+  double noise = 0;
+  for (size_t i = 0; i < std::min(expected.size(), actual.size()); ++i) {
+    const double want = expected[i];
+    signal += want * want;
+    noise += (want - actual[i]) * (want - actual[i]);
+  }
+  return 10 * std::log10(std::max(noise, 1e-30) / signal);
+}
+
+int Run() {
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  bool ok = true;
+  for (const absl::string_view rate :
+       absl::StrSplit(absl::GetFlag(FLAGS_samplerates), ',')) {
+    int samplerate;
+    QCHECK(absl::SimpleAtoi(rate, &samplerate) && samplerate > 0) << rate;
+    bool finite;
+    const double error_db = CompareBanks(samplerate, filter_gains, &finite);
+    fprintf(stdout, "%d Hz: %s, difference %.2f dB\n", samplerate,
+            finite ? "finite" : "NOT FINITE", error_db);
+    ok &= finite && error_db <= absl::GetFlag(FLAGS_max_error_db);
+  }
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  return tabuli::Run();
+}
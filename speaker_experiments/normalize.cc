@@ -0,0 +1,286 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "normalize.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "sndfile.hh"
+
+namespace tabuli {
+
+namespace {
+
+constexpr uint16_t kWaveFormatPcm = 1;
+constexpr uint16_t kWaveFormatFloat = 3;
+constexpr uint16_t kWaveFormatExtensible = 0xfffe;
+
+uint64_t Load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+uint32_t Load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+uint16_t Load16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return v;
+}
+void Store64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+void Store32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+void Store16(uint8_t *p, uint16_t v) { memcpy(p, &v, 2); }
+
+int BytesPerSample(int format) {
+  switch (format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_16:
+      return 2;
+    case SF_FORMAT_PCM_24:
+      return 3;
+    case SF_FORMAT_FLOAT:
+      return 4;
+  }
+  QCHECK(false) << "Unsupported sample format " << format;
+  return 0;
+}
+
+// Scales the float samples of the data chunk of the WAV or RF64 file at path
+// and rewrites them with bytes_per_sample, as PCM unless that is 4. The result
+// is a WAV file if its size fits in the 32 bits of the RIFF header, and an
+// RF64 file otherwise.
+void ScaleInPlace(const std::string &path, float gain, int bytes_per_sample) {
+  const int fd = open(path.c_str(), O_RDWR);
+  QCHECK_GE(fd, 0) << path << ": " << strerror(errno);
+  struct stat st;
+  QCHECK_EQ(fstat(fd, &st), 0) << path << ": " << strerror(errno);
+  const size_t size = st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  QCHECK(map != MAP_FAILED) << path << ": " << strerror(errno);
+  uint8_t *file = static_cast<uint8_t *>(map);
+  const bool rf64 = size >= 12 && memcmp(file, "RF64", 4) == 0;
+  QCHECK(size >= 12 && (rf64 || memcmp(file, "RIFF", 4) == 0) &&
+         memcmp(file + 8, "WAVE", 4) == 0)
+      << path << " is not a WAV file";
+  // The 64-bit sizes of an RF64 file are in the ds64 chunk that comes first:
+  // those of the RIFF and data chunks, and the number of frames.
+  uint8_t *ds64 = file + 20;
+  QCHECK(!rf64 || (size >= 48 && memcmp(file + 12, "ds64", 4) == 0 &&
+                   Load32(file + 16) >= 28))
+      << path << " has no ds64 chunk";
+
+  uint8_t *fmt = nullptr;
+  uint8_t *data = nullptr;
+  size_t data_size = 0;
+  for (size_t pos = 12; pos + 8 <= size;) {
+    const uint32_t chunk_size = Load32(file + pos + 4);
+    if (memcmp(file + pos, "fmt ", 4) == 0) fmt = file + pos + 8;
+    if (memcmp(file + pos, "data", 4) == 0) {
+      data = file + pos + 8;
+      data_size = std::min<size_t>(
+          rf64 && chunk_size == 0xffffffff ? Load64(ds64 + 8) : chunk_size,
+          size - pos - 8);
+      break;
+    }
+    pos += 8 + chunk_size + (chunk_size & 1);
+  }
+  QCHECK(fmt && data) << path << " has no format or data chunk";
+  const uint16_t tag = Load16(fmt);
+  const uint16_t channels = Load16(fmt + 2);
+  QCHECK(Load16(fmt + 14) == 32 &&
+         (tag == kWaveFormatFloat ||
+          (tag == kWaveFormatExtensible && Load16(fmt + 24) == 3)))
+      << path << " does not have float samples";
+
+  // Packing never overtakes the samples that are still to be read.
+  const size_t num_samples = data_size / 4;
+  for (size_t i = 0; i < num_samples; ++i) {
+    float v;
+    memcpy(&v, data + 4 * i, 4);
+    v *= gain;
+    uint8_t *out = data + bytes_per_sample * i;
+    if (bytes_per_sample == 4) {
+      memcpy(out, &v, 4);
+      continue;
+    }
+    const int bits = 8 * bytes_per_sample;
+    const float scale = static_cast<float>(int64_t{1} << (bits - 1));
+    const int32_t s = std::clamp<int64_t>(std::lround(v * scale),
+                                          -(int64_t{1} << (bits - 1)),
+                                          (int64_t{1} << (bits - 1)) - 1);
+    for (int b = 0; b < bytes_per_sample; ++b) out[b] = s >> (8 * b);
+  }
+
+  if (bytes_per_sample != 4) {
+    if (tag == kWaveFormatExtensible) {
+      Store16(fmt + 18, 8 * bytes_per_sample);  // Valid bits per sample.
+      Store16(fmt + 24, kWaveFormatPcm);  // First bytes of the subformat.
+    } else {
+      Store16(fmt, kWaveFormatPcm);
+    }
+    Store32(fmt + 8, Load32(fmt + 4) * channels * bytes_per_sample);
+    Store16(fmt + 12, channels * bytes_per_sample);
+    Store16(fmt + 14, 8 * bytes_per_sample);
+  }
+  const size_t new_data_size = num_samples * bytes_per_sample;
+  size_t new_size = (data - file) + new_data_size;
+  if (new_data_size & 1) data[new_data_size] = 0;  // Pad byte.
+  new_size += new_data_size & 1;
+  if (new_size - 8 < 0xffffffff) {
+    if (rf64) {
+      // The ds64 chunk becomes the placeholder that WAV files reserve for it.
+      memcpy(file, "RIFF", 4);
+      memcpy(file + 12, "JUNK", 4);
+    }
+    Store32(data - 4, new_data_size);
+    Store32(file + 4, new_size - 8);
+  } else {
+    QCHECK(rf64) << path << " is larger than a WAV file can be";
+    Store64(ds64, new_size - 8);
+    Store64(ds64 + 8, new_data_size);
+    Store64(ds64 + 16, num_samples / channels);
+  }
+  QCHECK_EQ(munmap(map, size), 0) << strerror(errno);
+  QCHECK_EQ(ftruncate(fd, new_size), 0) << path << ": " << strerror(errno);
+  close(fd);
+}
+
+}  // namespace
+
+NormalizingWriter::NormalizingWriter(const std::string &path, int format,
+                                     size_t channels, size_t samplerate,
+                                     double peak_db)
+    : path_(path),
+      format_(format),
+      channels_(channels),
+      peak_db_(peak_db),
+      file_(path, /*mode=*/SFM_WRITE,
+            /*format=*/SF_FORMAT_RF64 | SF_FORMAT_FLOAT, channels, samplerate),
+      peak_(channels),
+      energy_(channels) {
+  QCHECK(file_) << path << ": " << file_.strError();
+  QCHECK((format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAV ||
+         (format & SF_FORMAT_TYPEMASK) == SF_FORMAT_RF64);
+  BytesPerSample(format);
+  // The float samples may exceed 4 GB even where the packed ones do not.
+  file_.command(SFC_RF64_AUTO_DOWNGRADE, nullptr, SF_TRUE);
+  // Its peak values would be stale after normalization.
+  file_.command(SFC_SET_ADD_PEAK_CHUNK, nullptr, SF_FALSE);
+}
+
+int64_t NormalizingWriter::writef(const float *data, int64_t nframes) {
+  for (int64_t i = 0; i < nframes; ++i) {
+    for (size_t c = 0; c < channels_; ++c) {
+      const float v = data[i * channels_ + c];
+      peak_[c] = std::max(peak_[c], std::abs(v));
+      energy_[c] += static_cast<double>(v) * v;
+    }
+  }
+  frames_ += nframes;
+  return file_.writef(data, nframes);
+}
+
+float NormalizingWriter::rms(size_t c) const {
+  return frames_ == 0 ? 0.0f : std::sqrt(energy_[c] / frames_);
+}
+
+float NormalizingWriter::Finish() {
+  file_ = SndfileHandle();  // Closes the file.
+  const float peak = *std::max_element(peak_.begin(), peak_.end());
+  const float gain = peak > 0 ? std::pow(10.0, peak_db_ / 20) / peak : 1.0f;
+  double energy = 0;
+  for (double e : energy_) energy += e;
+  fprintf(stderr, "%s: peak %.2f dBFS, RMS %.2f dBFS, normalized by %+.2f dB\n",
+          path_.c_str(), 20 * std::log10(std::max(peak, 1e-30f)),
+          10 * std::log10(std::max(energy / std::max<int64_t>(frames_, 1) /
+                                       channels_,
+                                   1e-30)),
+          20 * std::log10(gain));
+  ScaleInPlace(path_, gain, BytesPerSample(format_));
+  return gain;
+}
+
+LookaheadLimiter::LookaheadLimiter(size_t channels, size_t samplerate,
+                                   float ceiling, double lookahead_ms,
+                                   double release_ms)
+    : channels_(channels),
+      ceiling_(ceiling),
+      lookahead_(std::max<int64_t>(1, std::lround(lookahead_ms * 1e-3 *
+                                                  samplerate))),
+      release_(std::exp(-1.0 / (release_ms * 1e-3 * samplerate))),
+      delay_line_(channels * (lookahead_ + 1)),
+      window_(lookahead_ + 1),
+      window_sum_(0) {}
+
+void LookaheadLimiter::Process(const float *data, int64_t nframes,
+                               std::vector<float> *output) {
+  const int64_t span = lookahead_ + 1;
+  for (int64_t i = 0; i < nframes; ++i) {
+    const float *frame = &data[i * channels_];
+    float peak = 0;
+    for (size_t c = 0; c < channels_; ++c) {
+      peak = std::max(peak, std::abs(frame[c]));
+    }
+    const float needed = peak > ceiling_ ? ceiling_ / peak : 1.0f;
+    const int64_t n = total_in_++;
+    while (!minima_.empty() && minima_.back().second >= needed) {
+      minima_.pop_back();
+    }
+    minima_.emplace_back(n, needed);
+    while (minima_.front().first < n - lookahead_) minima_.pop_front();
+    std::copy(frame, frame + channels_, &delay_line_[channels_ * (n % span)]);
+    const int64_t out = n - lookahead_;
+    if (out < 0) continue;
+    if (out == 0) {
+      // The slots of the frames before the start have to be at most the
+      // gains of the frames whose averages they enter, which this first
+      // lowest gain covers.
+      std::fill(window_.begin(), window_.end(), minima_.front().second);
+      window_sum_ = span * static_cast<double>(minima_.front().second);
+    }
+    // Each of the averaged gains is at most the one that frame 'out' needs,
+    // as their lookaheads all include it.
+    float &slot = window_[out % span];
+    window_sum_ += minima_.front().second - slot;
+    slot = minima_.front().second;
+    gain_ = std::min<float>(window_sum_ / span,
+                            1.0f - (1.0f - gain_) * release_);
+    const float *delayed = &delay_line_[channels_ * (out % span)];
+    for (size_t c = 0; c < channels_; ++c) {
+      output->push_back(delayed[c] * gain_);
+    }
+  }
+}
+
+void LookaheadLimiter::Flush(std::vector<float> *output) {
+  const std::vector<float> silence(channels_ * lookahead_);
+  Process(silence.data(), lookahead_, output);
+}
+
+}  // namespace tabuli
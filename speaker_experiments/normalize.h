@@ -0,0 +1,96 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_NORMALIZE_H
+#define _TABULI_NORMALIZE_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sndfile.hh"
+
+namespace tabuli {
+
+// WAV output that is normalized to a peak level without a second pass. The
+// frames are written as float while the peak and the energy of each channel
+// are tracked, and Finish() scales them in place through a memory map and
+// packs them into the sample format of 'format'. The container of 'format' is
+// WAV or RF64; either way the file is written as WAV up to 4 GB and as RF64
+// beyond.
+class NormalizingWriter {
+ public:
+  NormalizingWriter(const std::string &path, int format, size_t channels,
+                    size_t samplerate, double peak_db);
+
+  size_t channels() const { return channels_; }
+  int64_t writef(const float *data, int64_t nframes);
+
+  // Peak and RMS level of channel c of what has been written, before
+  // normalization.
+  float peak(size_t c) const { return peak_[c]; }
+  float rms(size_t c) const;
+
+  // Normalizes and closes the file. Returns the applied gain.
+  float Finish();
+
+ private:
+  std::string path_;
+  int format_;
+  size_t channels_;
+  double peak_db_;
+  SndfileHandle file_;
+  std::vector<float> peak_;
+  std::vector<double> energy_;
+  int64_t frames_ = 0;
+};
+
+// Streaming peak limiter that replaces hard clipping. The gain of a frame is
+// the lowest that any frame within the lookahead needs to stay below the
+// ceiling, averaged over the lookahead so that it ramps down smoothly, and
+// recovers with the release time. The output is delayed by the lookahead.
+class LookaheadLimiter {
+ public:
+  LookaheadLimiter(size_t channels, size_t samplerate, float ceiling,
+                   double lookahead_ms, double release_ms = 50);
+
+  int64_t delay() const { return lookahead_; }
+
+  // Appends the limited frames that the input up to now determines.
+  void Process(const float *data, int64_t nframes, std::vector<float> *output);
+  // Appends the frames that are still delayed.
+  void Flush(std::vector<float> *output);
+
+ private:
+  size_t channels_;
+  float ceiling_;
+  int64_t lookahead_;
+  float release_;
+  // The last lookahead_ + 1 input frames, by frame index modulo their count.
+  std::vector<float> delay_line_;
+  // Indices and needed gains of the input frames within the lookahead whose
+  // gain is lower than that of all the frames after them.
+  std::deque<std::pair<int64_t, float>> minima_;
+  // The last lookahead_ + 1 lowest gains, and their sum.
+  std::vector<float> window_;
+  double window_sum_;
+  float gain_ = 1.0f;
+  int64_t total_in_ = 0;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_NORMALIZE_H
@@ -0,0 +1,367 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Optimizes the filter gains of the rotator bank for the identity
+// reconstruction of a set of sound files, within one process.
+//
+// Usage: optimize_gains [--output=<gains.txt>] <input.wav>...
+//
+// This replaces running identity_sliding_fft under optimizer/simplex_fork,
+// which started a process and decoded the inputs for every evaluation. Here
+// the inputs are decoded once, and every generation of a separable CMA-ES
+// (with a diagonal covariance, which suits the 128 weakly coupled gains)
+// evaluates its whole population in parallel. The search runs over the log
+// of the gains relative to GetRotatorGains, so that it starts from the
+// current table and the gains stay positive. The score is the mean square
+// error that identity_sliding_fft prints, averaged over the inputs.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <future>  // NOLINT
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "audio_cache.h"
+#include "fourier_bank.h"
+
+ABSL_FLAG(int, num_threads, 0,
+          "Number of evaluation threads, 0 for one per core.");
+ABSL_FLAG(int, population, 0,
+          "Candidates per generation, 0 for the CMA-ES default or the number "
+          "of threads if that is larger.");
+ABSL_FLAG(double, sigma, 0.05, "Initial step size of the log gains.");
+ABSL_FLAG(int, generations, 10000, "Number of generations to run.");
+ABSL_FLAG(double, max_seconds, 20,
+          "Only the first this many seconds of each input are used.");
+ABSL_FLAG(int, seed, 0, "Seed of the candidate sampling.");
+ABSL_FLAG(std::string, output, "",
+          "If set, the best gains so far are written here as a C table.");
+ABSL_FLAG(std::string, audio_cache, "",
+          "Directory of decoded inputs that are shared between runs; "
+          "defaults to $TABULI_AUDIO_CACHE.");
+
+namespace tabuli {
+namespace {
+
+struct TestInput {
+  size_t channels;
+  size_t samplerate;
+  // Interleaved frames.
+  std::vector<float> frames;
+};
+
+TestInput ReadInput(const char *path, double max_seconds) {
+  CachedReader file(path, /*samplerate=*/0,
+                    AudioCacheDir(absl::GetFlag(FLAGS_audio_cache)));
+  TestInput input;
+  input.channels = file.channels();
+  input.samplerate = file.samplerate();
+  const int64_t num_frames = std::min<int64_t>(
+      file.frames(), std::llround(max_seconds * input.samplerate));
+  input.frames.resize(input.channels * num_frames);
+  QCHECK_EQ(file.readf(input.frames.data(), num_frames), num_frames);
+  return input;
+}
+
+// A bank for each input, and the buffers to run it, for one thread.
+struct Worker {
+  std::vector<std::unique_ptr<RotatorFilterBank>> banks;
+  std::vector<float> history;
+  std::vector<float> output;
+};
+
+// Mean square difference between the input and the identity output of the
+// bank, like identity_sliding_fft computes it.
+double IdentityError(const TestInput &input, RotatorFilterBank &rotbank,
+                     std::vector<float> &history, std::vector<float> &output) {
+  const size_t num_channels = input.channels;
+  const int64_t num_frames = input.frames.size() / num_channels;
+  history.assign(num_channels * (rotbank.history_mask_ + 1), 0.0f);
+  output.resize(num_channels * kBlockSize);
+  double err = 0;
+  int64_t total_out = 0;
+  // The last max_delay_ frames of silence bring out the end of the input.
+  const int64_t total = num_frames + rotbank.max_delay_;
+  for (int64_t total_in = 0; total_in < total; total_in += kBlockSize) {
+    const int64_t len = std::min(kBlockSize, total - total_in);
+    for (int64_t i = 0; i < len; ++i) {
+      const int64_t ix = total_in + i;
+      for (size_t c = 0; c < num_channels; ++c) {
+        history[num_channels * (ix & rotbank.history_mask_) + c] =
+            ix < num_frames ? input.frames[ix * num_channels + c] : 0.0f;
+      }
+    }
+    const int64_t output_len = rotbank.FilterAllSingleThreaded(
+        history.data(), total_in, len, IDENTITY, output.data(), output.size());
+    for (int64_t i = 0; i < output_len * static_cast<int64_t>(num_channels);
+         ++i) {
+      const float diff = input.frames[total_out * num_channels + i] - output[i];
+      err += diff * diff;
+    }
+    total_out += output_len;
+  }
+  return err / total_out;
+}
+
+// Filter gains for a point of the search space.
+std::vector<float> GainsAt(const std::vector<double> &x) {
+  std::vector<float> gains(kNumRotators);
+  for (int i = 0; i < kNumRotators; ++i) {
+    gains[i] = GetRotatorGains(i) * std::exp(x[i]);
+  }
+  return gains;
+}
+
+// Scores the candidates in parallel, with each thread taking the next
+// candidate as it becomes free.
+std::vector<double> Evaluate(const std::vector<TestInput> &inputs,
+                             const std::vector<std::vector<double>> &candidates,
+                             std::vector<Worker> &workers) {
+  std::vector<double> scores(candidates.size());
+  std::atomic<size_t> next_task{0};
+  auto run = [&](Worker &worker) {
+    while (true) {
+      const size_t task = next_task++;
+      if (task >= candidates.size()) return;
+      const std::vector<float> gains = GainsAt(candidates[task]);
+      double score = 0;
+      for (size_t k = 0; k < inputs.size(); ++k) {
+        RotatorFilterBank &rotbank = *worker.banks[k];
+        rotbank.Reset(gains, /*global_gain=*/1.0f);
+        score += IdentityError(inputs[k], rotbank, worker.history,
+                               worker.output);
+      }
+      scores[task] = score / inputs.size();
+    }
+  };
+  std::vector<std::future<void>> futures;
+  futures.reserve(workers.size());
+  for (Worker &worker : workers) {
+    futures.push_back(std::async(std::launch::async, run, std::ref(worker)));
+  }
+  for (std::future<void> &future : futures) future.get();
+  return scores;
+}
+
+void WriteGains(const std::string &path, const std::vector<float> &gains,
+                double score) {
+  FILE *f = fopen(path.c_str(), "w");
+  QCHECK(f) << "Cannot write " << path;
+  fprintf(f, "// score=%.15g\n", score);
+  for (int i = 0; i < kNumRotators; ++i) {
+    fprintf(f, "%s%f,%s", i % 7 == 0 ? "    " : " ", gains[i],
+            i % 7 == 6 || i + 1 == kNumRotators ? "\n" : "");
+  }
+  fclose(f);
+}
+
+// Separable CMA-ES (Ros and Hansen, 2008): the covariance of the sampling
+// distribution is diagonal, which makes each generation linear in the
+// dimension.
+class SepCmaEs {
+ public:
+  SepCmaEs(int dim, int population, double sigma, int seed)
+      : dim_(dim),
+        lambda_(population),
+        mu_(population / 2),
+        sigma_(sigma),
+        mean_(dim, 0.0),
+        variance_(dim, 1.0),
+        p_sigma_(dim, 0.0),
+        p_c_(dim, 0.0),
+        rng_(seed) {
+    for (int i = 0; i < mu_; ++i) {
+      weights_.push_back(std::log(mu_ + 0.5) - std::log(i + 1.0));
+    }
+    const double sum = std::accumulate(weights_.begin(), weights_.end(), 0.0);
+    double square_sum = 0;
+    for (double &w : weights_) {
+      w /= sum;
+      square_sum += w * w;
+    }
+    mu_eff_ = 1.0 / square_sum;
+    const double n = dim_;
+    c_sigma_ = (mu_eff_ + 2) / (n + mu_eff_ + 5);
+    d_sigma_ = 1 +
+               2 * std::max(0.0, std::sqrt((mu_eff_ - 1) / (n + 1)) - 1) +
+               c_sigma_;
+    c_c_ = (4 + mu_eff_ / n) / (n + 4 + 2 * mu_eff_ / n);
+    // The rank-one and rank-mu learning rates of the full CMA-ES, raised for
+    // the diagonal model.
+    const double scale = (n + 2) / 3;
+    c_1_ = scale * 2 / ((n + 1.3) * (n + 1.3) + mu_eff_);
+    c_mu_ = std::min(1 - c_1_, scale * 2 * (mu_eff_ - 2 + 1 / mu_eff_) /
+                                   ((n + 2) * (n + 2) + mu_eff_));
+    chi_n_ = std::sqrt(n) * (1 - 1 / (4 * n) + 1 / (21 * n * n));
+  }
+
+  std::vector<std::vector<double>> Sample() {
+    std::normal_distribution<double> normal;
+    samples_.assign(lambda_, std::vector<double>(dim_));
+    std::vector<std::vector<double>> candidates(lambda_,
+                                                std::vector<double>(dim_));
+    for (int k = 0; k < lambda_; ++k) {
+      for (int i = 0; i < dim_; ++i) {
+        samples_[k][i] = std::sqrt(variance_[i]) * normal(rng_);
+        candidates[k][i] = mean_[i] + sigma_ * samples_[k][i];
+      }
+    }
+    return candidates;
+  }
+
+  void Update(const std::vector<double> &scores) {
+    std::vector<int> order(lambda_);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&](int a, int b) { return scores[a] < scores[b]; });
+    std::vector<double> step(dim_, 0.0);
+    for (int k = 0; k < mu_; ++k) {
+      for (int i = 0; i < dim_; ++i) {
+        step[i] += weights_[k] * samples_[order[k]][i];
+      }
+    }
+    ++generation_;
+    double p_sigma_norm = 0;
+    for (int i = 0; i < dim_; ++i) {
+      mean_[i] += sigma_ * step[i];
+      p_sigma_[i] = (1 - c_sigma_) * p_sigma_[i] +
+                    std::sqrt(c_sigma_ * (2 - c_sigma_) * mu_eff_) * step[i] /
+                        std::sqrt(variance_[i]);
+      p_sigma_norm += p_sigma_[i] * p_sigma_[i];
+    }
+    p_sigma_norm = std::sqrt(p_sigma_norm);
+    const bool h_sigma =
+        p_sigma_norm /
+            std::sqrt(1 - std::pow(1 - c_sigma_, 2.0 * generation_)) <
+        (1.4 + 2.0 / (dim_ + 1)) * chi_n_;
+    for (int i = 0; i < dim_; ++i) {
+      p_c_[i] = (1 - c_c_) * p_c_[i] +
+                (h_sigma ? std::sqrt(c_c_ * (2 - c_c_) * mu_eff_) : 0.0) *
+                    step[i];
+      double rank_mu = 0;
+      for (int k = 0; k < mu_; ++k) {
+        const double y = samples_[order[k]][i];
+        rank_mu += weights_[k] * y * y;
+      }
+      variance_[i] =
+          (1 - c_1_ - c_mu_) * variance_[i] +
+          c_1_ * (p_c_[i] * p_c_[i] +
+                  (h_sigma ? 0.0 : c_c_ * (2 - c_c_) * variance_[i])) +
+          c_mu_ * rank_mu;
+    }
+    sigma_ *= std::exp(c_sigma_ / d_sigma_ * (p_sigma_norm / chi_n_ - 1));
+  }
+
+  const std::vector<double> &mean() const { return mean_; }
+  double sigma() const { return sigma_; }
+
+ private:
+  int dim_;
+  int lambda_;
+  int mu_;
+  double sigma_;
+  std::vector<double> weights_;
+  double mu_eff_;
+  double c_sigma_;
+  double d_sigma_;
+  double c_c_;
+  double c_1_;
+  double c_mu_;
+  double chi_n_;
+  std::vector<double> mean_;
+  std::vector<double> variance_;
+  std::vector<double> p_sigma_;
+  std::vector<double> p_c_;
+  // Steps of the last sampled candidates, before scaling with sigma.
+  std::vector<std::vector<double>> samples_;
+  int generation_ = 0;
+  std::mt19937_64 rng_;
+};
+
+int Run(int argc, char **argv) {
+  QCHECK_GE(argc, 2) << "Usage: " << argv[0] << " <input.wav>...";
+  std::vector<TestInput> inputs;
+  for (int i = 1; i < argc; ++i) {
+    inputs.push_back(ReadInput(argv[i], absl::GetFlag(FLAGS_max_seconds)));
+  }
+  // hardware_concurrency() is 0 where it is not known.
+  const int num_threads =
+      absl::GetFlag(FLAGS_num_threads) > 0
+          ? absl::GetFlag(FLAGS_num_threads)
+          : std::max(1u, std::thread::hardware_concurrency());
+  int population = absl::GetFlag(FLAGS_population);
+  if (population <= 0) {
+    population = std::max<int>(4 + 3 * std::log(kNumRotators), num_threads);
+  }
+  QCHECK_GE(population, 4);
+
+  const std::vector<float> initial_gains = GainsAt(std::vector<double>(
+      kNumRotators, 0.0));
+  std::vector<Worker> workers(num_threads);
+  for (Worker &worker : workers) {
+    for (const TestInput &input : inputs) {
+      worker.banks.push_back(std::make_unique<RotatorFilterBank>(
+          kNumRotators, input.channels, input.samplerate, /*num_threads=*/1,
+          initial_gains, /*global_gain=*/1.0f));
+    }
+  }
+
+  SepCmaEs cma(kNumRotators, population, absl::GetFlag(FLAGS_sigma),
+               absl::GetFlag(FLAGS_seed));
+  std::vector<double> best = cma.mean();
+  double best_score = Evaluate(inputs, {best}, workers)[0];
+  fprintf(stderr, "initial score %.9g, %d candidates on %d threads\n",
+          best_score, population, num_threads);
+  const std::string output = absl::GetFlag(FLAGS_output);
+  for (int generation = 0; generation < absl::GetFlag(FLAGS_generations);
+       ++generation) {
+    const std::vector<std::vector<double>> candidates = cma.Sample();
+    const std::vector<double> scores = Evaluate(inputs, candidates, workers);
+    cma.Update(scores);
+    const size_t min_ix =
+        std::min_element(scores.begin(), scores.end()) - scores.begin();
+    if (scores[min_ix] < best_score) {
+      best_score = scores[min_ix];
+      best = candidates[min_ix];
+      if (!output.empty()) WriteGains(output, GainsAt(best), best_score);
+    }
+    fprintf(stderr, "generation %d best %.9g sigma %g\n", generation,
+            best_score, cma.sigma());
+  }
+  fprintf(stdout, "score=%.15g\n", best_score);
+  const std::vector<float> gains = GainsAt(best);
+  for (int i = 0; i < kNumRotators; ++i) {
+    fprintf(stdout, " %f,%s", gains[i], i % 7 == 6 ? "\n" : "");
+  }
+  fprintf(stdout, "\n");
+  return 0;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  std::vector<char *> posargs = absl::ParseCommandLine(argc, argv);
+  return tabuli::Run(posargs.size(), posargs.data());
+}
@@ -0,0 +1,156 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "output_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/log/check.h"
+#include "sndfile.hh"
+
+namespace tabuli {
+
+int OutputFormat(const std::string &container, const std::string &samples) {
+  int format = 0;
+  if (container == "wav") {
+    format = SF_FORMAT_WAV;
+  } else if (container == "rf64") {
+    format = SF_FORMAT_RF64;
+  } else if (container == "w64") {
+    format = SF_FORMAT_W64;
+  } else if (container == "raw") {
+    format = SF_FORMAT_RAW;
+  } else {
+    QCHECK(false) << "Unknown container " << container;
+  }
+  if (samples == "pcm16") {
+    format |= SF_FORMAT_PCM_16;
+  } else if (samples == "pcm24") {
+    format |= SF_FORMAT_PCM_24;
+  } else if (samples == "float") {
+    format |= SF_FORMAT_FLOAT;
+  } else {
+    QCHECK(false) << "Unknown sample format " << samples;
+  }
+  return format;
+}
+
+std::string ChannelPath(const std::string &path, size_t c, size_t channels) {
+  const size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = path.size();
+  }
+  const int digits = std::to_string(channels - 1).size();
+  char number[32];
+  snprintf(number, sizeof(number), ".%0*zu", digits, c);
+  return path.substr(0, dot) + number + path.substr(dot);
+}
+
+OutputFile::OutputFile(const std::string &path, int format, size_t channels,
+                       size_t samplerate, bool split)
+    : channels_(channels) {
+  const size_t num_files = split ? channels : 1;
+  for (size_t c = 0; c < num_files; ++c) {
+    const std::string file_path =
+        split ? ChannelPath(path, c, channels) : path;
+    files_.emplace_back(file_path, /*mode=*/SFM_WRITE, format,
+                        /*channels=*/split ? 1 : channels, samplerate);
+    QCHECK(files_.back()) << file_path << ": " << files_.back().strError();
+    if ((format & SF_FORMAT_TYPEMASK) == SF_FORMAT_RF64) {
+      files_.back().command(SFC_RF64_AUTO_DOWNGRADE, nullptr, SF_TRUE);
+    }
+  }
+  if (split) {
+    const size_t num_encoders = std::min<size_t>(
+        channels_, std::max(1u, std::thread::hardware_concurrency()));
+    for (size_t t = 0; t < num_encoders; ++t) {
+      encoders_.emplace_back([this, t] { EncoderLoop(t); });
+    }
+  }
+}
+
+OutputFile::~OutputFile() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_.notify_all();
+  for (std::thread &encoder : encoders_) encoder.join();
+}
+
+int64_t OutputFile::writef(const float *data, int64_t nframes) {
+  return files_.size() == 1 ? files_[0].writef(data, nframes)
+                            : WriteSplit(data, nframes, &planar_float_);
+}
+
+int64_t OutputFile::writef(const double *data, int64_t nframes) {
+  return files_.size() == 1 ? files_[0].writef(data, nframes)
+                            : WriteSplit(data, nframes, &planar_double_);
+}
+
+// The planar samples keep the type of the write, so that libsndfile
+// converts them for the mono files as it would for an interleaved file.
+template <typename T>
+int64_t OutputFile::WriteSplit(const T *data, int64_t nframes,
+                               std::vector<T> *planar) {
+  planar->resize(channels_ * nframes);
+  for (int64_t i = 0; i < nframes; ++i) {
+    for (size_t c = 0; c < channels_; ++c) {
+      (*planar)[c * nframes + i] = data[i * channels_ + c];
+    }
+  }
+  const size_t num_encoders = encoders_.size();
+  RunOnEncoders([&](size_t t) {
+    for (size_t c = t; c < channels_; c += num_encoders) {
+      QCHECK_EQ(files_[c].writef(&(*planar)[c * nframes], nframes), nframes);
+    }
+  });
+  return nframes;
+}
+
+void OutputFile::RunOnEncoders(const std::function<void(size_t)> &task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  running_ = encoders_.size();
+  ++generation_;
+  start_.notify_all();
+  done_.wait(lock, [&] { return running_ == 0; });
+}
+
+void OutputFile::EncoderLoop(size_t t) {
+  int64_t generation = 0;
+  while (true) {
+    const std::function<void(size_t)> *task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&] { return stopping_ || generation_ != generation; });
+      if (stopping_) return;
+      generation = generation_;
+      task = task_;
+    }
+    (*task)(t);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--running_ == 0) done_.notify_one();
+  }
+}
+
+}  // namespace tabuli
@@ -0,0 +1,85 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_OUTPUT_FILE_H
+#define _TABULI_OUTPUT_FILE_H
+
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <functional>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "sndfile.hh"
+
+namespace tabuli {
+
+// libsndfile format of a container ("wav", "rf64", "w64" or "raw") and a
+// sample format ("pcm16", "pcm24" or "float"), as the tools take them by
+// flags. RF64 files that stay below 4 GB are written as plain WAV.
+int OutputFormat(const std::string &container, const std::string &samples);
+
+// Path of the mono file of channel c when the output is split: the channel
+// number goes before the extension, as in "out.007.wav".
+std::string ChannelPath(const std::string &path, size_t c, size_t channels);
+
+// Sound file output that is either one interleaved file or, when split, one
+// mono file per channel. The mono files are encoded in parallel on threads
+// that the file keeps for its lifetime.
+class OutputFile {
+ public:
+  OutputFile(const std::string &path, int format, size_t channels,
+             size_t samplerate, bool split);
+  ~OutputFile();
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  size_t channels() const { return channels_; }
+  size_t frame_size() const { return channels_; }
+
+  int64_t writef(const float *data, int64_t nframes);
+  int64_t writef(const double *data, int64_t nframes);
+
+ private:
+  template <typename T>
+  int64_t WriteSplit(const T *data, int64_t nframes,
+                     std::vector<T> *planar);
+  // Runs task(t) on each encoder thread t and waits for all of them.
+  void RunOnEncoders(const std::function<void(size_t)> &task);
+  void EncoderLoop(size_t t);
+
+  size_t channels_;
+  std::vector<SndfileHandle> files_;
+  // Samples of each channel of a split write, channel after channel, in the
+  // sample type of the write.
+  std::vector<float> planar_float_;
+  std::vector<double> planar_double_;
+  // Threads that encode the mono files of a split output, each a fixed
+  // subset of the channels, and the task of the current write.
+  std::vector<std::thread> encoders_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void(size_t)> *task_ = nullptr;
+  int64_t generation_ = 0;
+  size_t running_ = 0;
+  bool stopping_ = false;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_OUTPUT_FILE_H
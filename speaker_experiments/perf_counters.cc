@@ -0,0 +1,145 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace tabuli {
+
+namespace {
+
+constexpr const char *kPerfEventNames[kNumPerfEvents] = {
+    "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses",
+};
+
+#ifdef __linux__
+// Opens an event in the group of group_fd, or as the leader of a new group
+// if it is -1. Only the leader is disabled, as the others follow it.
+int OpenEvent(PerfEvent event, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = group_fd < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  switch (event) {
+    case kPerfCycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case kPerfInstructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case kPerfL1dMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case kPerfLlcMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case kPerfBranchMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    default:
+      return -1;
+  }
+  return syscall(SYS_perf_event_open, &attr, /*pid=*/0, /*cpu=*/-1, group_fd,
+                 /*flags=*/0);
+}
+#endif
+
+}  // namespace
+
+const char *PerfEventName(PerfEvent event) { return kPerfEventNames[event]; }
+
+PerfCounters::PerfCounters() {
+  for (int e = 0; e < kNumPerfEvents; ++e) {
+#ifdef __linux__
+    // The cycles lead the group unless they are not there.
+    fd_[e] = OpenEvent(static_cast<PerfEvent>(e), leader_);
+    if (fd_[e] < 0 && error_ == 0) error_ = errno;
+    if (fd_[e] >= 0 && leader_ < 0) leader_ = fd_[e];
+#else
+    fd_[e] = -1;
+    error_ = ENOSYS;
+#endif
+  }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int fd : fd_) {
+    if (fd >= 0) close(fd);
+  }
+#endif
+}
+
+bool PerfCounters::available() const { return leader_ >= 0; }
+
+void PerfCounters::Start() {
+#ifdef __linux__
+  if (leader_ < 0) return;
+  ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+PerfCounts PerfCounters::Stop() {
+  PerfCounts counts;
+#ifdef __linux__
+  if (leader_ < 0) return counts;
+  ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // The number of events, the time enabled and the time running, and the
+  // values of the events in the order they joined the group.
+  uint64_t data[3 + kNumPerfEvents];
+  const ssize_t size = read(leader_, data, sizeof(data));
+  if (size < static_cast<ssize_t>(3 * sizeof(uint64_t)) ||
+      size != static_cast<ssize_t>((3 + data[0]) * sizeof(uint64_t)) ||
+      data[2] == 0) {
+    return counts;
+  }
+  size_t next = 3;
+  for (int e = 0; e < kNumPerfEvents; ++e) {
+    if (fd_[e] < 0) continue;
+    counts.value[e] =
+        data[2] < data[1]
+            ? static_cast<uint64_t>(static_cast<double>(data[next]) * data[1] /
+                                    data[2])
+            : data[next];
+    counts.valid[e] = true;
+    ++next;
+  }
+#endif
+  return counts;
+}
+
+}  // namespace tabuli
@@ -0,0 +1,74 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _TABULI_PERF_COUNTERS_H
+#define _TABULI_PERF_COUNTERS_H
+
+#include <cstdint>
+
+namespace tabuli {
+
+// Hardware events that PerfCounters counts.
+enum PerfEvent {
+  kPerfCycles,
+  kPerfInstructions,
+  kPerfL1dMisses,
+  kPerfLlcMisses,
+  kPerfBranchMisses,
+  kNumPerfEvents,
+};
+
+const char *PerfEventName(PerfEvent event);
+
+// Counts of the events between Start() and Stop(), scaled up for the time
+// that the kernel multiplexed them out. The events are counted as one group,
+// so they all cover the same intervals and their ratios, such as the
+// instructions per cycle, stay consistent.
+struct PerfCounts {
+  uint64_t value[kNumPerfEvents] = {0};
+  bool valid[kNumPerfEvents] = {false};
+};
+
+// Hardware performance counters of the calling thread through
+// perf_event_open, in user space only so that they also open with a
+// perf_event_paranoid of 2. Events that the CPU, the kernel or a container
+// do not provide are left out, and Stop() marks them as not valid.
+class PerfCounters {
+ public:
+  PerfCounters();
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // Whether any event could be opened, and why not.
+  bool available() const;
+  int error() const { return error_; }
+
+  void Start();
+  PerfCounts Stop();
+
+ private:
+  int fd_[kNumPerfEvents];
+  // The first event that opened, usually the cycles, which leads the group
+  // of the others.
+  int leader_ = -1;
+  // errno of the first event that could not be opened.
+  int error_ = 0;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_PERF_COUNTERS_H
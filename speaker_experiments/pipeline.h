@@ -0,0 +1,297 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_PIPELINE_H
+#define _TABULI_PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "trace.h"
+
+namespace tabuli {
+
+// Bounded queue from one producer thread to one consumer thread, lock-free
+// while neither has to wait. Push waits while the queue is full and Pop while
+// it is empty, first spinning for a moment and then sleeping, so that a
+// stage that waits on a slow one does not take a core.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) : slots_(capacity), mask_(capacity - 1) {
+    QCHECK(capacity > 0 && (capacity & mask_) == 0)
+        << "Capacity must be a power of two";
+  }
+
+  void Push(T value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    Await([&] {
+      return tail - head_.load(std::memory_order_acquire) < slots_.size();
+    });
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    Wake();
+  }
+
+  T Pop() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    Await([&] { return tail_.load(std::memory_order_acquire) != head; });
+    T value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    Wake();
+    return value;
+  }
+
+ private:
+  // Checks of the other thread's index before sleeping. They take about a
+  // microsecond, which covers a stage that is just about to hand over.
+  static constexpr int kSpins = 1000;
+
+  // Returns when ready() holds, which only the other thread can change.
+  template <typename Ready>
+  void Await(const Ready &ready) {
+    for (int i = 0; i < kSpins; ++i) {
+      if (ready()) return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleepers_.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in Wake: either the other thread sees the
+    // sleeper, or ready() sees its update.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    changed_.wait(lock, ready);
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Wakes the other thread if it sleeps in Await.
+  void Wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+    // Under the lock, so that the notification cannot come between the
+    // sleeper's last check and its wait.
+    std::lock_guard<std::mutex> lock(mutex_);
+    changed_.notify_one();
+  }
+
+  std::vector<T> slots_;
+  size_t mask_;
+  // Apart, so that the two threads do not share a cache line when they
+  // update them.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  // At most one of the threads sleeps, since the queue cannot be full and
+  // empty at once.
+  std::atomic<int> sleepers_{0};
+  std::mutex mutex_;
+  std::condition_variable changed_;
+};
+
+// Interleaved frames that one pipeline stage hands to the next. An empty
+// block ends the stream.
+using Block = std::vector<float>;
+
+// Input stream with channels(), samplerate() and readf() over the blocks of
+// a queue, for the stages that read sound files otherwise.
+template <typename T = float>
+class QueueReader {
+ public:
+  QueueReader(SpscQueue<std::vector<T>> &queue, size_t channels,
+              size_t samplerate)
+      : queue_(queue), channels_(channels), samplerate_(samplerate) {}
+
+  size_t channels() const { return channels_; }
+  size_t samplerate() const { return samplerate_; }
+  bool done() const { return done_; }
+
+  int64_t readf(T *data, int64_t nframes) {
+    int64_t read = 0;
+    while (read < nframes && !done_) {
+      if (pos_ == block_.size()) {
+        block_ = queue_.Pop();
+        pos_ = 0;
+        if (block_.empty()) {
+          done_ = true;
+          break;
+        }
+      }
+      const size_t n = std::min<size_t>((nframes - read) * channels_,
+                                        block_.size() - pos_);
+      std::copy(block_.begin() + pos_, block_.begin() + pos_ + n,
+                data + read * channels_);
+      pos_ += n;
+      read += n / channels_;
+    }
+    return read;
+  }
+
+  // Drops the rest of the stream.
+  void Drain() {
+    while (!done_) done_ = queue_.Pop().empty();
+  }
+
+ private:
+  SpscQueue<std::vector<T>> &queue_;
+  size_t channels_;
+  size_t samplerate_;
+  std::vector<T> block_;
+  size_t pos_ = 0;
+  bool done_ = false;
+};
+
+// Output stream with writef() into the blocks of a queue. Close() ends the
+// stream.
+class QueueWriter {
+ public:
+  QueueWriter(SpscQueue<Block> &queue, size_t channels)
+      : queue_(queue), channels_(channels) {}
+
+  size_t channels() const { return channels_; }
+
+  int64_t writef(const float *data, int64_t nframes) {
+    if (nframes > 0) queue_.Push(Block(data, data + nframes * channels_));
+    return nframes;
+  }
+
+  void Close() { queue_.Push(Block()); }
+
+ private:
+  SpscQueue<Block> &queue_;
+  size_t channels_;
+};
+
+// Blocks that an asynchronous reader or writer keeps in flight, and their
+// size. With two, the file is read or written while the caller computes on
+// the other block; more absorb stalls of the disk.
+constexpr size_t kBlocksInFlight = 4;
+constexpr int64_t kFramesPerBlock = 1 << 13;
+
+// Input stream that reads another one ahead on a thread of its own, so that
+// decoding and resampling overlap with the computation on the frames that
+// were read before. T is the sample type of the blocks; reads of another
+// type convert on the caller's side.
+template <typename In, typename T = float>
+class AsyncReader {
+ public:
+  explicit AsyncReader(In &input, size_t blocks_in_flight = kBlocksInFlight)
+      : input_(input),
+        queue_(blocks_in_flight),
+        reader_(queue_, input.channels(), input.samplerate()),
+        thread_([this] { Run(); }) {}
+
+  ~AsyncReader() {
+    stop_.store(true, std::memory_order_relaxed);
+    // Makes room for the blocks that the thread is still pushing.
+    reader_.Drain();
+    thread_.join();
+  }
+
+  size_t channels() const { return reader_.channels(); }
+  size_t samplerate() const { return reader_.samplerate(); }
+
+  int64_t readf(T *data, int64_t nframes) {
+    return reader_.readf(data, nframes);
+  }
+
+ private:
+  void Run() {
+    const size_t channels = reader_.channels();
+    while (!stop_.load(std::memory_order_relaxed)) {
+      std::vector<T> block(channels * kFramesPerBlock);
+      int64_t read;
+      {
+        ScopedStage stage(kStageDecode);
+        read = input_.readf(block.data(), kFramesPerBlock);
+      }
+      if (read <= 0) break;
+      block.resize(channels * read);
+      queue_.Push(std::move(block));
+    }
+    queue_.Push(std::vector<T>());
+  }
+
+  In &input_;
+  SpscQueue<std::vector<T>> queue_;
+  QueueReader<T> reader_;
+  std::atomic<bool> stop_{false};
+  // Last, so that it starts when everything it uses is there.
+  std::thread thread_;
+};
+
+// Output stream that writes to another one behind on a thread of its own, so
+// that encoding overlaps with the computation of the frames that follow.
+// Small writes are gathered into blocks of kFramesPerBlock frames. Close(), or
+// the destructor, waits until everything is written; it must come before the
+// output is closed.
+template <typename Out, typename T = float>
+class AsyncWriter {
+ public:
+  AsyncWriter(Out &output, size_t channels,
+              size_t blocks_in_flight = kBlocksInFlight)
+      : output_(output),
+        channels_(channels),
+        queue_(blocks_in_flight),
+        thread_([this] { Run(); }) {
+    pending_.reserve(channels_ * kFramesPerBlock);
+  }
+
+  ~AsyncWriter() { Close(); }
+
+  size_t channels() const { return channels_; }
+  size_t frame_size() const { return channels_; }
+
+  int64_t writef(const T *data, int64_t nframes) {
+    pending_.insert(pending_.end(), data, data + nframes * channels_);
+    if (pending_.size() >= channels_ * kFramesPerBlock) {
+      queue_.Push(std::move(pending_));
+      pending_ = std::vector<T>();
+      pending_.reserve(channels_ * kFramesPerBlock);
+    }
+    return nframes;
+  }
+
+  void Close() {
+    if (closed_) return;
+    closed_ = true;
+    if (!pending_.empty()) queue_.Push(std::move(pending_));
+    queue_.Push(std::vector<T>());
+    thread_.join();
+  }
+
+ private:
+  void Run() {
+    for (std::vector<T> block = queue_.Pop(); !block.empty();
+         block = queue_.Pop()) {
+      ScopedStage stage(kStageEncode);
+      output_.writef(block.data(), block.size() / channels_);
+    }
+  }
+
+  Out &output_;
+  size_t channels_;
+  SpscQueue<std::vector<T>> queue_;
+  std::vector<T> pending_;
+  bool closed_ = false;
+  // Last, so that it starts when everything it uses is there.
+  std::thread thread_;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_PIPELINE_H
@@ -0,0 +1,134 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "render_cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+namespace {
+
+// File layout: kMagic and the fingerprint, then for each snapshot its
+// position, and the size and the values of state, precise and history.
+constexpr uint32_t kMagic = 0x34425454;  // "TTB4"
+
+template <typename T>
+bool ReadValue(FILE *f, T *v) {
+  return fread(v, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+void WriteValue(FILE *f, const T &v) {
+  QCHECK_EQ(fwrite(&v, sizeof(T), 1, f), 1);
+}
+
+template <typename T>
+bool ReadVector(FILE *f, std::vector<T> *v) {
+  uint64_t size;
+  if (!ReadValue(f, &size)) return false;
+  v->resize(size);
+  return fread(v->data(), sizeof(T), size, f) == size;
+}
+
+template <typename T>
+void WriteVector(FILE *f, const std::vector<T> &v) {
+  WriteValue<uint64_t>(f, v.size());
+  QCHECK_EQ(fwrite(v.data(), sizeof(T), v.size(), f), v.size());
+}
+
+}  // namespace
+
+uint64_t RenderFingerprint(const std::vector<double> &params) {
+  // FNV-1a over the bytes of the parameters.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const double param : params) {
+    unsigned char bytes[sizeof(param)];
+    memcpy(bytes, &param, sizeof(param));
+    for (const unsigned char byte : bytes) {
+      hash = (hash ^ byte) * 0x100000001b3ull;
+    }
+  }
+  return hash;
+}
+
+RenderCache::RenderCache(const std::string &path, uint64_t fingerprint)
+    : path_(path), fingerprint_(fingerprint) {
+  FILE *f = fopen(path_.c_str(), "rb");
+  if (!f) return;
+  uint32_t magic = 0;
+  QCHECK(ReadValue(f, &magic) && magic == kMagic)
+      << path_ << " is not a render cache";
+  uint64_t file_fingerprint = 0;
+  QCHECK(ReadValue(f, &file_fingerprint))
+      << "Truncated render cache " << path_;
+  if (file_fingerprint != fingerprint_) {
+    fclose(f);
+    mismatched_ = true;
+    fprintf(stderr, "Ignoring %s, which was rendered with other parameters\n",
+            path_.c_str());
+    return;
+  }
+  BankSnapshot snapshot;
+  while (ReadValue(f, &snapshot.position)) {
+    QCHECK(ReadVector(f, &snapshot.state) &&
+           ReadVector(f, &snapshot.precise) &&
+           ReadVector(f, &snapshot.history))
+        << "Truncated render cache " << path_;
+    snapshots_[snapshot.position] = snapshot;
+  }
+  fclose(f);
+  fprintf(stderr, "Loaded %zu snapshots from %s\n", snapshots_.size(),
+          path_.c_str());
+}
+
+const BankSnapshot *RenderCache::Find(int64_t position) const {
+  auto it = snapshots_.upper_bound(position);
+  if (it == snapshots_.begin()) return nullptr;
+  return &std::prev(it)->second;
+}
+
+void RenderCache::Add(BankSnapshot snapshot) {
+  const int64_t position = snapshot.position;
+  snapshots_[position] = std::move(snapshot);
+}
+
+void RenderCache::DropAfter(int64_t position) {
+  snapshots_.erase(snapshots_.upper_bound(position), snapshots_.end());
+}
+
+void RenderCache::Save() const {
+  FILE *f = fopen(path_.c_str(), "wb");
+  QCHECK(f) << "Cannot write " << path_;
+  WriteValue(f, kMagic);
+  WriteValue(f, fingerprint_);
+  for (const auto &[position, snapshot] : snapshots_) {
+    WriteValue(f, position);
+    WriteVector(f, snapshot.state);
+    WriteVector(f, snapshot.precise);
+    WriteVector(f, snapshot.history);
+  }
+  fclose(f);
+}
+
+}  // namespace tabuli
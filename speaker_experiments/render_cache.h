@@ -0,0 +1,68 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_RENDER_CACHE_H
+#define _TABULI_RENDER_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "fourier_bank.h"
+
+namespace tabuli {
+
+// Hashes the parameters that the state of a render depends on: sample rate,
+// channels, gains, latency budget and the code path of the bank.
+uint64_t RenderFingerprint(const std::vector<double> &params);
+
+// Bank snapshots taken at regular positions of a render, kept in a file next
+// to its output. After an edit, rendering restarts from the latest snapshot
+// before the edit instead of from the beginning of the program.
+//
+// The file records the fingerprint of the render that wrote it. Snapshots of
+// a render with other parameters are not loaded.
+class RenderCache {
+ public:
+  // Loads the snapshots from path if the file exists and was written with
+  // the same fingerprint.
+  RenderCache(const std::string &path, uint64_t fingerprint);
+
+  // Returns the latest snapshot at or before position, or nullptr.
+  const BankSnapshot *Find(int64_t position) const;
+
+  // Adds a snapshot, replacing any earlier one at the same position.
+  void Add(BankSnapshot snapshot);
+
+  // Removes the snapshots after position, which were taken from input that
+  // the last render did not reach.
+  void DropAfter(int64_t position);
+
+  void Save() const;
+
+  size_t size() const { return snapshots_.size(); }
+  // Whether the file held snapshots of a render with other parameters.
+  bool mismatched() const { return mismatched_; }
+
+ private:
+  std::string path_;
+  uint64_t fingerprint_;
+  bool mismatched_ = false;
+  std::map<int64_t, BankSnapshot> snapshots_;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_RENDER_CACHE_H
@@ -0,0 +1,132 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "resampler.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "absl/log/check.h"
+
+namespace tabuli {
+
+namespace {
+
+// Zero crossings of the sinc on each side. The cutoff is at the lower Nyquist
+// frequency, and the transition band spans 0.91 to 1.09 of it, so the top
+// rotator at 20 kHz stays in the passband at 44.1 kHz and what aliases lands
+// above it.
+constexpr int64_t kZeroCrossings = 32;
+// About 90 dB of stopband attenuation.
+constexpr double kKaiserBeta = 9.0;
+// Bounds the table to a few MB for unusual ratios.
+constexpr int64_t kMaxPhases = 4096;
+
+double BesselI0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < 1e-12 * sum) break;
+  }
+  return sum;
+}
+
+}  // namespace
+
+Resampler::Resampler(size_t num_channels, size_t input_rate,
+                     size_t output_rate)
+    : num_channels_(num_channels) {
+  const int64_t g = std::gcd<int64_t>(input_rate, output_rate);
+  up_ = output_rate / g;
+  down_ = input_rate / g;
+  QCHECK_LE(up_, kMaxPhases) << "Unsupported resampling ratio "
+                             << input_rate << " to " << output_rate;
+  // Cutoff in cycles per input sample.
+  const double cutoff =
+      0.5 * std::min<double>(1.0, static_cast<double>(up_) / down_);
+  half_taps_ = std::ceil(kZeroCrossings / (2 * cutoff));
+  const int64_t num_taps = 2 * half_taps_;
+  filter_.resize(up_ * num_taps);
+  for (int64_t p = 0; p < up_; ++p) {
+    // Phase p is for output times p / up_ past an input frame, and tap k
+    // for the input frame half_taps_ - 1 - k before that frame.
+    double sum = 0;
+    for (int64_t k = 0; k < num_taps; ++k) {
+      const double t = static_cast<double>(p) / up_ + (half_taps_ - 1 - k);
+      const double x = 2 * cutoff * t;
+      const double sinc =
+          x == 0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+      const double r = t / half_taps_;
+      const double window =
+          r * r < 1 ? BesselI0(kKaiserBeta * std::sqrt(1 - r * r)) /
+                          BesselI0(kKaiserBeta)
+                    : 0.0;
+      filter_[p * num_taps + k] = sinc * window;
+      sum += sinc * window;
+    }
+    // Unity gain at DC for every phase.
+    for (int64_t k = 0; k < num_taps; ++k) filter_[p * num_taps + k] /= sum;
+  }
+  // The first outputs reach back before the input, which is silence.
+  buffer_.assign(num_channels_ * half_taps_, 0.0f);
+  buffer_start_ = -half_taps_;
+}
+
+void Resampler::Emit(int64_t available, int64_t end,
+                     std::vector<float> *output) {
+  const int64_t num_taps = 2 * half_taps_;
+  for (; total_out_ < end; ++total_out_) {
+    // Output frame total_out_ is at input time first + phase / up_.
+    const int64_t first = total_out_ * down_ / up_;
+    const int64_t phase = total_out_ * down_ % up_;
+    const int64_t begin = first - half_taps_ + 1;
+    if (begin + num_taps > available) break;
+    const float *taps = &filter_[phase * num_taps];
+    const float *in = &buffer_[(begin - buffer_start_) * num_channels_];
+    for (size_t c = 0; c < num_channels_; ++c) {
+      float sum = 0;
+      for (int64_t k = 0; k < num_taps; ++k) {
+        sum += taps[k] * in[k * num_channels_ + c];
+      }
+      output->push_back(sum);
+    }
+  }
+  // Drop the input that no later output reaches.
+  const int64_t keep_from = total_out_ * down_ / up_ - half_taps_ + 1;
+  if (keep_from > buffer_start_) {
+    buffer_.erase(buffer_.begin(),
+                  buffer_.begin() + (keep_from - buffer_start_) * num_channels_);
+    buffer_start_ = keep_from;
+  }
+}
+
+void Resampler::Process(const float *input, int64_t num_frames,
+                        std::vector<float> *output) {
+  buffer_.insert(buffer_.end(), input, input + num_frames * num_channels_);
+  total_in_ += num_frames;
+  Emit(total_in_, std::numeric_limits<int64_t>::max(), output);
+}
+
+void Resampler::Flush(std::vector<float> *output) {
+  buffer_.resize(buffer_.size() + num_channels_ * 2 * half_taps_, 0.0f);
+  Emit(total_in_ + 2 * half_taps_, (total_in_ * up_ + down_ - 1) / down_,
+       output);
+}
+
+}  // namespace tabuli
@@ -0,0 +1,110 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_RESAMPLER_H
+#define _TABULI_RESAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace tabuli {
+
+// Streaming sample rate converter for a rational ratio, with a polyphase
+// Kaiser-windowed sinc filter. Output frame n is at input time
+// n * input_rate / output_rate, without delay: the filter looks ahead into
+// the input, and Flush() supplies the silence after its end.
+class Resampler {
+ public:
+  Resampler(size_t num_channels, size_t input_rate, size_t output_rate);
+
+  // Appends the output frames that the input up to now determines.
+  void Process(const float *input, int64_t num_frames,
+               std::vector<float> *output);
+
+  // Appends the rest of the output of ceil(total input * output_rate /
+  // input_rate) frames.
+  void Flush(std::vector<float> *output);
+
+ private:
+  // Computes the output frames up to end that the input frames before
+  // available determine.
+  void Emit(int64_t available, int64_t end, std::vector<float> *output);
+
+  size_t num_channels_;
+  // Output and input steps of the ratio, reduced.
+  int64_t up_;
+  int64_t down_;
+  // Taps on each side of the output time.
+  int64_t half_taps_;
+  // Filter phase p, tap k at filter_[p * 2 * half_taps_ + k].
+  std::vector<float> filter_;
+  // Input frames from buffer_start_ on, interleaved by channel.
+  std::vector<float> buffer_;
+  int64_t buffer_start_;
+  int64_t total_in_ = 0;
+  int64_t total_out_ = 0;
+};
+
+// Input stream that resamples another input stream with channels(),
+// samplerate() and readf() to samplerate.
+template <typename In>
+class ResamplingReader {
+ public:
+  ResamplingReader(In &input, size_t samplerate)
+      : input_(input),
+        samplerate_(samplerate),
+        resampler_(input.channels(), input.samplerate(), samplerate),
+        chunk_(input.channels() * kChunkFrames) {}
+
+  size_t channels() const { return input_.channels(); }
+  size_t samplerate() const { return samplerate_; }
+
+  int64_t readf(float *data, int64_t nframes) {
+    const size_t num_channels = channels();
+    while (!flushed_ && pending_.size() - pending_pos_ <
+                            static_cast<size_t>(nframes) * num_channels) {
+      pending_.erase(pending_.begin(), pending_.begin() + pending_pos_);
+      pending_pos_ = 0;
+      const int64_t read = input_.readf(chunk_.data(), kChunkFrames);
+      if (read == 0) {
+        resampler_.Flush(&pending_);
+        flushed_ = true;
+      } else {
+        resampler_.Process(chunk_.data(), read, &pending_);
+      }
+    }
+    const int64_t frames = std::min<int64_t>(
+        nframes, (pending_.size() - pending_pos_) / num_channels);
+    std::copy(pending_.begin() + pending_pos_,
+              pending_.begin() + pending_pos_ + frames * num_channels, data);
+    pending_pos_ += frames * num_channels;
+    return frames;
+  }
+
+ private:
+  static constexpr int64_t kChunkFrames = 1 << 13;
+
+  In &input_;
+  size_t samplerate_;
+  Resampler resampler_;
+  std::vector<float> chunk_;
+  std::vector<float> pending_;
+  size_t pending_pos_ = 0;
+  bool flushed_ = false;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_RESAMPLER_H
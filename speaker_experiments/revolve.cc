@@ -15,543 +15,427 @@
 #include <algorithm>
 #include <atomic>
 #include <cmath>
-#include <complex>
 #include <cstdlib>
 #include <functional>
 #include <future>  // NOLINT
+#include <memory>
 #include <sndfile.hh>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/check.h"
+#include "fourier_bank.h"
+#include "normalize.h"
+#include "output_file.h"
+#include "pipeline.h"
+#include "resampler.h"
+#include "revolve_engine.h"
+#include "segment_render.h"
+#include "trace.h"
 
 ABSL_FLAG(int, output_channels, 16, "number of output channels");
 ABSL_FLAG(double, distance_to_interval_ratio, 8,
           "ratio of (distance between microphone and source array) / (distance "
           "between each source); default = 40cm / 10cm = 4");
+ABSL_FLAG(int, internal_samplerate, 0,
+          "If positive, an input at another sample rate is resampled to this "
+          "rate before filtering, and the outputs are written at it.");
+ABSL_FLAG(double, max_latency_ms, 0,
+          "If positive, caps the output delay of the rotator bank at this "
+          "many milliseconds, for interactive use.");
+ABSL_FLAG(std::string, latency_fit, "window",
+          "How the rotators that are slower than --max_latency_ms are fit "
+          "into it: 'window' shortens their windows, 'advance' lets them "
+          "come late.");
+ABSL_FLAG(double, segment_seconds, 0,
+          "If positive, renders the input in independent time segments of "
+          "this length in parallel.");
+ABSL_FLAG(int, segment_threads, 8,
+          "Number of segments rendered concurrently.");
+ABSL_FLAG(double, warmup_tolerance, 1e-4,
+          "Residual of the filter and driver state, relative to its peak "
+          "response, that is accepted at the start of each segment.");
+ABSL_FLAG(bool, pipeline, false,
+          "If set, reading and resampling the input, filtering, and mixing "
+          "and writing the outputs run as concurrent stages that hand blocks "
+          "to each other in memory.");
+ABSL_FLAG(double, input_gain_db, 0,
+          "Gain of the input before filtering, with --pipeline.");
+ABSL_FLAG(std::string, device_output, "",
+          "With --pipeline, also writes the speaker feeds in the 20-channel "
+          "layout of the output device, where channels 1-2 and 11-12 are "
+          "silent.");
+ABSL_FLAG(std::string, stereo_output, "",
+          "With --pipeline, also writes a stereo downmix of the speaker feeds "
+          "as 32-bit float, panned by the speaker position.");
+ABSL_FLAG(double, binaural_peak_db, 0,
+          "If negative, the pipeline normalizes the binaural output to this "
+          "peak level in dBFS.");
+ABSL_FLAG(double, device_peak_db, 0,
+          "If negative, the pipeline normalizes the device output to this "
+          "peak level in dBFS.");
+ABSL_FLAG(double, stereo_peak_db, 0,
+          "If negative, the pipeline normalizes the stereo output to this "
+          "peak level in dBFS.");
+ABSL_FLAG(std::string, output_format, "wav",
+          "Container of the multichannel output: wav, rf64 or w64 for files "
+          "over 4 GB, or raw.");
+ABSL_FLAG(std::string, sample_format, "pcm24",
+          "Samples of the multichannel output: pcm16, pcm24 or float.");
+ABSL_FLAG(bool, split_output, false,
+          "If set, writes the multichannel output as one mono file per "
+          "speaker, numbered before the extension.");
+ABSL_FLAG(bool, trace, false,
+          "If set, prints the time spent in each stage and the real-time "
+          "factor.");
+ABSL_FLAG(std::string, trace_json, "",
+          "If set, also writes the spans of the stages to this file as a "
+          "Chrome trace.");
 
 namespace {
 
-constexpr int kSubSourcePrecision = 1000;
-
-float MicrophoneResponse(const float angle) {
-  return 0.5f * (1.0f + std::cos(angle));
-}
-
-float ExpectedLeftToRightRatio(const float angle) {
-  return (1e-3 + MicrophoneResponse(angle + M_PI / 4)) /
-         (1e-3 + MicrophoneResponse(angle - M_PI / 4));
-}
-
-float ActualLeftToRightRatio(float left, float right) {
-  return std::sqrt((1e-13 + left) / (1e-13 + right));
+using tabuli::revolve::BarkFreq;
+using tabuli::revolve::GetFilterGains;
+using tabuli::revolve::kBlockSize;
+using tabuli::revolve::kNumRotators;
+using tabuli::revolve::MultiChannelDriverModel;
+using tabuli::revolve::RotatorFilterBank;
+using tabuli::revolve::Rotators;
+
+tabuli::LatencyFit GetLatencyFit() {
+  std::string desc = absl::GetFlag(FLAGS_latency_fit);
+  if (desc == "window") {
+    return tabuli::SHORTEN_WINDOW;
+  } else if (desc == "advance") {
+    return tabuli::CAP_ADVANCE;
+  }
+  QCHECK(0) << "Unknown latency fit " << desc;
 }
 
-// Fast approximate function for temporal coherence of 3x exp leakers.
-float FindMedian3xLeaker(float window) { return -2.32 / log(window); }
-
-constexpr int64_t kNumRotators = 128;
-
-float GetFilterGains(int i) {
-  static const float kFilterGains[kNumRotators] = {
-      1.050645, 1.948438, 3.050339, 3.967913, 4.818584, 5.303335, 5.560281,
-      5.490826, 5.156689, 4.547374, 3.691308, 2.666868, 1.539254, 0.656948,
-      0.345893, 0.327111, 0.985318, 1.223506, 0.447645, 0.830961, 1.075181,
-      0.613335, 0.902695, 0.855391, 0.817774, 0.823359, 0.841483, 0.838562,
-      0.831912, 0.808731, 0.865214, 0.808036, 0.850837, 0.821305, 0.839458,
-      0.829195, 0.836373, 0.827271, 0.836018, 0.834514, 0.825624, 0.836999,
-      0.833990, 0.832992, 0.830897, 0.832593, 0.846116, 0.824796, 0.829331,
-      0.844509, 0.838830, 0.821733, 0.840738, 0.841735, 0.827570, 0.838581,
-      0.837742, 0.834965, 0.842970, 0.832145, 0.847596, 0.840942, 0.830891,
-      0.850632, 0.841468, 0.838383, 0.841493, 0.855118, 0.826750, 0.848000,
-      0.874356, 0.812177, 0.849037, 0.893550, 0.832527, 0.827986, 0.877198,
-      0.851760, 0.846317, 0.883044, 0.843178, 0.856925, 0.857045, 0.860695,
-      0.894345, 0.870391, 0.839519, 0.870541, 0.870573, 0.902951, 0.871798,
-      0.818328, 0.871413, 0.921101, 0.863915, 0.793014, 0.936519, 0.888107,
-      0.856968, 0.821018, 0.987345, 0.904846, 0.783447, 0.973613, 0.903628,
-      0.875688, 0.931024, 0.992087, 0.806914, 1.050332, 0.942569, 0.800870,
-      1.210426, 0.916555, 0.817352, 1.126946, 0.985119, 0.922530, 0.994633,
-      0.959602, 0.381419, 1.879201, 2.078451, 0.475196, 0.952731, 1.709305,
-      1.383894, 1.557669,
-  };
-  return kFilterGains[i];
+// Output delay budget of the rotator bank in samples, or 0 for none.
+int64_t LatencyBudget(size_t samplerate) {
+  return std::llround(absl::GetFlag(FLAGS_max_latency_ms) * 1e-3 * samplerate);
 }
 
-struct PerChannel {
-  // [0..1] is for real and imag of 1st leaking accumulation
-  // [2..3] is for real and imag of 2nd leaking accumulation
-  // [4..5] is for real and imag of 3rd leaking accumulation
-  float accu[6][kNumRotators] = {0};
-  float LenSqr(size_t i) {
-    return accu[4][i] * accu[4][i] + accu[5][i] * accu[5][i];
-  }
-};
-
-struct Rotators {
-  // Four arrays of rotators.
-  // [0..1] is real and imag for rotation speed
-  // [2..3] is real and image for a frequency rotator of length sqrt(gain[i])
-  // Values inserted into the rotators are multiplied with this rotator in both
-  // input and output, leading to a total gain multiplication if the length is
-  // at sqrt(gain).
-  float rot[4][kNumRotators] = {0};
-  std::vector<PerChannel> channel;
-  // Accu has the channel related data, everything else the same between
-  // channels.
-  float window[kNumRotators];
-  float gain[kNumRotators];
-  int16_t delay[kNumRotators] = {0};
-  int16_t advance[kNumRotators] = {0};
-  int16_t max_delay_ = 0;
-
-  int FindMedian3xLeaker(float window) {
-    // Approximate filter delay. TODO: optimize this value along with gain
-    // values. Recordings can sound better with -2.32 as it pushes the bass
-    // signals a bit earlier and likely compensates human hearing's deficiency
-    // for temporal separation.
-    const float kMagic = -2.2028003503591482;
-    const float kAlmostHalfForRounding = 0.4687;
-    return static_cast<int>(kMagic / log(window) + kAlmostHalfForRounding);
-  }
-
-  Rotators() {}
-  Rotators(int num_channels, std::vector<float> frequency,
-           std::vector<float> filter_gains, const float sample_rate) {
-    channel.resize(num_channels);
-    for (int i = 0; i < kNumRotators; ++i) {
-      // The parameter relates to the frequency shape overlap and window length
-      // of triple leaking integrator.
-      float kWindow = 0.9996;
-      float w40Hz = std::pow(kWindow, 128.0 / kNumRotators);  // at 40 Hz.
-      window[i] = pow(w40Hz, std::max(1.0, frequency[i] / 40.0));
-      delay[i] = FindMedian3xLeaker(window[i]);
-      float windowM1 = 1.0f - window[i];
-      max_delay_ = std::max(max_delay_, delay[i]);
-      float f = frequency[i] * 2.0f * M_PI / sample_rate;
-      gain[i] = filter_gains[i] * pow(windowM1, 3.0);
-      rot[0][i] = float(std::cos(f));
-      rot[1][i] = float(-std::sin(f));
-      rot[2][i] = sqrt(gain[i]);
-      rot[3][i] = 0.0f;
-    }
-    for (size_t i = 0; i < kNumRotators; ++i) {
-      advance[i] = max_delay_ - delay[i];
-    }
-  }
-  void AddAudio(int c, int i, float audio) {
-    audio *= 0.03;
-    channel[c].accu[0][i] += rot[2][i] * audio;
-    channel[c].accu[1][i] += rot[3][i] * audio;
-  }
-  void OccasionallyRenormalize() {
-    for (int i = 0; i < kNumRotators; ++i) {
-      float norm =
-          sqrt(gain[i] / (rot[2][i] * rot[2][i] + rot[3][i] * rot[3][i]));
-      rot[2][i] *= norm;
-      rot[3][i] *= norm;
-    }
-  }
-  void IncrementAll() {
-    for (int i = 0; i < kNumRotators; i++) {
-      const float tr = rot[0][i] * rot[2][i] - rot[1][i] * rot[3][i];
-      const float tc = rot[0][i] * rot[3][i] + rot[1][i] * rot[2][i];
-      rot[2][i] = tr;
-      rot[3][i] = tc;
-    }
-    for (int c = 0; c < channel.size(); ++c) {
-      for (int i = 0; i < kNumRotators; i++) {
-        const float w = window[i];
-        channel[c].accu[0][i] *= w;
-        channel[c].accu[1][i] *= w;
-        channel[c].accu[2][i] *= w;
-        channel[c].accu[3][i] *= w;
-        channel[c].accu[4][i] *= w;
-        channel[c].accu[5][i] *= w;
-        channel[c].accu[2][i] += channel[c].accu[0][i];
-        channel[c].accu[3][i] += channel[c].accu[1][i];
-        channel[c].accu[4][i] += channel[c].accu[2][i];
-        channel[c].accu[5][i] += channel[c].accu[3][i];
-      }
-    }
-  }
-  void GetTriplet(float left_to_right_ratio, int rot_ix, float rightr,
-                  float righti, float leftr, float lefti, float &right,
-                  float &center, float &left) {
-    float aver = rightr + leftr;
-    float avei = righti + lefti;
-
-    center = rot[2][rot_ix] * aver + rot[3][rot_ix] * avei;
-
-    rightr -= left_to_right_ratio * aver;
-    righti -= left_to_right_ratio * avei;
-    leftr -= (1.0 - left_to_right_ratio) * aver;
-    lefti -= (1.0 - left_to_right_ratio) * avei;
-
-    right = rot[2][rot_ix] * rightr + rot[3][rot_ix] * righti;
-    left = rot[2][rot_ix] * leftr + rot[3][rot_ix] * lefti;
+// Renders with a new bank for the sample rate of the input, and the latency
+// budget of the flags.
+template <typename In, typename Out>
+void Process(const int output_channels, const double distance_to_interval_ratio,
+             In &input_stream, Out &output_stream, Out &binaural_output_stream,
+             const std::function<void(int64_t)> &set_progress =
+                 [](int64_t written) {}) {
+  std::vector<float> filter_gains(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    filter_gains[i] = GetFilterGains(i);
   }
-};
+  RotatorFilterBank rfb(kNumRotators, input_stream.channels(),
+                        input_stream.samplerate(), filter_gains,
+                        LatencyBudget(input_stream.samplerate()),
+                        GetLatencyFit());
+  tabuli::revolve::Process(output_channels, distance_to_interval_ratio, rfb,
+                           input_stream, output_stream, binaural_output_stream,
+                           set_progress);
+}
 
-float BarkFreq(float v) {
-  constexpr float linlogsplit = 0.1;
-  if (v < linlogsplit) {
-    return 20.0 + (v / linlogsplit) * 20.0;  // Linear 20-40 Hz.
-  } else {
-    float normalized_v = (v - linlogsplit) * (1.0 / (1.0 - linlogsplit));
-    return 40.0 * pow(500.0, normalized_v);  // Logarithmic 40-20000 Hz.
+// Number of input samples that the rotators and the driver model need from a
+// cleared state to converge, and the output delay of the rotator bank.
+void SegmentWarmupAndLookahead(size_t samplerate, int64_t *warmup,
+                               int64_t *lookahead) {
+  std::vector<float> freqs(kNumRotators);
+  std::vector<float> filter_gains(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
+    filter_gains[i] = GetFilterGains(i);
   }
+  const Rotators rotators(1, freqs, filter_gains, samplerate,
+                          LatencyBudget(samplerate), GetLatencyFit());
+  const float slowest =
+      *std::max_element(rotators.window, rotators.window + kNumRotators);
+  const double tolerance = absl::GetFlag(FLAGS_warmup_tolerance);
+  // The membrane position is the velocity integrated once more.
+  *warmup = tabuli::WarmupSamples(slowest, 3, tolerance) +
+            tabuli::WarmupSamples(MultiChannelDriverModel::kDamping, 2,
+                                  tolerance);
+  *lookahead = rotators.max_delay_;
 }
 
-static constexpr int64_t kBlockSize = 1 << 15;
-static const int kHistorySize = (1 << 18);
-static const int kHistoryMask = kHistorySize - 1;
+// Renders the input in parallel time segments, each pre-rolled over the
+// preceding warm-up samples, and writes them to the outputs in order.
+void ProcessSegments(const int output_channels,
+                     const double distance_to_interval_ratio,
+                     const std::string &input_path,
+                     tabuli::OutputFile &output_file,
+                     tabuli::OutputFile &binaural_output_file) {
+  SndfileHandle input_file(input_path.c_str());
+  QCHECK(input_file) << input_file.strError();
+  int64_t warmup, lookahead;
+  SegmentWarmupAndLookahead(input_file.samplerate(), &warmup, &lookahead);
+  const int64_t segment_frames =
+      absl::GetFlag(FLAGS_segment_seconds) * input_file.samplerate();
+  fprintf(stderr, "Segments of %zu frames, warm-up %zu\n",
+          static_cast<size_t>(segment_frames), static_cast<size_t>(warmup));
+  using Segment = std::pair<std::vector<float>, std::vector<float>>;
+  int64_t written = 0;
+  tabuli::RenderSegments(
+      input_file.frames(), segment_frames, warmup, lookahead,
+      absl::GetFlag(FLAGS_segment_threads),
+      [&](int64_t input_begin, int64_t input_end, int64_t skip, int64_t keep) {
+        tabuli::SegmentReader in(input_path, input_begin, input_end);
+        tabuli::SegmentWriter<float> out(output_channels, skip, keep);
+        tabuli::SegmentWriter<float> binaural_out(2, skip, keep);
+        Process(output_channels, distance_to_interval_ratio, in, out,
+                binaural_out);
+        QCHECK_EQ(out.num_frames(), keep);
+        return Segment{out.frames(), binaural_out.frames()};
+      },
+      [&](const Segment &segment) {
+        output_file.writef(segment.first.data(),
+                           segment.first.size() / output_channels);
+        binaural_output_file.writef(segment.second.data(),
+                                    segment.second.size() / 2);
+        written += segment.second.size() / 2;
+        tabuli::TraceProgress(written);
+      });
+}
 
-struct RotatorFilterBank {
-  RotatorFilterBank(size_t num_rotators, size_t num_channels, size_t samplerate,
-                    const std::vector<float> &filter_gains) {
-    std::vector<float> freqs(num_rotators);
-    for (size_t i = 0; i < num_rotators; ++i) {
-      freqs[i] = BarkFreq(static_cast<float>(i) / (num_rotators - 1));
+// Output file of the pipeline, normalized to peak_db if it is negative.
+class PipelineOutput {
+ public:
+  PipelineOutput(const std::string &path, int format, size_t channels,
+                 size_t samplerate, double peak_db, bool split = false) {
+    if (peak_db < 0) {
+      QCHECK(!split) << "Normalization needs a single file.";
+      normalizing_ = std::make_unique<tabuli::NormalizingWriter>(
+          path, format, channels, samplerate, peak_db);
+    } else {
+      file_ = std::make_unique<tabuli::OutputFile>(path, format, channels,
+                                                   samplerate, split);
     }
-    rotators_ = new Rotators(num_channels, freqs, filter_gains, samplerate);
-
-    max_delay_ = rotators_->max_delay_;
-    QCHECK_LE(max_delay_, kBlockSize);
-    fprintf(stderr, "Rotator bank output delay: %zu\n", max_delay_);
   }
-  ~RotatorFilterBank() { delete rotators_; }
-  Rotators *rotators_;
-  int64_t max_delay_;
-};
 
-float AngleEffect(float dy, float distance) {
-  float dist2 = sqrt(dy * dy + distance * distance);
-  float cos_angle = distance / dist2;
-  cos_angle = cos_angle * cos_angle * cos_angle;
-  return cos_angle;
-}
-
-float HardClip(float v) { return std::max(-1.0f, std::min(1.0f, v)); }
-
-struct MultiChannelDriverModel {
-  std::vector<float>
-      ave;  // For high pass filtering of input voltage (~20 Hz or so)
-  std::vector<float> pos;   // Position of the driver membrane.
-  std::vector<float> dpos;  // Velocity of the driver membrane.
-  void Initialize(size_t n) {
-    ave.resize(n);
-    pos.resize(n);
-    dpos.resize(n);
-  }
-  void Convert(float *p, size_t n) {
-    // This number relates to the resonance frequence of the speakers.
-    // I suspect I have around ~100 Hz.
-    // It is an ad hoc formula.
-    const float kResonance = 100.0;
-    // Funny constant -- perhaps from 1.0 / (2 * pi * samplerate),
-    // didn't analyze yet why this works, but it does.
-    const float kFunnyConstant = 0.0000039;
-    const float kSuspension = kFunnyConstant * kResonance;
-
-    // damping reduces the speed of the membrane passively as it
-    // emits energy or converts it to heat in the suspension deformations
-    const float damping = 0.99999;
-    const float kSomewhatRandomNonPhysicalPositionRegularization = 0.99998;
-
-    const float kInputMul = 0.3;
-
-    for (int k = 0; k < n; ++k) {
-      float kAve = 0.9995;
-      ave[k] *= kAve;
-      ave[k] += (1.0 - kAve) * p[k];
-      float v = kInputMul * (p[k] - ave[k]);
-      dpos[k] *= damping;
-      dpos[k] += v;
-      pos[k] += dpos[k];
-      v += kSuspension * pos[k];
-      pos[k] *= kSomewhatRandomNonPhysicalPositionRegularization;
-      p[k] = HardClip(v);
+  void Write(const float *data, int64_t nframes) {
+    if (normalizing_) {
+      normalizing_->writef(data, nframes);
+    } else {
+      file_->writef(data, nframes);
     }
   }
-};
 
-// Control delays for binaural experience.
-struct BinauralModel {
-  size_t index = 0;
-  float channel[2][4096] = {0};
-  void GetAndAdvance(float *left_arg, float *right_arg) {
-    *left_arg = HardClip(channel[0][index & 0xfff]);
-    *right_arg = HardClip(channel[1][index & 0xfff]);
-    /*
-    channel[1][(index + 27) & 0xfff] += 0.01 * channel[0][index & 0xfff];
-    channel[0][(index + 27) & 0xfff] += 0.01 * channel[1][index & 0xfff];
-    */
-    channel[0][index & 0xfff] = 0.0;
-    channel[1][index & 0xfff] = 0.0;
-    ++index;
-  }
-  void Emit(float *p) { GetAndAdvance(p, p + 1); }
-  void WriteWithDelay(size_t c, size_t delay, float v) {
-    channel[c][(index + delay) & 0xfff] += v;
-  }
-  void WriteWithFloatDelay(int c, float float_delay, float v) {
-    int delay = floor(float_delay);
-    float frac = float_delay - delay;
-    WriteWithDelay(c, delay, v * (1.0 - frac));
-    WriteWithDelay(c, delay + 1, v * frac);
+  void Finish() {
+    if (normalizing_) normalizing_->Finish();
   }
+
+ private:
+  std::unique_ptr<tabuli::OutputFile> file_;
+  std::unique_ptr<tabuli::NormalizingWriter> normalizing_;
 };
 
-float *GetBinauralTable() {
-  static const float binau[16] = {
-      1.4, 1.3, 1.2, 1.1,  1.0, 0.9,  0.8, 0.7,
+constexpr size_t kDeviceChannels = 20;
 
-      0.6, 0.5, 0.4, 0.35, 0.3, 0.25, 0.2, 0.15,
-  };
-  static float table[kNumRotators * 16];
-  for (int i = 0; i < kNumRotators; ++i) {
-    for (int k = 0; k < 16; ++k) {
-      table[i * 16 + k] = pow(binau[k], i / 128.0);
-    }
-  }
-  return table;
+// Channel of the output device that plays the given speaker.
+size_t DeviceChannel(int speaker) {
+  return speaker < 8 ? 2 + speaker : 4 + speaker;
 }
 
-template <typename In, typename Out>
-void Process(const int output_channels, const double distance_to_interval_ratio,
-             In &input_stream, Out &output_stream,
-             Out &binaural_output_stream) {
-  std::vector<float> history(input_stream.channels() * kHistorySize);
-  std::vector<float> input(input_stream.channels() * kBlockSize);
-  std::vector<float> output(output_channels * kBlockSize);
-  std::vector<float> binaural_output(2 * kBlockSize);
-
-  MultiChannelDriverModel dm;
-  dm.Initialize(output_channels);
-  BinauralModel binaural;
-  float *btable = GetBinauralTable();
-  constexpr int64_t kNumRotators = 128;
-  std::vector<float> freqs(kNumRotators);
-  for (size_t i = 0; i < kNumRotators; ++i) {
-    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
-  }
-  std::vector<float> filter_gains(kNumRotators);
-  for (size_t i = 0; i < kNumRotators; ++i) {
-    filter_gains[i] = GetFilterGains(i);
-  }
-
-  RotatorFilterBank rfb(kNumRotators, input_stream.channels(),
-                        input_stream.samplerate(), filter_gains);
-
-  std::vector<float> speaker_to_ratio_table;
-  speaker_to_ratio_table.reserve(kSubSourcePrecision * (output_channels - 1) +
-                                 1);
-  for (int i = 0; i < kSubSourcePrecision * (output_channels - 1) + 1; ++i) {
-    const float x_div_interval = static_cast<float>(i) / kSubSourcePrecision -
-                                 0.5f * (output_channels - 1);
-    const float x_div_distance = x_div_interval / distance_to_interval_ratio;
-    const float angle = std::atan(x_div_distance);
-    speaker_to_ratio_table.push_back(ExpectedLeftToRightRatio(angle));
-  }
-
-  int64_t total_in = 0;
-  bool extend_the_end = true;
-  for (;;) {
-    int64_t out_ix = 0;
-    int64_t read = input_stream.readf(input.data(), kBlockSize);
-    for (int i = 0; i < read; ++i) {
-      int input_ix = i + total_in;
-      history[2 * (input_ix & kHistoryMask) + 0] = input[2 * i];
-      history[2 * (input_ix & kHistoryMask) + 1] = input[2 * i + 1];
-    }
-    printf("read %d\n", int(read));
-    if (read == 0) {
-      if (extend_the_end) {
-        // Empty the filters and the history.
-        extend_the_end = false;
-        read = rfb.max_delay_;
-        printf("empty the history buffer %d\n", int(read));
-        for (int i = 0; i < read; ++i) {
-          int input_ix = i + total_in;
-          history[2 * (input_ix & kHistoryMask) + 0] = 0;
-          history[2 * (input_ix & kHistoryMask) + 1] = 0;
-        }
-      } else {
-        break;
+// Runs the upmix of scripts/upmix.py as concurrent stages: the input is read,
+// scaled and resampled, then filtered into the speaker feeds and the
+// binaural output, and the speaker feeds are written together with their
+// mixes.
+void ProcessPipeline(const int output_channels,
+                     const double distance_to_interval_ratio,
+                     SndfileHandle &input_file, size_t samplerate,
+                     const std::string &multichannel_path,
+                     const std::string &binaural_path) {
+  // A few blocks let each stage run ahead of the next one over a slow block.
+  constexpr size_t kQueueBlocks = 4;
+  tabuli::SpscQueue<tabuli::Block> input_queue(kQueueBlocks);
+  tabuli::SpscQueue<tabuli::Block> speaker_queue(kQueueBlocks);
+  tabuli::SpscQueue<tabuli::Block> binaural_queue(kQueueBlocks);
+
+  std::thread reader([&] {
+    tabuli::QueueWriter out(input_queue, 2);
+    const float gain = std::pow(10.0, absl::GetFlag(FLAGS_input_gain_db) / 20);
+    auto pump = [&](auto &in) {
+      std::vector<float> block(2 * kBlockSize);
+      int64_t read;
+      while ((read = in.readf(block.data(), kBlockSize)) > 0) {
+        for (int64_t i = 0; i < 2 * read; ++i) block[i] *= gain;
+        out.writef(block.data(), read);
       }
+    };
+    if (samplerate != input_file.samplerate()) {
+      tabuli::ResamplingReader<SndfileHandle> resampled(input_file,
+                                                        samplerate);
+      pump(resampled);
+    } else {
+      pump(input_file);
+    }
+    out.Close();
+  });
+
+  std::thread filter([&] {
+    tabuli::QueueReader in(input_queue, 2, samplerate);
+    tabuli::QueueWriter speakers(speaker_queue, output_channels);
+    tabuli::QueueWriter binaural(binaural_queue, 2);
+    Process(output_channels, distance_to_interval_ratio, in, speakers,
+            binaural, tabuli::TraceProgress);
+    speakers.Close();
+    binaural.Close();
+  });
+
+  std::thread mixer([&] {
+    PipelineOutput multichannel(
+        multichannel_path,
+        tabuli::OutputFormat(absl::GetFlag(FLAGS_output_format),
+                             absl::GetFlag(FLAGS_sample_format)),
+        output_channels, samplerate, /*peak_db=*/0,
+        absl::GetFlag(FLAGS_split_output));
+    std::unique_ptr<PipelineOutput> device;
+    if (!absl::GetFlag(FLAGS_device_output).empty()) {
+      device = std::make_unique<PipelineOutput>(
+          absl::GetFlag(FLAGS_device_output), SF_FORMAT_WAV | SF_FORMAT_PCM_24,
+          kDeviceChannels, samplerate, absl::GetFlag(FLAGS_device_peak_db));
     }
-    rfb.rotators_->OccasionallyRenormalize();
-    for (int i = 0; i < read; ++i) {
-      for (int rot = 0; rot < kNumRotators; ++rot) {
-        for (size_t c = 0; c < 2; ++c) {
-          int64_t delayed_ix = total_in + i - rfb.rotators_->advance[rot];
-          size_t histo_ix = 2 * (delayed_ix & kHistoryMask);
-          float delayed = history[histo_ix + c];
-          rfb.rotators_->AddAudio(c, rot, delayed);
+    std::unique_ptr<PipelineOutput> stereo;
+    if (!absl::GetFlag(FLAGS_stereo_output).empty()) {
+      stereo = std::make_unique<PipelineOutput>(
+          absl::GetFlag(FLAGS_stereo_output), SF_FORMAT_WAV | SF_FORMAT_FLOAT,
+          2, samplerate, absl::GetFlag(FLAGS_stereo_peak_db));
+    }
+    std::vector<float> device_frames;
+    std::vector<float> stereo_frames;
+    for (tabuli::Block block = speaker_queue.Pop(); !block.empty();
+         block = speaker_queue.Pop()) {
+      const int64_t nframes = block.size() / output_channels;
+      multichannel.Write(block.data(), nframes);
+      if (device) {
+        device_frames.assign(kDeviceChannels * nframes, 0.0f);
+        for (int64_t i = 0; i < nframes; ++i) {
+          for (int k = 0; k < output_channels; ++k) {
+            device_frames[i * kDeviceChannels + DeviceChannel(k)] =
+                block[i * output_channels + k];
+          }
         }
+        device->Write(device_frames.data(), nframes);
       }
-      rfb.rotators_->IncrementAll();
-      for (int rot = 0; rot < kNumRotators; ++rot) {
-        const float ratio =
-            ActualLeftToRightRatio(rfb.rotators_->channel[1].LenSqr(rot),
-                                   rfb.rotators_->channel[0].LenSqr(rot));
-        float subspeaker_index =
-            (std::lower_bound(speaker_to_ratio_table.begin(),
-                              speaker_to_ratio_table.end(), ratio,
-                              std::greater<>()) -
-             speaker_to_ratio_table.begin()) *
-            (1.0 / kSubSourcePrecision);
-        if (subspeaker_index < 1.0) {
-          subspeaker_index = 1.0;
-        }
-        if (subspeaker_index >= 14.0) {
-          subspeaker_index = 14.0;
-        }
-        float stage_size = 1.3;  // meters
-        float distance_from_center =
-            stage_size * (subspeaker_index - 0.5 * (output_channels - 1)) /
-            (output_channels - 1);
-        float assumed_distance_to_line = stage_size * 1.6;
-        float right, center, left;
-        rfb.rotators_->GetTriplet(subspeaker_index / (output_channels - 1), rot,
-                                  rfb.rotators_->channel[1].accu[4][rot],
-                                  rfb.rotators_->channel[1].accu[5][rot],
-                                  rfb.rotators_->channel[0].accu[4][rot],
-                                  rfb.rotators_->channel[0].accu[5][rot], right,
-                                  center, left);
-        if (total_in + i >= rfb.max_delay_) {
-#define BINAURAL
-#ifdef BINAURAL
-          // left and right.
-          {
-            // left *= 2.0;
-            // right *= 2.0;
-            //  Some hacks here: 27 samples is roughly 19 cm which I use
-            //  as an approximate for the added delay needed for this
-            //  kind of left-right 'residual sound'. perhaps it is too
-            //  much. perhaps having more than one delay would make sense.
-            //
-            //  This computation being left-right and with delay accross
-            //  causes a relaxed feeling of space to emerge.
-            float lbin = left * 2;
-            float rbin = right * 2;
-            size_t delay = 0;
-            for (int i = 0; i < 5; ++i) {
-              binaural.WriteWithDelay(0, delay, lbin);
-              binaural.WriteWithDelay(1, delay, rbin);
-
-              float lt = btable[16 * rot + 15] * lbin;
-              float rt = btable[16 * rot + 15] * rbin;
-
-              // swap:
-              lbin = rt;
-              rbin = lt;
-
-              if (i == 0) {
-                delay += 17;
-              } else {
-                delay += 27;
-              }
-            }
-          }
-          {
-            // center.
-            int speaker = static_cast<int>(floor(subspeaker_index));
-            float off = subspeaker_index - speaker;
-            float right_gain_0 = btable[16 * rot + speaker];
-            float right_gain_1 = btable[16 * rot + speaker + 1];
-            float right_gain = (1.0 - off) * right_gain_0 + off * right_gain_1;
-            float left_gain_0 = btable[16 * rot + 15 - speaker];
-            float left_gain_1 = btable[16 * rot + 15 - speaker - 1];
-            float left_gain = (1.0 - off) * left_gain_0 + off * left_gain_1;
-            float kDelayMul = 0.15;
-            float delay_p = 0;
-            {
-              // Making delay diffs less in the center maintains
-              // a smaller acoustic picture of the singer.
-              // This relates to Euclidian distances and makes
-              // physical sense, too.
-              float len = (output_channels - 1);
-              float dx = subspeaker_index - 0.5 * len;
-              float dist = sqrt(dx * dx + len * len) - len;
-              if (dx < 0) {
-                dist = -dist;
-              }
-              dist += 0.5 * len;
-              delay_p = dist;
-            }
-
-            float delay_l = 1 + kDelayMul * delay_p;
-            float delay_r = 1 + kDelayMul * ((output_channels - 1) - delay_p);
-            binaural.WriteWithFloatDelay(0, delay_l, center * left_gain);
-            binaural.WriteWithFloatDelay(1, delay_r, center * right_gain);
-          }
-#endif
-
-          float speaker_offset_left = (2 - 7.5) * 0.1;
-          float speaker_offset_right = (13 - 7.5) * 0.1;
-
-          for (int kk = 0; kk < output_channels; ++kk) {
-            float speaker_offset = (kk - 7.5) * 0.1;
-            float val = AngleEffect(speaker_offset + distance_from_center,
-                                    assumed_distance_to_line) *
-                        center;
-            output[out_ix * output_channels + kk] += val;
-
-            output[out_ix * output_channels + kk] +=
-                AngleEffect(speaker_offset - speaker_offset_right,
-                            assumed_distance_to_line) *
-                right;
-            output[out_ix * output_channels + kk] +=
-                AngleEffect(speaker_offset - speaker_offset_left,
-                            assumed_distance_to_line) *
-                left;
+      if (stereo) {
+        // Each side has the speakers towards it louder, linearly in the
+        // speaker index.
+        const float norm = 1.0f / (16 * output_channels);
+        stereo_frames.assign(2 * nframes, 0.0f);
+        for (int64_t i = 0; i < nframes; ++i) {
+          for (int k = 0; k < output_channels; ++k) {
+            const float v = block[i * output_channels + k];
+            stereo_frames[2 * i] += (output_channels - k) * norm * v;
+            stereo_frames[2 * i + 1] += (k + 1) * norm * v;
           }
         }
-      }
-      if (total_in + i >= rfb.max_delay_) {
-#ifdef BINAURAL
-        binaural.Emit(&binaural_output[out_ix * 2]);
-#endif
-        dm.Convert(&output[out_ix * output_channels], output_channels);
-        ++out_ix;
+        stereo->Write(stereo_frames.data(), nframes);
       }
     }
-    output_stream.writef(output.data(), out_ix);
-    binaural_output_stream.writef(binaural_output.data(), out_ix);
-    total_in += read;
-    std::fill(output.begin(), output.end(), 0.0);
-    std::fill(binaural_output.begin(), binaural_output.end(), 0.0);
+    multichannel.Finish();
+    if (device) device->Finish();
+    if (stereo) stereo->Finish();
+  });
+
+  PipelineOutput binaural(binaural_path, SF_FORMAT_WAV | SF_FORMAT_PCM_24, 2,
+                          samplerate, absl::GetFlag(FLAGS_binaural_peak_db));
+  for (tabuli::Block block = binaural_queue.Pop(); !block.empty();
+       block = binaural_queue.Pop()) {
+    binaural.Write(block.data(), block.size() / 2);
   }
-};
+  binaural.Finish();
+  reader.join();
+  filter.join();
+  mixer.join();
+}
 
 }  // namespace
 
 int main(int argc, char **argv) {
-  absl::ParseCommandLine(argc, argv);
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+  if (absl::GetFlag(FLAGS_trace) || !absl::GetFlag(FLAGS_trace_json).empty()) {
+    tabuli::EnableTracing(absl::GetFlag(FLAGS_trace_json));
+  }
 
   const int output_channels = absl::GetFlag(FLAGS_output_channels);
   const float distance_to_interval_ratio =
       absl::GetFlag(FLAGS_distance_to_interval_ratio);
 
-  QCHECK_EQ(argc, 4)
+  QCHECK_EQ(args.size(), 4)
       << "Usage: " << argv[0]
       << " <input> <multichannel-output> <binaural-headphone-output>";
 
-  SndfileHandle input_file(argv[1]);
+  SndfileHandle input_file(args[1]);
   QCHECK(input_file) << input_file.strError();
 
   QCHECK_EQ(input_file.channels(), 2);
 
-  SndfileHandle output_file(
-      argv[2], /*mode=*/SFM_WRITE, /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
-      /*channels=*/output_channels, /*samplerate=*/input_file.samplerate());
-
-  SndfileHandle binaural_output_file(
-      argv[3], /*mode=*/SFM_WRITE, /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
-      /*channels=*/2, /*samplerate=*/input_file.samplerate());
-
-  Process(output_channels, distance_to_interval_ratio, input_file, output_file,
-          binaural_output_file);
+  const size_t samplerate = absl::GetFlag(FLAGS_internal_samplerate) > 0
+                                ? absl::GetFlag(FLAGS_internal_samplerate)
+                                : input_file.samplerate();
+
+  if (absl::GetFlag(FLAGS_pipeline)) {
+    QCHECK_LE(absl::GetFlag(FLAGS_segment_seconds), 0)
+        << "The pipeline renders the input as one stream.";
+    QCHECK(absl::GetFlag(FLAGS_device_output).empty() || output_channels == 16)
+        << "The output device has 16 speakers.";
+    ProcessPipeline(output_channels, distance_to_interval_ratio, input_file,
+                    samplerate, args[2], args[3]);
+    tabuli::ReportTracing(samplerate);
+    return 0;
+  }
+  QCHECK(absl::GetFlag(FLAGS_device_output).empty() &&
+         absl::GetFlag(FLAGS_stereo_output).empty() &&
+         absl::GetFlag(FLAGS_input_gain_db) == 0 &&
+         absl::GetFlag(FLAGS_binaural_peak_db) == 0)
+      << "Gains, normalization and mixes need --pipeline.";
+
+  tabuli::OutputFile output_file(
+      args[2],
+      tabuli::OutputFormat(absl::GetFlag(FLAGS_output_format),
+                           absl::GetFlag(FLAGS_sample_format)),
+      output_channels, samplerate, absl::GetFlag(FLAGS_split_output));
+
+  tabuli::OutputFile binaural_output_file(
+      args[3], /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24, /*channels=*/2,
+      samplerate, /*split=*/false);
+
+  if (samplerate != input_file.samplerate()) {
+    QCHECK_LE(absl::GetFlag(FLAGS_segment_seconds), 0)
+        << "Segmented rendering reads the input at its own sample rate.";
+    tabuli::ResamplingReader<SndfileHandle> resampled(input_file, samplerate);
+    // Resamples on the reader thread.
+    tabuli::AsyncReader<tabuli::ResamplingReader<SndfileHandle>> input(
+        resampled);
+    tabuli::AsyncWriter<tabuli::OutputFile> output(output_file,
+                                                   output_channels);
+    tabuli::AsyncWriter<tabuli::OutputFile> binaural_output(
+        binaural_output_file, 2);
+    Process(output_channels, distance_to_interval_ratio, input, output,
+            binaural_output, tabuli::TraceProgress);
+    output.Close();
+    binaural_output.Close();
+    tabuli::ReportTracing(samplerate);
+    return 0;
+  }
+  if (absl::GetFlag(FLAGS_segment_seconds) > 0) {
+    ProcessSegments(output_channels, distance_to_interval_ratio, args[1],
+                    output_file, binaural_output_file);
+    tabuli::ReportTracing(samplerate);
+    return 0;
+  }
+  tabuli::AsyncReader<SndfileHandle> input(input_file);
+  tabuli::AsyncWriter<tabuli::OutputFile> output(output_file, output_channels);
+  tabuli::AsyncWriter<tabuli::OutputFile> binaural_output(binaural_output_file,
+                                                          2);
+  Process(output_channels, distance_to_interval_ratio, input, output,
+          binaural_output, tabuli::TraceProgress);
+  output.Close();
+  binaural_output.Close();
+  tabuli::ReportTracing(samplerate);
 }
@@ -0,0 +1,141 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "revolve_engine.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "fourier_bank.h"
+
+namespace tabuli {
+namespace revolve {
+
+namespace {
+
+float MicrophoneResponse(const float angle) {
+  return 0.5f * (1.0f + std::cos(angle));
+}
+
+}  // namespace
+
+float ExpectedLeftToRightRatio(const float angle) {
+  return (1e-3 + MicrophoneResponse(angle + M_PI / 4)) /
+         (1e-3 + MicrophoneResponse(angle - M_PI / 4));
+}
+
+float ActualLeftToRightRatio(float left, float right) {
+  return std::sqrt((1e-13 + left) / (1e-13 + right));
+}
+
+float GetFilterGains(int i) {
+  static const float kFilterGains[kNumRotators] = {
+      1.050645, 1.948438, 3.050339, 3.967913, 4.818584, 5.303335, 5.560281,
+      5.490826, 5.156689, 4.547374, 3.691308, 2.666868, 1.539254, 0.656948,
+      0.345893, 0.327111, 0.985318, 1.223506, 0.447645, 0.830961, 1.075181,
+      0.613335, 0.902695, 0.855391, 0.817774, 0.823359, 0.841483, 0.838562,
+      0.831912, 0.808731, 0.865214, 0.808036, 0.850837, 0.821305, 0.839458,
+      0.829195, 0.836373, 0.827271, 0.836018, 0.834514, 0.825624, 0.836999,
+      0.833990, 0.832992, 0.830897, 0.832593, 0.846116, 0.824796, 0.829331,
+      0.844509, 0.838830, 0.821733, 0.840738, 0.841735, 0.827570, 0.838581,
+      0.837742, 0.834965, 0.842970, 0.832145, 0.847596, 0.840942, 0.830891,
+      0.850632, 0.841468, 0.838383, 0.841493, 0.855118, 0.826750, 0.848000,
+      0.874356, 0.812177, 0.849037, 0.893550, 0.832527, 0.827986, 0.877198,
+      0.851760, 0.846317, 0.883044, 0.843178, 0.856925, 0.857045, 0.860695,
+      0.894345, 0.870391, 0.839519, 0.870541, 0.870573, 0.902951, 0.871798,
+      0.818328, 0.871413, 0.921101, 0.863915, 0.793014, 0.936519, 0.888107,
+      0.856968, 0.821018, 0.987345, 0.904846, 0.783447, 0.973613, 0.903628,
+      0.875688, 0.931024, 0.992087, 0.806914, 1.050332, 0.942569, 0.800870,
+      1.210426, 0.916555, 0.817352, 1.126946, 0.985119, 0.922530, 0.994633,
+      0.959602, 0.381419, 1.879201, 2.078451, 0.475196, 0.952731, 1.709305,
+      1.383894, 1.557669,
+  };
+  return kFilterGains[i];
+}
+
+float BarkFreq(float v) {
+  constexpr float linlogsplit = 0.1;
+  if (v < linlogsplit) {
+    return 20.0 + (v / linlogsplit) * 20.0;  // Linear 20-40 Hz.
+  } else {
+    float normalized_v = (v - linlogsplit) * (1.0 / (1.0 - linlogsplit));
+    return 40.0 * pow(500.0, normalized_v);  // Logarithmic 40-20000 Hz.
+  }
+}
+
+std::vector<float> BudgetFilterGains(size_t samplerate,
+                                     std::vector<float> filter_gains,
+                                     int64_t max_delay,
+                                     LatencyFit latency_fit) {
+  if (max_delay <= 0) return filter_gains;
+  std::vector<float> freqs(kNumRotators);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (kNumRotators - 1));
+  }
+  const ::tabuli::Rotators unbounded(0, freqs, filter_gains, samplerate, 1.0f);
+  const ::tabuli::Rotators bounded(0, freqs, filter_gains, samplerate,
+                                   1.0f, max_delay, latency_fit);
+  for (size_t i = 0; i < kNumRotators; ++i) {
+    if (unbounded.gain[i] == 0.0f) continue;
+    filter_gains[i] *= bounded.gain[i] / unbounded.gain[i] *
+                       std::pow((1.0 - unbounded.window[i]) /
+                                    (1.0 - bounded.window[i]),
+                                3.0);
+  }
+  return filter_gains;
+}
+
+RotatorFilterBank::RotatorFilterBank(size_t num_rotators, size_t num_channels,
+                                     size_t samplerate,
+                                     const std::vector<float> &filter_gains,
+                                     int64_t max_delay,
+                                     LatencyFit latency_fit) {
+  std::vector<float> freqs(num_rotators);
+  for (size_t i = 0; i < num_rotators; ++i) {
+    freqs[i] = BarkFreq(static_cast<float>(i) / (num_rotators - 1));
+  }
+  rotators_ = new Rotators(
+      num_channels, freqs,
+      BudgetFilterGains(samplerate, filter_gains, max_delay, latency_fit),
+      samplerate, max_delay, latency_fit);
+
+  max_delay_ = rotators_->max_delay_;
+  QCHECK_LE(max_delay_, kBlockSize);
+  fprintf(stderr, "Rotator bank output delay: %zu\n", max_delay_);
+}
+
+const float *GetBinauralTable() {
+  static const float binau[16] = {
+      1.4, 1.3, 1.2, 1.1,  1.0, 0.9,  0.8, 0.7,
+
+      0.6, 0.5, 0.4, 0.35, 0.3, 0.25, 0.2, 0.15,
+  };
+  // Computed once, since concurrent renders share it.
+  static const float *table = [] {
+    static float table[kNumRotators * 16];
+    for (int i = 0; i < kNumRotators; ++i) {
+      for (int k = 0; k < 16; ++k) {
+        table[i * 16 + k] = pow(binau[k], i / 128.0);
+      }
+    }
+    return table;
+  }();
+  return table;
+}
+
+}  // namespace revolve
+}  // namespace tabuli
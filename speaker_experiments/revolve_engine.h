@@ -0,0 +1,521 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The upmixer of revolve: a bank of rotators splits a stereo input into
+// frequency bands, places each band between the speakers of a line array by
+// the level difference of its channels, and mixes the speaker feeds and a
+// binaural rendering of them.
+
+#ifndef _TABULI_REVOLVE_ENGINE_H
+#define _TABULI_REVOLVE_ENGINE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "denormals.h"
+#include "fourier_bank.h"
+#include "trace.h"
+
+namespace tabuli {
+namespace revolve {
+
+constexpr int kSubSourcePrecision = 1000;
+
+constexpr int64_t kNumRotators = 128;
+
+static constexpr int64_t kBlockSize = 1 << 15;
+// The delay of the bank is at most a block, see RotatorFilterBank.
+static const int kHistorySize = 2 * kBlockSize;
+static const int kHistoryMask = kHistorySize - 1;
+
+float ExpectedLeftToRightRatio(float angle);
+
+float ActualLeftToRightRatio(float left, float right);
+
+float GetFilterGains(int i);
+
+float BarkFreq(float v);
+
+// Filter gains refit for a latency budget. A budget changes how the
+// responses of neighbouring rotators add up, so each gain is scaled as
+// tabuli::Rotators::AdaptGains scales the gain of the same rotator.
+std::vector<float> BudgetFilterGains(size_t samplerate,
+                                     std::vector<float> filter_gains,
+                                     int64_t max_delay,
+                                     LatencyFit latency_fit);
+
+struct PerChannel {
+  // [0..1] is for real and imag of 1st leaking accumulation
+  // [2..3] is for real and imag of 2nd leaking accumulation
+  // [4..5] is for real and imag of 3rd leaking accumulation
+  float accu[6][kNumRotators] = {0};
+  float LenSqr(size_t i) {
+    return accu[4][i] * accu[4][i] + accu[5][i] * accu[5][i];
+  }
+};
+
+struct Rotators {
+  // Four arrays of rotators.
+  // [0..1] is real and imag for rotation speed
+  // [2..3] is real and image for a frequency rotator of length sqrt(gain[i])
+  // Values inserted into the rotators are multiplied with this rotator in both
+  // input and output, leading to a total gain multiplication if the length is
+  // at sqrt(gain).
+  float rot[4][kNumRotators] = {0};
+  std::vector<PerChannel> channel;
+  // Accu has the channel related data, everything else the same between
+  // channels.
+  float window[kNumRotators];
+  float gain[kNumRotators];
+  int16_t delay[kNumRotators] = {0};
+  int16_t advance[kNumRotators] = {0};
+  int16_t max_delay_ = 0;
+
+  int FindMedian3xLeaker(float window) {
+    // Approximate filter delay. TODO: optimize this value along with gain
+    // values. Recordings can sound better with -2.32 as it pushes the bass
+    // signals a bit earlier and likely compensates human hearing's deficiency
+    // for temporal separation.
+    const float kMagic = -2.2028003503591482;
+    const float kAlmostHalfForRounding = 0.4687;
+    return static_cast<int>(kMagic / log(window) + kAlmostHalfForRounding);
+  }
+
+  Rotators() {}
+  // If max_delay is positive, the output delay is at most max_delay samples,
+  // with the slower rotators fit into it as in tabuli::Rotators.
+  Rotators(int num_channels, std::vector<float> frequency,
+           std::vector<float> filter_gains, const float sample_rate,
+           int64_t max_delay = 0,
+           LatencyFit latency_fit = SHORTEN_WINDOW) {
+    channel.resize(num_channels);
+    for (int i = 0; i < kNumRotators; ++i) {
+      // The parameter relates to the frequency shape overlap and window length
+      // of triple leaking integrator.
+      float kWindow = 0.9996;
+      float w40Hz = std::pow(kWindow, 128.0 / kNumRotators);  // at 40 Hz.
+      window[i] = pow(w40Hz, std::max(1.0, frequency[i] / 40.0));
+      delay[i] = FindMedian3xLeaker(window[i]);
+      if (max_delay > 0 && delay[i] > max_delay) {
+        if (latency_fit == SHORTEN_WINDOW) {
+          // The delay is inversely proportional to the log of the window.
+          window[i] = std::pow(window[i],
+                               static_cast<double>(delay[i]) / max_delay);
+        }
+        delay[i] = max_delay;
+      }
+      float windowM1 = 1.0f - window[i];
+      max_delay_ = std::max(max_delay_, delay[i]);
+      float f = frequency[i] * 2.0f * M_PI / sample_rate;
+      gain[i] = filter_gains[i] * pow(windowM1, 3.0);
+      rot[0][i] = float(std::cos(f));
+      rot[1][i] = float(-std::sin(f));
+      rot[2][i] = sqrt(gain[i]);
+      rot[3][i] = 0.0f;
+    }
+    for (size_t i = 0; i < kNumRotators; ++i) {
+      advance[i] = max_delay_ - delay[i];
+    }
+  }
+  // Returns the state to that of a new bank with the same parameters.
+  void Restart() {
+    for (int i = 0; i < kNumRotators; ++i) {
+      rot[2][i] = sqrt(gain[i]);
+      rot[3][i] = 0.0f;
+    }
+    for (PerChannel &c : channel) c = PerChannel();
+  }
+  void AddAudio(int c, int i, float audio) {
+    audio *= 0.03;
+    channel[c].accu[0][i] += rot[2][i] * audio;
+    channel[c].accu[1][i] += rot[3][i] * audio;
+  }
+  void OccasionallyRenormalize() {
+    for (int i = 0; i < kNumRotators; ++i) {
+      float norm =
+          sqrt(gain[i] / (rot[2][i] * rot[2][i] + rot[3][i] * rot[3][i]));
+      rot[2][i] *= norm;
+      rot[3][i] *= norm;
+    }
+  }
+  void IncrementAll() {
+    for (int i = 0; i < kNumRotators; i++) {
+      const float tr = rot[0][i] * rot[2][i] - rot[1][i] * rot[3][i];
+      const float tc = rot[0][i] * rot[3][i] + rot[1][i] * rot[2][i];
+      rot[2][i] = tr;
+      rot[3][i] = tc;
+    }
+    for (int c = 0; c < channel.size(); ++c) {
+      for (int i = 0; i < kNumRotators; i++) {
+        const float w = window[i];
+        channel[c].accu[0][i] *= w;
+        channel[c].accu[1][i] *= w;
+        channel[c].accu[2][i] *= w;
+        channel[c].accu[3][i] *= w;
+        channel[c].accu[4][i] *= w;
+        channel[c].accu[5][i] *= w;
+        channel[c].accu[2][i] += channel[c].accu[0][i];
+        channel[c].accu[3][i] += channel[c].accu[1][i];
+        channel[c].accu[4][i] += channel[c].accu[2][i];
+        channel[c].accu[5][i] += channel[c].accu[3][i];
+      }
+    }
+  }
+  void GetTriplet(float left_to_right_ratio, int rot_ix, float rightr,
+                  float righti, float leftr, float lefti, float &right,
+                  float &center, float &left) {
+    float aver = rightr + leftr;
+    float avei = righti + lefti;
+
+    center = rot[2][rot_ix] * aver + rot[3][rot_ix] * avei;
+
+    rightr -= left_to_right_ratio * aver;
+    righti -= left_to_right_ratio * avei;
+    leftr -= (1.0 - left_to_right_ratio) * aver;
+    lefti -= (1.0 - left_to_right_ratio) * avei;
+
+    right = rot[2][rot_ix] * rightr + rot[3][rot_ix] * righti;
+    left = rot[2][rot_ix] * leftr + rot[3][rot_ix] * lefti;
+  }
+};
+
+// The rotators of a stereo input. If max_delay is positive, the output
+// delay is at most max_delay samples.
+struct RotatorFilterBank {
+  RotatorFilterBank(size_t num_rotators, size_t num_channels, size_t samplerate,
+                    const std::vector<float> &filter_gains,
+                    int64_t max_delay = 0,
+                    LatencyFit latency_fit = SHORTEN_WINDOW);
+  ~RotatorFilterBank() { delete rotators_; }
+  // Returns the bank to its state after construction, for the next input.
+  void Restart() { rotators_->Restart(); }
+  Rotators *rotators_;
+  int64_t max_delay_;
+};
+
+inline float AngleEffect(float dy, float distance) {
+  float dist2 = sqrt(dy * dy + distance * distance);
+  float cos_angle = distance / dist2;
+  cos_angle = cos_angle * cos_angle * cos_angle;
+  return cos_angle;
+}
+
+inline float HardClip(float v) { return std::max(-1.0f, std::min(1.0f, v)); }
+
+struct MultiChannelDriverModel {
+  // Slowest decay of the membrane state, which integrates the velocity.
+  static constexpr float kDamping = 0.99999;
+
+  std::vector<float>
+      ave;  // For high pass filtering of input voltage (~20 Hz or so)
+  std::vector<float> pos;   // Position of the driver membrane.
+  std::vector<float> dpos;  // Velocity of the driver membrane.
+  void Initialize(size_t n) {
+    ave.resize(n);
+    pos.resize(n);
+    dpos.resize(n);
+  }
+  void Convert(float *p, size_t n) {
+    // This number relates to the resonance frequence of the speakers.
+    // I suspect I have around ~100 Hz.
+    // It is an ad hoc formula.
+    const float kResonance = 100.0;
+    // Funny constant -- perhaps from 1.0 / (2 * pi * samplerate),
+    // didn't analyze yet why this works, but it does.
+    const float kFunnyConstant = 0.0000039;
+    const float kSuspension = kFunnyConstant * kResonance;
+
+    // damping reduces the speed of the membrane passively as it
+    // emits energy or converts it to heat in the suspension deformations
+    const float damping = kDamping;
+    const float kSomewhatRandomNonPhysicalPositionRegularization = 0.99998;
+
+    const float kInputMul = 0.3;
+
+    for (int k = 0; k < n; ++k) {
+      float kAve = 0.9995;
+      ave[k] *= kAve;
+      ave[k] += (1.0 - kAve) * p[k];
+      float v = kInputMul * (p[k] - ave[k]);
+      dpos[k] *= damping;
+      dpos[k] += v;
+      pos[k] += dpos[k];
+      v += kSuspension * pos[k];
+      pos[k] *= kSomewhatRandomNonPhysicalPositionRegularization;
+      p[k] = HardClip(v);
+    }
+  }
+};
+
+// Control delays for binaural experience.
+struct BinauralModel {
+  size_t index = 0;
+  float channel[2][4096] = {0};
+  void GetAndAdvance(float *left_arg, float *right_arg) {
+    *left_arg = HardClip(channel[0][index & 0xfff]);
+    *right_arg = HardClip(channel[1][index & 0xfff]);
+    /*
+    channel[1][(index + 27) & 0xfff] += 0.01 * channel[0][index & 0xfff];
+    channel[0][(index + 27) & 0xfff] += 0.01 * channel[1][index & 0xfff];
+    */
+    channel[0][index & 0xfff] = 0.0;
+    channel[1][index & 0xfff] = 0.0;
+    ++index;
+  }
+  void Emit(float *p) { GetAndAdvance(p, p + 1); }
+  void WriteWithDelay(size_t c, size_t delay, float v) {
+    channel[c][(index + delay) & 0xfff] += v;
+  }
+  void WriteWithFloatDelay(int c, float float_delay, float v) {
+    int delay = floor(float_delay);
+    float frac = float_delay - delay;
+    WriteWithDelay(c, delay, v * (1.0 - frac));
+    WriteWithDelay(c, delay + 1, v * frac);
+  }
+};
+
+// Gains of the rotators at the 16 speaker positions of the binaural mix.
+const float *GetBinauralTable();
+
+// Renders the stereo input_stream into output_channels speaker feeds and a
+// binaural output with the bank rfb, which has to be new or restarted.
+template <typename In, typename Out>
+void Process(const int output_channels, const double distance_to_interval_ratio,
+             RotatorFilterBank &rfb, In &input_stream, Out &output_stream,
+             Out &binaural_output_stream,
+             const std::function<void(int64_t)> &set_progress =
+                 [](int64_t written) {}) {
+  ScopedFlushDenormals flush_denormals;
+  std::vector<float> history(input_stream.channels() * kHistorySize);
+  std::vector<float> input(input_stream.channels() * kBlockSize);
+  std::vector<float> output(output_channels * kBlockSize);
+  std::vector<float> binaural_output(2 * kBlockSize);
+
+  MultiChannelDriverModel dm;
+  dm.Initialize(output_channels);
+  BinauralModel binaural;
+  const float *btable = GetBinauralTable();
+
+  std::vector<float> speaker_to_ratio_table;
+  speaker_to_ratio_table.reserve(kSubSourcePrecision * (output_channels - 1) +
+                                 1);
+  for (int i = 0; i < kSubSourcePrecision * (output_channels - 1) + 1; ++i) {
+    const float x_div_interval = static_cast<float>(i) / kSubSourcePrecision -
+                                 0.5f * (output_channels - 1);
+    const float x_div_distance = x_div_interval / distance_to_interval_ratio;
+    const float angle = std::atan(x_div_distance);
+    speaker_to_ratio_table.push_back(ExpectedLeftToRightRatio(angle));
+  }
+
+  int64_t total_in = 0;
+  int64_t total_out = 0;
+  bool extend_the_end = true;
+  for (;;) {
+    int64_t out_ix = 0;
+    int64_t read;
+    {
+      ScopedStage stage(kStageRead);
+      read = input_stream.readf(input.data(), kBlockSize);
+    }
+    {
+      ScopedStage stage(kStageHistory);
+      for (int i = 0; i < read; ++i) {
+        int input_ix = i + total_in;
+        history[2 * (input_ix & kHistoryMask) + 0] = input[2 * i];
+        history[2 * (input_ix & kHistoryMask) + 1] = input[2 * i + 1];
+      }
+    }
+    if (read == 0) {
+      if (extend_the_end) {
+        // Empty the filters and the history.
+        extend_the_end = false;
+        read = rfb.max_delay_;
+        for (int i = 0; i < read; ++i) {
+          int input_ix = i + total_in;
+          history[2 * (input_ix & kHistoryMask) + 0] = 0;
+          history[2 * (input_ix & kHistoryMask) + 1] = 0;
+        }
+      } else {
+        break;
+      }
+    }
+    rfb.rotators_->OccasionallyRenormalize();
+    // The mix of each sample needs the rotator state right after it, so the
+    // two alternate within one span for the whole block.
+    {
+      ScopedStage stage(kStageFilter);
+      for (int i = 0; i < read; ++i) {
+        for (int rot = 0; rot < kNumRotators; ++rot) {
+          for (size_t c = 0; c < 2; ++c) {
+            int64_t delayed_ix = total_in + i - rfb.rotators_->advance[rot];
+            size_t histo_ix = 2 * (delayed_ix & kHistoryMask);
+            float delayed = history[histo_ix + c];
+            rfb.rotators_->AddAudio(c, rot, delayed);
+          }
+        }
+        rfb.rotators_->IncrementAll();
+        for (int rot = 0; rot < kNumRotators; ++rot) {
+          const float ratio =
+              ActualLeftToRightRatio(rfb.rotators_->channel[1].LenSqr(rot),
+                                     rfb.rotators_->channel[0].LenSqr(rot));
+          float subspeaker_index =
+              (std::lower_bound(speaker_to_ratio_table.begin(),
+                                speaker_to_ratio_table.end(), ratio,
+                                std::greater<>()) -
+               speaker_to_ratio_table.begin()) *
+              (1.0 / kSubSourcePrecision);
+          if (subspeaker_index < 1.0) {
+            subspeaker_index = 1.0;
+          }
+          if (subspeaker_index >= 14.0) {
+            subspeaker_index = 14.0;
+          }
+          float stage_size = 1.3;  // meters
+          float distance_from_center =
+              stage_size * (subspeaker_index - 0.5 * (output_channels - 1)) /
+              (output_channels - 1);
+          float assumed_distance_to_line = stage_size * 1.6;
+          float right, center, left;
+          rfb.rotators_->GetTriplet(
+              subspeaker_index / (output_channels - 1), rot,
+              rfb.rotators_->channel[1].accu[4][rot],
+              rfb.rotators_->channel[1].accu[5][rot],
+              rfb.rotators_->channel[0].accu[4][rot],
+              rfb.rotators_->channel[0].accu[5][rot], right, center, left);
+          if (total_in + i >= rfb.max_delay_) {
+#define BINAURAL
+#ifdef BINAURAL
+            // left and right.
+            {
+              // left *= 2.0;
+              // right *= 2.0;
+              //  Some hacks here: 27 samples is roughly 19 cm which I use
+              //  as an approximate for the added delay needed for this
+              //  kind of left-right 'residual sound'. perhaps it is too
+              //  much. perhaps having more than one delay would make sense.
+              //
+              //  This computation being left-right and with delay accross
+              //  causes a relaxed feeling of space to emerge.
+              float lbin = left * 2;
+              float rbin = right * 2;
+              size_t delay = 0;
+              for (int i = 0; i < 5; ++i) {
+                binaural.WriteWithDelay(0, delay, lbin);
+                binaural.WriteWithDelay(1, delay, rbin);
+
+                float lt = btable[16 * rot + 15] * lbin;
+                float rt = btable[16 * rot + 15] * rbin;
+
+                // swap:
+                lbin = rt;
+                rbin = lt;
+
+                if (i == 0) {
+                  delay += 17;
+                } else {
+                  delay += 27;
+                }
+              }
+            }
+            {
+              // center.
+              int speaker = static_cast<int>(floor(subspeaker_index));
+              float off = subspeaker_index - speaker;
+              float right_gain_0 = btable[16 * rot + speaker];
+              float right_gain_1 = btable[16 * rot + speaker + 1];
+              float right_gain =
+                  (1.0 - off) * right_gain_0 + off * right_gain_1;
+              float left_gain_0 = btable[16 * rot + 15 - speaker];
+              float left_gain_1 = btable[16 * rot + 15 - speaker - 1];
+              float left_gain = (1.0 - off) * left_gain_0 + off * left_gain_1;
+              float kDelayMul = 0.15;
+              float delay_p = 0;
+              {
+                // Making delay diffs less in the center maintains
+                // a smaller acoustic picture of the singer.
+                // This relates to Euclidian distances and makes
+                // physical sense, too.
+                float len = (output_channels - 1);
+                float dx = subspeaker_index - 0.5 * len;
+                float dist = sqrt(dx * dx + len * len) - len;
+                if (dx < 0) {
+                  dist = -dist;
+                }
+                dist += 0.5 * len;
+                delay_p = dist;
+              }
+
+              float delay_l = 1 + kDelayMul * delay_p;
+              float delay_r = 1 + kDelayMul * ((output_channels - 1) - delay_p);
+              binaural.WriteWithFloatDelay(0, delay_l, center * left_gain);
+              binaural.WriteWithFloatDelay(1, delay_r, center * right_gain);
+            }
+#endif
+
+            float speaker_offset_left = (2 - 7.5) * 0.1;
+            float speaker_offset_right = (13 - 7.5) * 0.1;
+
+            for (int kk = 0; kk < output_channels; ++kk) {
+              float speaker_offset = (kk - 7.5) * 0.1;
+              float val = AngleEffect(speaker_offset + distance_from_center,
+                                      assumed_distance_to_line) *
+                          center;
+              output[out_ix * output_channels + kk] += val;
+
+              output[out_ix * output_channels + kk] +=
+                  AngleEffect(speaker_offset - speaker_offset_right,
+                              assumed_distance_to_line) *
+                  right;
+              output[out_ix * output_channels + kk] +=
+                  AngleEffect(speaker_offset - speaker_offset_left,
+                              assumed_distance_to_line) *
+                  left;
+            }
+          }
+        }
+        if (total_in + i >= rfb.max_delay_) {
+#ifdef BINAURAL
+          binaural.Emit(&binaural_output[out_ix * 2]);
+#endif
+          ++out_ix;
+        }
+      }
+    }
+    {
+      // Each frame is complete once the sample loop has passed it.
+      ScopedStage stage(kStageDriver);
+      for (int64_t i = 0; i < out_ix; ++i) {
+        dm.Convert(&output[i * output_channels], output_channels);
+      }
+    }
+    {
+      ScopedStage stage(kStageWrite);
+      output_stream.writef(output.data(), out_ix);
+      binaural_output_stream.writef(binaural_output.data(), out_ix);
+    }
+    total_in += read;
+    total_out += out_ix;
+    set_progress(total_out);
+    std::fill(output.begin(), output.end(), 0.0);
+    std::fill(binaural_output.begin(), binaural_output.end(), 0.0);
+  }
+}
+
+}  // namespace revolve
+}  // namespace tabuli
+
+#endif  // _TABULI_REVOLVE_ENGINE_H
@@ -0,0 +1,60 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "segment_render.h"
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "absl/log/check.h"
+#include "sndfile.hh"
+
+namespace tabuli {
+
+int64_t WarmupSamples(double window, int order, double tolerance) {
+  QCHECK(window > 0 && window < 1) << window;
+  QCHECK_GE(order, 1);
+  // The response of the cascade is a polynomial of degree order - 1 times
+  // window^j, which peaks at j = (order - 1) / -log(window).
+  const double log_window = std::log(window);
+  auto log_envelope = [&](double j) {
+    double v = j * log_window;
+    for (int k = 1; k < order; ++k) v += std::log(j + k);
+    return v;
+  };
+  const double peak_j = (order - 1) / -log_window;
+  const double threshold = log_envelope(peak_j) + std::log(tolerance);
+  int64_t lo = std::ceil(peak_j);
+  int64_t hi = std::max<int64_t>(lo, 1);
+  while (log_envelope(hi) > threshold) hi *= 2;
+  while (lo < hi) {
+    const int64_t mid = lo + (hi - lo) / 2;
+    if (log_envelope(mid) > threshold) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+SegmentReader::SegmentReader(const std::string &path, int64_t begin,
+                             int64_t end)
+    : file_(path.c_str()), pos_(begin), end_(end) {
+  QCHECK(file_) << file_.strError();
+  QCHECK_EQ(file_.seek(begin, SEEK_SET), begin);
+}
+
+}  // namespace tabuli
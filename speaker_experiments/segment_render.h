@@ -0,0 +1,128 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_SEGMENT_RENDER_H
+#define _TABULI_SEGMENT_RENDER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <future>  // NOLINT
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "sndfile.hh"
+
+namespace tabuli {
+
+// Number of samples after which the impulse response of 'order' cascaded
+// leaking integrators with the given window has decayed below 'tolerance'
+// of its peak. Running a filter for this long from a wrong (zero) state
+// makes its output indistinguishable from a run over the full signal.
+int64_t WarmupSamples(double window, int order, double tolerance);
+
+// Input stream over the frames [begin, end) of a sound file.
+class SegmentReader {
+ public:
+  SegmentReader(const std::string &path, int64_t begin, int64_t end);
+
+  size_t channels() const { return file_.channels(); }
+  size_t samplerate() const { return file_.samplerate(); }
+
+  template <typename T>
+  int64_t readf(T *data, int64_t nframes) {
+    nframes = std::min(nframes, end_ - pos_);
+    const int64_t read = file_.readf(data, nframes);
+    pos_ += read;
+    return read;
+  }
+
+ private:
+  SndfileHandle file_;
+  int64_t pos_;
+  int64_t end_;
+};
+
+// Output stream that keeps the frames [skip, skip + keep) of what is written
+// to it and drops the rest.
+template <typename T>
+class SegmentWriter {
+ public:
+  SegmentWriter(size_t frame_size, int64_t skip, int64_t keep)
+      : frame_size_(frame_size), skip_(skip), keep_(keep) {
+    frames_.reserve(frame_size_ * keep_);
+  }
+
+  size_t frame_size() const { return frame_size_; }
+  size_t channels() const { return frame_size_; }
+
+  int64_t writef(const T *data, int64_t nframes) {
+    const int64_t first = std::clamp<int64_t>(skip_ - written_, 0, nframes);
+    const int64_t last =
+        std::clamp<int64_t>(skip_ + keep_ - written_, 0, nframes);
+    frames_.insert(frames_.end(), data + first * frame_size_,
+                   data + last * frame_size_);
+    written_ += nframes;
+    return nframes;
+  }
+
+  const std::vector<T> &frames() const { return frames_; }
+  int64_t num_frames() const { return frames_.size() / frame_size_; }
+
+ private:
+  size_t frame_size_;
+  int64_t skip_;
+  int64_t keep_;
+  int64_t written_ = 0;
+  std::vector<T> frames_;
+};
+
+// Renders [0, num_frames) in segments of segment_frames on up to num_threads
+// threads, and hands the results to write() in order.
+//
+// render(input_begin, input_end, skip, keep) processes the input frames
+// [input_begin, input_end) from a cleared state, and returns the output
+// frames [skip, skip + keep) of that run. Each segment is pre-rolled by
+// 'warmup' frames so that the state has converged when its first output
+// frame is reached, and runs 'lookahead' frames past its end for filters
+// whose output depends on future input.
+template <typename Render, typename Write>
+void RenderSegments(int64_t num_frames, int64_t segment_frames,
+                    int64_t warmup, int64_t lookahead, size_t num_threads,
+                    const Render &render, const Write &write) {
+  QCHECK_GT(segment_frames, 0);
+  QCHECK_GT(num_threads, 0);
+  using Result = decltype(render(int64_t{}, int64_t{}, int64_t{}, int64_t{}));
+  std::deque<std::future<Result>> in_flight;
+  int64_t begin = 0;
+  while (begin < num_frames || !in_flight.empty()) {
+    while (begin < num_frames && in_flight.size() < num_threads) {
+      const int64_t end = std::min(num_frames, begin + segment_frames);
+      const int64_t input_begin = std::max<int64_t>(0, begin - warmup);
+      const int64_t input_end = std::min(num_frames, end + lookahead);
+      in_flight.push_back(std::async(std::launch::async, render, input_begin,
+                                     input_end, begin - input_begin,
+                                     end - begin));
+      begin = end;
+    }
+    Result result = in_flight.front().get();
+    in_flight.pop_front();
+    write(result);
+  }
+}
+
+}  // namespace tabuli
+
+#endif  // _TABULI_SEGMENT_RENDER_H
@@ -0,0 +1,103 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times the identity rotator bank through a burst of noise followed by a
+// long stretch of digital silence, one second at a time. While the
+// accumulators decay through the subnormal range the cost per sample must
+// stay at the level of the loud part.
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "fourier_bank.h"
+
+ABSL_FLAG(int, channels, 2, "Number of input channels.");
+ABSL_FLAG(int, samplerate, 48000, "Sample rate.");
+ABSL_FLAG(double, loud_seconds, 2, "Length of the noise burst.");
+ABSL_FLAG(double, silent_seconds, 30, "Length of the silence after it.");
+
+namespace tabuli {
+namespace {
+
+void Run() {
+  const size_t num_channels = absl::GetFlag(FLAGS_channels);
+  const size_t samplerate = absl::GetFlag(FLAGS_samplerate);
+  const int64_t loud = absl::GetFlag(FLAGS_loud_seconds) * samplerate;
+  const int64_t total =
+      loud + static_cast<int64_t>(absl::GetFlag(FLAGS_silent_seconds) *
+                                  samplerate);
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  RotatorFilterBank rotbank(kNumRotators, num_channels, samplerate,
+                            /*num_threads=*/1, filter_gains,
+                            /*global_gain=*/1.0);
+  std::vector<float> history(num_channels * (rotbank.history_mask_ + 1));
+  std::vector<float> output(num_channels * kBlockSize);
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0, 0.1);
+
+  double loud_cost = 0;
+  double worst_silent_cost = 0;
+  for (int64_t total_in = 0; total_in < total; total_in += samplerate) {
+    const int64_t len = std::min<int64_t>(samplerate, total - total_in);
+    // The history holds one block beyond the delay of the bank.
+    double ns = 0;
+    for (int64_t block = total_in; block < total_in + len;
+         block += kBlockSize) {
+      const int64_t block_len = std::min(kBlockSize, total_in + len - block);
+      for (int64_t ix = block; ix < block + block_len; ++ix) {
+        for (size_t c = 0; c < num_channels; ++c) {
+          history[num_channels * (ix & rotbank.history_mask_) + c] =
+              ix < loud ? noise(rng) : 0.0f;
+        }
+      }
+      const auto start = std::chrono::steady_clock::now();
+      rotbank.FilterAllSingleThreaded(history.data(), block, block_len,
+                                      IDENTITY, output.data(), output.size());
+      ns += std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+    }
+    const double ns_per_sample = ns / len;
+    const bool silent = total_in >= loud;
+    fprintf(stderr, "%6.1f s  %s  %8.2f ns/sample\n",
+            static_cast<double>(total_in) / samplerate,
+            silent ? "silent" : "loud  ", ns_per_sample);
+    if (silent) {
+      worst_silent_cost = std::max(worst_silent_cost, ns_per_sample);
+    } else {
+      loud_cost = std::max(loud_cost, ns_per_sample);
+    }
+  }
+  QCHECK_GT(loud_cost, 0) << "--loud_seconds must cover at least one block";
+  fprintf(stdout, "loud=%.2f silent_worst=%.2f ratio=%.2f\n", loud_cost,
+          worst_silent_cost, worst_silent_cost / loud_cost);
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  tabuli::Run();
+}
@@ -0,0 +1,246 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sparse_audio.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+
+namespace tabuli {
+
+namespace {
+
+// File layout: the header (kMagic, kVersion, channels, sample rate, block
+// frames), then each block as its frame count, its bitmap of active channels
+// in 64-bit words and their samples, then the first frame and offset of each
+// block, and the footer (index offset, block count, frame count,
+// kIndexMagic).
+constexpr uint32_t kMagic = 0x50534254;       // "TBSP"
+constexpr uint32_t kIndexMagic = 0x58534254;  // "TBSX"
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = 5 * sizeof(uint32_t);
+constexpr size_t kFooterSize = 3 * sizeof(uint64_t) + sizeof(uint32_t);
+constexpr float kScale = 1 << 23;
+
+template <typename T>
+bool ReadValue(FILE *f, T *v) {
+  return fread(v, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+void WriteValue(FILE *f, const T &v) {
+  QCHECK_EQ(fwrite(&v, sizeof(T), 1, f), 1);
+}
+
+// Converts as libsndfile does for PCM24 (f2let_array), so that a decoded
+// file has the samples of the dense render: rounded to nearest at 32 bits
+// with the scale 0x7FFFFFFF, which is 2^31 as a float, and then the top 24
+// bits. Samples outside [-1, 1) are clipped instead of wrapping around.
+int32_t Quantize(float v) {
+  const float scaled = v * static_cast<float>(0x7FFFFFFF);
+  if (scaled >= 2147483648.0f) return (1 << 23) - 1;
+  if (scaled <= -2147483648.0f) return -(1 << 23);
+  return static_cast<int32_t>(std::lrintf(scaled)) >> 8;
+}
+
+size_t BitmapWords(size_t channels) { return (channels + 63) / 64; }
+
+}  // namespace
+
+SparseWriter::SparseWriter(const std::string &path, size_t channels,
+                           size_t samplerate, int64_t block_frames)
+    : path_(path),
+      channels_(channels),
+      block_frames_(block_frames),
+      file_(fopen(path.c_str(), "wb")),
+      offset_(kHeaderSize) {
+  QCHECK(file_) << "Could not write " << path_;
+  WriteValue(file_, kMagic);
+  WriteValue(file_, kVersion);
+  WriteValue<uint32_t>(file_, channels_);
+  WriteValue<uint32_t>(file_, samplerate);
+  WriteValue<uint32_t>(file_, block_frames_);
+  pending_.reserve(channels_ * block_frames_);
+}
+
+SparseWriter::~SparseWriter() { Close(); }
+
+int64_t SparseWriter::writef(const float *data, int64_t nframes) {
+  for (int64_t i = 0; i < nframes;) {
+    const int64_t n = std::min<int64_t>(
+        nframes - i, block_frames_ - pending_.size() / channels_);
+    pending_.insert(pending_.end(), data + i * channels_,
+                    data + (i + n) * channels_);
+    i += n;
+    if (pending_.size() == channels_ * block_frames_) {
+      WriteBlock(pending_.data(), block_frames_);
+      pending_.clear();
+    }
+  }
+  return nframes;
+}
+
+void SparseWriter::WriteBlock(const float *data, int64_t nframes) {
+  std::vector<uint64_t> bitmap(BitmapWords(channels_));
+  encoded_.clear();
+  for (size_t c = 0; c < channels_; ++c) {
+    const size_t begin = encoded_.size();
+    bool active = false;
+    for (int64_t i = 0; i < nframes; ++i) {
+      const int32_t s = Quantize(data[i * channels_ + c]);
+      active |= s != 0;
+      encoded_.push_back(s);
+      encoded_.push_back(s >> 8);
+      encoded_.push_back(s >> 16);
+    }
+    if (active) {
+      bitmap[c / 64] |= uint64_t{1} << (c % 64);
+      ++active_channel_blocks_;
+    } else {
+      encoded_.resize(begin);
+    }
+  }
+  index_.emplace_back(frames_, offset_);
+  WriteValue<uint32_t>(file_, nframes);
+  QCHECK_EQ(fwrite(bitmap.data(), sizeof(uint64_t), bitmap.size(), file_),
+            bitmap.size());
+  QCHECK_EQ(fwrite(encoded_.data(), 1, encoded_.size(), file_),
+            encoded_.size())
+      << "Could not write " << path_;
+  frames_ += nframes;
+  offset_ += sizeof(uint32_t) + bitmap.size() * sizeof(uint64_t) +
+             encoded_.size();
+}
+
+void SparseWriter::Close() {
+  if (!file_) return;
+  if (!pending_.empty()) {
+    WriteBlock(pending_.data(), pending_.size() / channels_);
+    pending_.clear();
+  }
+  for (const auto &[first_frame, offset] : index_) {
+    WriteValue(file_, first_frame);
+    WriteValue(file_, offset);
+  }
+  WriteValue<uint64_t>(file_, offset_);
+  WriteValue<uint64_t>(file_, index_.size());
+  WriteValue(file_, frames_);
+  WriteValue(file_, kIndexMagic);
+  QCHECK_EQ(fclose(file_), 0) << "Could not write " << path_;
+  file_ = nullptr;
+}
+
+double SparseWriter::occupancy() const {
+  return index_.empty() ? 0.0
+                        : static_cast<double>(active_channel_blocks_) /
+                              (index_.size() * channels_);
+}
+
+SparseReader::SparseReader(const std::string &path)
+    : path_(path), file_(fopen(path.c_str(), "rb")) {
+  QCHECK(file_) << "Could not read " << path_;
+  uint32_t magic = 0, version = 0, channels, samplerate, block_frames;
+  QCHECK(ReadValue(file_, &magic) && magic == kMagic &&
+         ReadValue(file_, &version) && version == kVersion &&
+         ReadValue(file_, &channels) && ReadValue(file_, &samplerate) &&
+         ReadValue(file_, &block_frames))
+      << path_ << " is not a sparse audio file";
+  channels_ = channels;
+  samplerate_ = samplerate;
+
+  uint64_t index_offset, num_blocks, frames;
+  QCHECK(fseeko(file_, -static_cast<off_t>(kFooterSize), SEEK_END) == 0 &&
+         ReadValue(file_, &index_offset) && ReadValue(file_, &num_blocks) &&
+         ReadValue(file_, &frames) && ReadValue(file_, &magic) &&
+         magic == kIndexMagic)
+      << path_ << " has no index; it was not closed";
+  frames_ = frames;
+  index_.resize(num_blocks);
+  QCHECK(fseeko(file_, index_offset, SEEK_SET) == 0);
+  for (auto &[first_frame, offset] : index_) {
+    QCHECK(ReadValue(file_, &first_frame) && ReadValue(file_, &offset))
+        << "Truncated index in " << path_;
+  }
+}
+
+SparseReader::~SparseReader() { fclose(file_); }
+
+int64_t SparseReader::seek(int64_t frame) {
+  pos_ = std::clamp<int64_t>(frame, 0, frames_);
+  return pos_;
+}
+
+void SparseReader::Load(int64_t frame) {
+  if (frame >= block_begin_ && frame < block_begin_ + block_frames_) return;
+  const size_t b =
+      std::upper_bound(index_.begin(), index_.end(),
+                       std::make_pair(static_cast<uint64_t>(frame),
+                                      ~uint64_t{0})) -
+      index_.begin() - 1;
+  QCHECK(fseeko(file_, index_[b].second, SEEK_SET) == 0);
+  uint32_t nframes;
+  std::vector<uint64_t> bitmap(BitmapWords(channels_));
+  QCHECK(ReadValue(file_, &nframes) &&
+         fread(bitmap.data(), sizeof(uint64_t), bitmap.size(), file_) ==
+             bitmap.size())
+      << "Truncated block in " << path_;
+  block_begin_ = index_[b].first;
+  block_frames_ = nframes;
+  block_.assign(channels_ * nframes, 0.0f);
+  block_active_ = 0;
+  for (size_t c = 0; c < channels_; ++c) {
+    if (!(bitmap[c / 64] >> (c % 64) & 1)) continue;
+    ++block_active_;
+    encoded_.resize(3 * nframes);
+    QCHECK_EQ(fread(encoded_.data(), 1, encoded_.size(), file_),
+              encoded_.size())
+        << "Truncated block in " << path_;
+    for (uint32_t i = 0; i < nframes; ++i) {
+      const uint8_t *p = &encoded_[3 * i];
+      const uint32_t u = p[0] << 8 | p[1] << 16 | uint32_t{p[2]} << 24;
+      // The shift extends the sign of the 24 bits.
+      block_[i * channels_ + c] = (static_cast<int32_t>(u) >> 8) / kScale;
+    }
+  }
+}
+
+int64_t SparseReader::readf(float *data, int64_t nframes) {
+  int64_t read = 0;
+  while (read < nframes && pos_ < frames_) {
+    Load(pos_);
+    const int64_t n =
+        std::min(nframes - read, block_begin_ + block_frames_ - pos_);
+    const float *from = &block_[(pos_ - block_begin_) * channels_];
+    std::copy(from, from + n * channels_, data + read * channels_);
+    read += n;
+    pos_ += n;
+  }
+  return read;
+}
+
+size_t SparseReader::active_channels(int64_t frame) {
+  QCHECK(frame >= 0 && frame < frames_);
+  Load(frame);
+  return block_active_;
+}
+
+}  // namespace tabuli
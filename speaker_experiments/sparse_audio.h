@@ -0,0 +1,105 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_SPARSE_AUDIO_H
+#define _TABULI_SPARSE_AUDIO_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tabuli {
+
+// Multichannel audio file that stores, for each block of frames, only the
+// channels that are not silent at 24-bit resolution. Each block has a bitmap
+// of its active channels followed by their samples, channel after channel, as
+// 24-bit PCM. An index of the blocks at the end of the file gives random
+// access. Channels that are dropped would be zero in a 24-bit WAV file, so the
+// samples that are read back are the same as from one.
+class SparseWriter {
+ public:
+  SparseWriter(const std::string &path, size_t channels, size_t samplerate,
+               int64_t block_frames = 4096);
+  ~SparseWriter();
+
+  size_t channels() const { return channels_; }
+  size_t frame_size() const { return channels_; }
+
+  int64_t writef(const float *data, int64_t nframes);
+
+  // Writes the last block and the index.
+  void Close();
+
+  // Fraction of the channel blocks that were stored.
+  double occupancy() const;
+
+ private:
+  void WriteBlock(const float *data, int64_t nframes);
+
+  std::string path_;
+  size_t channels_;
+  int64_t block_frames_;
+  FILE *file_;
+  std::vector<float> pending_;
+  // First frame and file offset of each block.
+  std::vector<std::pair<uint64_t, uint64_t>> index_;
+  uint64_t frames_ = 0;
+  uint64_t offset_;
+  uint64_t active_channel_blocks_ = 0;
+  std::vector<uint8_t> encoded_;
+};
+
+// Reads a file of SparseWriter as dense frames, with silent channels filled
+// in, from any position.
+class SparseReader {
+ public:
+  explicit SparseReader(const std::string &path);
+  ~SparseReader();
+
+  size_t channels() const { return channels_; }
+  size_t samplerate() const { return samplerate_; }
+  int64_t frames() const { return frames_; }
+
+  // Moves the read position to 'frame', and returns it.
+  int64_t seek(int64_t frame);
+  int64_t readf(float *data, int64_t nframes);
+
+  // Number of channels that are stored in the block that holds 'frame'.
+  size_t active_channels(int64_t frame);
+
+ private:
+  // Decodes the block that holds 'frame' unless it is the current one.
+  void Load(int64_t frame);
+
+  std::string path_;
+  FILE *file_;
+  size_t channels_;
+  size_t samplerate_;
+  int64_t frames_;
+  std::vector<std::pair<uint64_t, uint64_t>> index_;
+  int64_t pos_ = 0;
+  // The decoded block, its first frame, its length and how many channels it
+  // stores.
+  std::vector<float> block_;
+  int64_t block_begin_ = -1;
+  int64_t block_frames_ = 0;
+  size_t block_active_ = 0;
+  std::vector<uint8_t> encoded_;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_SPARSE_AUDIO_H
@@ -0,0 +1,95 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Expands a sparse file of angular --sparse_output into dense sound files.
+//
+// Usage: sparse_decode <input.tbsp> <output>
+//
+// With --split_output --output_format=raw --sample_format=pcm16 and an
+// output named like "speaker.pcm16", each channel becomes a file
+// "speaker.NNN.pcm16" of the kind that the cclvi muxers load.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "output_file.h"
+#include "pipeline.h"
+#include "sparse_audio.h"
+
+ABSL_FLAG(double, from_seconds, 0, "Start of the range that is expanded.");
+ABSL_FLAG(double, to_seconds, -1,
+          "If non-negative, end of the range that is expanded.");
+ABSL_FLAG(std::string, output_format, "wav",
+          "Container of the output: wav, rf64 or w64 for files over 4 GB, or "
+          "raw.");
+ABSL_FLAG(std::string, sample_format, "pcm24",
+          "Samples of the output: pcm16, pcm24 or float.");
+ABSL_FLAG(bool, split_output, false,
+          "If set, writes one mono file per channel, numbered before the "
+          "extension.");
+
+namespace tabuli {
+namespace {
+
+int Run(int argc, char **argv) {
+  QCHECK_EQ(argc, 3) << "Usage: " << argv[0] << " <input.tbsp> <output>";
+  SparseReader input(argv[1]);
+  const size_t channels = input.channels();
+  const int64_t begin =
+      input.seek(absl::GetFlag(FLAGS_from_seconds) * input.samplerate());
+  const int64_t end =
+      absl::GetFlag(FLAGS_to_seconds) < 0
+          ? input.frames()
+          : std::min<int64_t>(input.frames(), absl::GetFlag(FLAGS_to_seconds) *
+                                                  input.samplerate());
+  OutputFile output_file(argv[2],
+                         OutputFormat(absl::GetFlag(FLAGS_output_format),
+                                      absl::GetFlag(FLAGS_sample_format)),
+                         channels, input.samplerate(),
+                         absl::GetFlag(FLAGS_split_output));
+  AsyncWriter<OutputFile> output(output_file, channels);
+
+  std::vector<float> frames(channels * kFramesPerBlock);
+  int64_t active = 0;
+  int64_t pos = begin;
+  while (pos < end) {
+    active += input.active_channels(pos);
+    const int64_t read = input.readf(
+        frames.data(), std::min<int64_t>(kFramesPerBlock, end - pos));
+    QCHECK_GT(read, 0);
+    output.writef(frames.data(), read);
+    pos += read;
+  }
+  output.Close();
+  fprintf(stderr, "Expanded %.1f s of %zu channels, %.1f active on average\n",
+          static_cast<double>(end - begin) / input.samplerate(), channels,
+          static_cast<double>(active) /
+              std::max<int64_t>(1, (end - begin + kFramesPerBlock - 1) /
+                                       kFramesPerBlock));
+  return 0;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  std::vector<char *> posargs = absl::ParseCommandLine(argc, argv);
+  return tabuli::Run(posargs.size(), posargs.data());
+}
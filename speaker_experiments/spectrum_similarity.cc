@@ -18,19 +18,24 @@
 #include <cstdint>
 #include <cstdio>
 #include <functional>
+#include <string>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/check.h"
+#include "audio_cache.h"
 #include "fftw3.h"
-#include "sndfile.hh"
 
 ABSL_FLAG(bool, autoscale, true,
           "whether to automatically scale the inputs so that the residuals "
           "have equal power");
 ABSL_FLAG(int, overlap, 128, "how much to overlap the FFTs");
 ABSL_FLAG(int, window_size, 4096, "FFT window size");
+ABSL_FLAG(std::string, audio_cache, "",
+          "Directory of decoded inputs that are shared between runs; "
+          "defaults to $TABULI_AUDIO_CACHE. Without one, each input is still "
+          "decoded only once per run.");
 
 namespace {
 
@@ -43,8 +48,9 @@ using FFTWUniquePtr = std::unique_ptr<T, FFTWDeleter>;
 float SquaredNorm(const fftwf_complex c) { return c[0] * c[0] + c[1] * c[1]; }
 
 float Similarity(
-    const int window_size, const int overlap, SndfileHandle& reference_input,
-    SndfileHandle& candidate_input, const float candidate_scaling,
+    const int window_size, const int overlap,
+    tabuli::CachedReader& reference_input,
+    tabuli::CachedReader& candidate_input, const float candidate_scaling,
     float* reference_minus_candidate_residuals = nullptr,
     const std::function<void()>& start_progress = [] {},
     const std::function<void(int64_t)>& set_progress = [](int64_t) {}) {
@@ -166,8 +172,8 @@ float Similarity(
 }
 
 float FindScaling(const int window_size, const int overlap,
-                  SndfileHandle& reference_input,
-                  SndfileHandle& candidate_input) {
+                  tabuli::CachedReader& reference_input,
+                  tabuli::CachedReader& candidate_input) {
   // Scalings are in log2 scale until the very end.
 
   float min = 0.f, max = 0.f;
@@ -219,19 +225,23 @@ float FindScaling(const int window_size, const int overlap,
 }  // namespace
 
 int main(int argc, char** argv) {
-  absl::ParseCommandLine(argc, argv);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
 
   const int window_size = absl::GetFlag(FLAGS_window_size);
   const int overlap = absl::GetFlag(FLAGS_overlap);
 
   QCHECK_EQ(window_size % overlap, 0);
 
-  QCHECK_EQ(argc, 3) << "Usage: " << argv[0] << " <reference> <candidate>";
+  QCHECK_EQ(args.size(), 3)
+      << "Usage: " << argv[0] << " <reference> <candidate>";
 
-  SndfileHandle reference_input_file(argv[1]);
-  QCHECK(reference_input_file) << reference_input_file.strError();
-  SndfileHandle candidate_input_file(argv[2]);
-  QCHECK(candidate_input_file) << candidate_input_file.strError();
+  // FindScaling reads both inputs many times over.
+  const std::string cache_dir =
+      tabuli::AudioCacheDir(absl::GetFlag(FLAGS_audio_cache));
+  tabuli::CachedReader reference_input_file(args[1], /*samplerate=*/0,
+                                            cache_dir);
+  tabuli::CachedReader candidate_input_file(args[2], /*samplerate=*/0,
+                                            cache_dir);
   QCHECK_EQ(reference_input_file.channels(), 1);
   QCHECK_EQ(candidate_input_file.channels(), 1);
   QCHECK_EQ(reference_input_file.samplerate(),
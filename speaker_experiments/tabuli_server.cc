@@ -0,0 +1,578 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Long-running renderer, which keeps the engines of earlier jobs warm for the
+// next ones with the same parameters: the rotator banks of identity renders
+// by sample rate, channel count and gain, those of revolve and emphasizer by
+// sample rate, and the FFTW plans of angular. Up to --max_idle_banks of each
+// kind are kept.
+//
+// Usage: tabuli_server [--socket=<path>]
+//
+// Serves the clients of a Unix domain socket, or a single client on stdin
+// and stdout without --socket. Each client sends one command per line:
+//
+//   render <input.wav> <output.wav> [<gain>]
+//   revolve <input.wav> <multichannel.wav> <binaural.wav>
+//   emphasize <input.wav> <output.wav>
+//   angular <input.wav> <output.wav>
+//   quit
+//
+// where the gain is a positive number, and revolve, emphasize and angular
+// render a stereo input as their tools do with the default flags. It gets
+// back for each job
+//
+//   started
+//   progress <frames>      (after each block)
+//   done <frames> <seconds>
+//
+// or a line "error <message>". Paths must not contain spaces.
+//
+// An output path of "-", at most one per job, sends the frames back over the
+// connection instead of into a file. The job then gets before "started"
+//
+//   stream <channels> <samplerate>
+//
+// and before each progress line
+//
+//   data <frames>
+//
+// followed by that many frames of interleaved little-endian 32-bit floats.
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>  // NOLINT
+#include <cmath>
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/check.h"
+#include "absl/strings/str_split.h"
+#include "angular_engine.h"
+#include "emphasizer_engine.h"
+#include "fourier_bank.h"
+#include "revolve_engine.h"
+#include "sndfile.hh"
+
+ABSL_FLAG(std::string, socket, "",
+          "Path of the Unix domain socket to serve. If empty, serves one "
+          "client on stdin and stdout.");
+ABSL_FLAG(int, workers, 4, "Number of clients that are served at once.");
+ABSL_FLAG(int, num_threads, 1,
+          "Number of threads per job. Identity renders filter groups of the "
+          "channels in parallel, and emphasizer renders groups of the "
+          "rotators.");
+ABSL_FLAG(int, max_idle_banks, 8,
+          "Number of banks of each kind that are kept warm between jobs. The "
+          "least recently used ones are freed first.");
+
+namespace tabuli {
+namespace {
+
+// Highest sample rate at which the rotator delays fit into a block.
+constexpr size_t kMaxSampleRate = 192000;
+
+// Rotator banks that are not in use, by the parameters they were made for.
+// At most max_idle of them are kept, and the least recently released one
+// is freed first.
+template <typename Key, typename Bank>
+class EnginePool {
+ public:
+  using Factory = std::function<std::unique_ptr<Bank>(const Key &)>;
+
+  EnginePool(size_t max_idle, Factory factory)
+      : max_idle_(max_idle), factory_(std::move(factory)) {}
+
+  std::unique_ptr<Bank> Acquire(const Key &key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+        if (it->first == key) {
+          std::unique_ptr<Bank> bank = std::move(it->second);
+          idle_.erase(it);
+          return bank;
+        }
+      }
+    }
+    return factory_(key);
+  }
+
+  void Release(const Key &key, std::unique_ptr<Bank> bank) {
+    bank->Restart();
+    // Freed outside of the lock.
+    std::list<std::pair<Key, std::unique_ptr<Bank>>> evicted;
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.emplace_front(key, std::move(bank));
+    while (idle_.size() > max_idle_) {
+      evicted.splice(evicted.end(), idle_, std::prev(idle_.end()));
+    }
+  }
+
+ private:
+  const size_t max_idle_;
+  const Factory factory_;
+  std::mutex mutex_;
+  // Most recently released first.
+  std::list<std::pair<Key, std::unique_ptr<Bank>>> idle_;
+};
+
+// Identity banks by sample rate, channel count and global gain.
+using IdentityPool =
+    EnginePool<std::tuple<size_t, size_t, float>, RotatorFilterBank>;
+
+// Revolve banks of a stereo input by sample rate.
+using RevolvePool = EnginePool<size_t, revolve::RotatorFilterBank>;
+
+// Emphasizer engines by sample rate.
+using EmphasizerPool = EnginePool<size_t, emphasizer::Engine>;
+
+// Angular engines by speaker count, which do not depend on the sample rate.
+using AngularPool = EnginePool<int, angular::Engine>;
+
+struct Pools {
+  IdentityPool identity;
+  RevolvePool revolve;
+  EmphasizerPool emphasizer;
+  AngularPool angular;
+};
+
+// Output path that sends the frames back to the client.
+constexpr char kStreamPath[] = "-";
+
+// Where a job writes its frames: a WAV file, or the connection of the client.
+class JobOutput {
+ public:
+  // Opens path for frames of the given channels, and returns an empty string
+  // or what went wrong.
+  std::string Open(const std::string &path, FILE *client, int channels,
+                   size_t samplerate) {
+    channels_ = channels;
+    samplerate_ = samplerate;
+    if (path == kStreamPath) {
+      client_ = client;
+      return "";
+    }
+    file_ = SndfileHandle(path, /*mode=*/SFM_WRITE,
+                          /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
+                          channels, samplerate);
+    if (!file_) return path + ": " + file_.strError();
+    return "";
+  }
+
+  // Tells a streaming client the format of the frames, once all the outputs
+  // of the job are open.
+  void Start() {
+    if (client_ == nullptr) return;
+    fprintf(client_, "stream %d %zu\n", channels_, samplerate_);
+    fflush(client_);
+  }
+
+  template <typename T>
+  void writef(const T *data, int64_t frames) {
+    if (client_ == nullptr) {
+      file_.writef(data, frames);
+      return;
+    }
+    if (frames == 0) return;
+    const size_t samples = frames * channels_;
+    bytes_.resize(4 * samples);
+    for (size_t i = 0; i < samples; ++i) {
+      const float sample = data[i];
+      uint32_t bits;
+      memcpy(&bits, &sample, sizeof(bits));
+      for (int b = 0; b < 4; ++b) bytes_[4 * i + b] = bits >> (8 * b);
+    }
+    fprintf(client_, "data %zd\n", frames);
+    fwrite(bytes_.data(), 1, bytes_.size(), client_);
+    fflush(client_);
+  }
+
+ private:
+  int channels_ = 0;
+  size_t samplerate_ = 0;
+  SndfileHandle file_;
+  FILE *client_ = nullptr;
+  std::vector<uint8_t> bytes_;
+};
+
+// Returns an error if more than one of the paths streams to the client.
+std::string CheckStreams(const std::vector<std::string> &paths) {
+  if (std::count(paths.begin(), paths.end(), kStreamPath) > 1) {
+    return std::string("only one output can be ") + kStreamPath;
+  }
+  return "";
+}
+
+// Buffers of a client, kept between its jobs.
+struct Buffers {
+  std::vector<float> history;
+  std::vector<float> input;
+  std::vector<float> output;
+};
+
+// Renders input_path into output_path, and returns an empty string or what
+// went wrong.
+std::string Render(IdentityPool &pool, Buffers &buffers, FILE *client,
+                   const std::string &input_path,
+                   const std::string &output_path, float gain,
+                   const std::function<void()> &start_progress,
+                   const std::function<void(int64_t)> &set_progress) {
+  SndfileHandle input_file(input_path);
+  if (!input_file) return input_path + ": " + input_file.strError();
+  const size_t num_channels = input_file.channels();
+  const size_t samplerate = input_file.samplerate();
+  if (samplerate > kMaxSampleRate) {
+    return "sample rate " + std::to_string(samplerate) + " is too high";
+  }
+  JobOutput output_file;
+  std::string error =
+      output_file.Open(output_path, client, num_channels, samplerate);
+  if (!error.empty()) return error;
+  output_file.Start();
+
+  const std::tuple<size_t, size_t, float> key(samplerate, num_channels, gain);
+  std::unique_ptr<RotatorFilterBank> bank = pool.Acquire(key);
+  const int64_t history_mask = bank->history_mask_;
+  buffers.history.assign(num_channels * (history_mask + 1), 0.0f);
+  buffers.input.resize(num_channels * kBlockSize);
+  buffers.output.resize(num_channels * kBlockSize);
+
+  start_progress();
+  int64_t total_in = 0;
+  int64_t total_out = 0;
+  bool done = false;
+  while (!done) {
+    int64_t read = input_file.readf(buffers.input.data(), kBlockSize);
+    if (read == 0) {
+      done = true;
+      read = total_in - total_out;
+      std::fill(buffers.input.begin(),
+                buffers.input.begin() + read * num_channels, 0);
+    }
+    for (int64_t i = 0; i < read; ++i) {
+      std::copy(&buffers.input[i * num_channels],
+                &buffers.input[(i + 1) * num_channels],
+                &buffers.history[num_channels *
+                                 ((total_in + i) & history_mask)]);
+    }
+    const int64_t output_len =
+        bank->num_threads_ > 1
+            ? bank->FilterAllChannelParallel(buffers.history.data(), total_in,
+                                             read, buffers.output.data(),
+                                             buffers.output.size())
+            : bank->FilterAllSingleThreaded(
+                  buffers.history.data(), total_in, read, IDENTITY,
+                  buffers.output.data(), buffers.output.size());
+    output_file.writef(buffers.output.data(), output_len);
+    total_in += read;
+    total_out += output_len;
+    set_progress(total_out);
+  }
+  pool.Release(key, std::move(bank));
+  return "";
+}
+
+// Speaker feeds and distance ratio of revolve with its default flags.
+constexpr int kRevolveChannels = 16;
+constexpr double kRevolveDistanceRatio = 8;
+
+// Upmixes the stereo input_path into multichannel_path and binaural_path,
+// and returns an empty string or what went wrong.
+std::string Revolve(RevolvePool &pool, FILE *client,
+                    const std::string &input_path,
+                    const std::string &multichannel_path,
+                    const std::string &binaural_path,
+                    const std::function<void()> &start_progress,
+                    const std::function<void(int64_t)> &set_progress) {
+  SndfileHandle input_file(input_path);
+  if (!input_file) return input_path + ": " + input_file.strError();
+  if (input_file.channels() != 2) return input_path + " is not stereo";
+  const size_t samplerate = input_file.samplerate();
+  std::string error = CheckStreams({multichannel_path, binaural_path});
+  if (!error.empty()) return error;
+  JobOutput multichannel_file;
+  error = multichannel_file.Open(multichannel_path, client, kRevolveChannels,
+                                 samplerate);
+  if (!error.empty()) return error;
+  JobOutput binaural_file;
+  error = binaural_file.Open(binaural_path, client, /*channels=*/2, samplerate);
+  if (!error.empty()) return error;
+  multichannel_file.Start();
+  binaural_file.Start();
+
+  std::unique_ptr<revolve::RotatorFilterBank> bank = pool.Acquire(samplerate);
+  start_progress();
+  revolve::Process(kRevolveChannels, kRevolveDistanceRatio, *bank, input_file,
+                   multichannel_file, binaural_file, set_progress);
+  pool.Release(samplerate, std::move(bank));
+  return "";
+}
+
+// Output channels of emphasizer, and the FFT and the speakers of angular,
+// with the default flags of their tools.
+constexpr int kEmphasizerChannels = 6;
+constexpr int kAngularWindowSize = 4096;
+constexpr int kAngularOverlap = 64;
+constexpr int kAngularChannels = 120;
+constexpr float kAngularDistanceRatio = 4;
+
+// Renders the stereo input_path into output_path with an engine of the pool,
+// by the key that key_for_rate gives for the sample rate of the input, and
+// returns an empty string or what went wrong.
+template <typename Key, typename Engine>
+std::string RenderStereo(EnginePool<Key, Engine> &pool, FILE *client,
+                         const std::function<Key(size_t)> &key_for_rate,
+                         int output_channels, const std::string &input_path,
+                         const std::string &output_path,
+                         const std::function<void()> &start_progress,
+                         const std::function<void(int64_t)> &set_progress) {
+  SndfileHandle input_file(input_path);
+  if (!input_file) return input_path + ": " + input_file.strError();
+  if (input_file.channels() != 2) return input_path + " is not stereo";
+  const size_t samplerate = input_file.samplerate();
+  JobOutput output_file;
+  const std::string error =
+      output_file.Open(output_path, client, output_channels, samplerate);
+  if (!error.empty()) return error;
+  output_file.Start();
+
+  const Key key = key_for_rate(samplerate);
+  std::unique_ptr<Engine> engine = pool.Acquire(key);
+  engine->Process(input_file, output_file, start_progress, set_progress);
+  pool.Release(key, std::move(engine));
+  return "";
+}
+
+// Parses the gain of a render, which has to be a finite positive number.
+bool ParseGain(const std::string &text, float *gain) {
+  char *end;
+  *gain = std::strtof(text.c_str(), &end);
+  return end != text.c_str() && *end == '\0' && std::isfinite(*gain) &&
+         *gain > 0;
+}
+
+// Runs the commands of a client until it quits or disconnects.
+void Serve(Pools &pools, FILE *in, FILE *out) {
+  Buffers buffers;
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, in)) > 0) {
+    std::vector<std::string> args =
+        absl::StrSplit(std::string(line, length), absl::ByAnyChar(" \t\r\n"),
+                       absl::SkipEmpty());
+    if (args.empty()) continue;
+    if (args[0] == "quit") break;
+    const bool render =
+        args[0] == "render" && args.size() >= 3 && args.size() <= 4;
+    const bool upmix = args[0] == "revolve" && args.size() == 4;
+    const bool emphasize = args[0] == "emphasize" && args.size() == 3;
+    const bool angular = args[0] == "angular" && args.size() == 3;
+    if (!render && !upmix && !emphasize && !angular) {
+      fprintf(out,
+              "error usage: render <input> <output> [<gain>] | "
+              "revolve <input> <multichannel> <binaural> | "
+              "emphasize <input> <output> | angular <input> <output>\n");
+      fflush(out);
+      continue;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    int64_t frames = 0;
+    const auto start_progress = [&] {
+      fprintf(out, "started\n");
+      fflush(out);
+    };
+    const auto set_progress = [&](int64_t written) {
+      frames = written;
+      fprintf(out, "progress %zd\n", written);
+      fflush(out);
+    };
+    std::string error;
+    float gain = 1.0f;
+    if (render && args.size() > 3 && !ParseGain(args[3], &gain)) {
+      error = "gain " + args[3] + " is not a positive number";
+    } else if (render) {
+      error = Render(pools.identity, buffers, out, args[1], args[2], gain,
+                     start_progress, set_progress);
+    } else if (upmix) {
+      error = Revolve(pools.revolve, out, args[1], args[2], args[3],
+                      start_progress, set_progress);
+    } else if (emphasize) {
+      error = RenderStereo<size_t>(
+          pools.emphasizer, out, [](size_t samplerate) { return samplerate; },
+          kEmphasizerChannels, args[1], args[2], start_progress,
+          set_progress);
+    } else {
+      error = RenderStereo<int>(
+          pools.angular, out, [](size_t) { return kAngularChannels; },
+          kAngularChannels, args[1], args[2], start_progress, set_progress);
+    }
+    if (error.empty()) {
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      fprintf(out, "done %zd %.3f\n", frames, seconds);
+    } else {
+      fprintf(out, "error %s\n", error.c_str());
+    }
+    fflush(out);
+  }
+  free(line);
+}
+
+// Connections that wait for a worker.
+class ConnectionQueue {
+ public:
+  void Push(int fd) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      fds_.push_back(fd);
+    }
+    ready_.notify_one();
+  }
+
+  int Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_.wait(lock, [&] { return !fds_.empty(); });
+    const int fd = fds_.front();
+    fds_.pop_front();
+    return fd;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<int> fds_;
+};
+
+void ServeSocket(Pools &pools, const std::string &path) {
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  QCHECK_GE(listen_fd, 0) << strerror(errno);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  QCHECK_LT(path.size(), sizeof(addr.sun_path)) << "Socket path too long";
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  QCHECK_EQ(bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+            0)
+      << path << ": " << strerror(errno);
+  QCHECK_EQ(listen(listen_fd, SOMAXCONN), 0) << strerror(errno);
+  fprintf(stderr, "Serving on %s\n", path.c_str());
+
+  ConnectionQueue queue;
+  std::vector<std::thread> workers;
+  for (int i = 0; i < absl::GetFlag(FLAGS_workers); ++i) {
+    workers.emplace_back([&] {
+      while (true) {
+        const int fd = queue.Pop();
+        FILE *in = fdopen(fd, "r");
+        FILE *out = fdopen(dup(fd), "w");
+        Serve(pools, in, out);
+        fclose(out);
+        fclose(in);
+      }
+    });
+  }
+  while (true) {
+    const int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      QCHECK(false) << strerror(errno);
+    }
+    queue.Push(fd);
+  }
+}
+
+int Run() {
+  // A client that disconnects in the middle of a job must not take the
+  // server down with it.
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<float> filter_gains;
+  for (int i = 0; i < kNumRotators; ++i) {
+    filter_gains.push_back(GetRotatorGains(i));
+  }
+  std::vector<float> revolve_gains;
+  for (int i = 0; i < revolve::kNumRotators; ++i) {
+    revolve_gains.push_back(revolve::GetFilterGains(i));
+  }
+  const size_t max_idle = absl::GetFlag(FLAGS_max_idle_banks);
+  Pools pools{
+      IdentityPool(
+          max_idle,
+          [filter_gains = std::move(filter_gains)](
+              const std::tuple<size_t, size_t, float> &key) {
+            const auto [samplerate, num_channels, gain] = key;
+            return std::make_unique<RotatorFilterBank>(
+                kNumRotators, num_channels, samplerate,
+                absl::GetFlag(FLAGS_num_threads), filter_gains, gain);
+          }),
+      RevolvePool(
+          max_idle,
+          [revolve_gains = std::move(revolve_gains)](size_t samplerate) {
+            return std::make_unique<revolve::RotatorFilterBank>(
+                revolve::kNumRotators, /*num_channels=*/2, samplerate,
+                revolve_gains);
+          }),
+      EmphasizerPool(max_idle,
+                     [](size_t samplerate) {
+                       return std::make_unique<emphasizer::Engine>(
+                           samplerate, kEmphasizerChannels,
+                           absl::GetFlag(FLAGS_num_threads));
+                     }),
+      AngularPool(max_idle,
+                  [](int output_channels) {
+                    return std::make_unique<angular::Engine>(
+                        kAngularWindowSize, kAngularOverlap, output_channels,
+                        kAngularDistanceRatio);
+                  }),
+  };
+  const std::string socket_path = absl::GetFlag(FLAGS_socket);
+  if (socket_path.empty()) {
+    Serve(pools, stdin, stdout);
+  } else {
+    ServeSocket(pools, socket_path);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace tabuli
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  QCHECK_GE(absl::GetFlag(FLAGS_workers), 1);
+  QCHECK_GE(absl::GetFlag(FLAGS_num_threads), 1);
+  QCHECK_GE(absl::GetFlag(FLAGS_max_idle_banks), 0);
+  return tabuli::Run();
+}
@@ -0,0 +1,172 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+
+namespace tabuli {
+
+std::atomic<bool> tracing_enabled{false};
+
+namespace {
+
+constexpr const char *kStageNames[kNumStages] = {
+    "read", "history", "filter", "mix", "driver", "write", "decode", "encode",
+};
+
+// Spans shorter than this are counted but not kept as trace events, so that
+// per-sample stages do not flood the trace.
+constexpr int64_t kMinEventNanos = 10000;
+// Events that are kept of each thread, which bounds the memory and the size
+// of the trace of long renders. The rest is only counted.
+constexpr size_t kMaxEventsPerThread = 1 << 20;
+
+struct Event {
+  Stage stage;
+  int64_t begin;
+  int64_t end;
+};
+
+// Events of one thread. Owned by the registry, so that they outlive the
+// thread.
+struct ThreadEvents {
+  size_t tid;
+  std::vector<Event> events;
+};
+
+struct Tracer {
+  std::string trace_path;
+  int64_t start = 0;
+  std::atomic<int64_t> nanos[kNumStages] = {};
+  std::atomic<int64_t> spans[kNumStages] = {};
+  std::atomic<int64_t> frames{0};
+  std::atomic<int64_t> dropped_events{0};
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadEvents>> threads;
+};
+
+Tracer &GetTracer() {
+  static Tracer *tracer = new Tracer;
+  return *tracer;
+}
+
+ThreadEvents &GetThreadEvents() {
+  thread_local ThreadEvents *events = nullptr;
+  if (!events) {
+    Tracer &tracer = GetTracer();
+    std::lock_guard<std::mutex> lock(tracer.mutex);
+    tracer.threads.push_back(std::make_unique<ThreadEvents>());
+    events = tracer.threads.back().get();
+    events->tid = tracer.threads.size();
+  }
+  return *events;
+}
+
+}  // namespace
+
+int64_t TraceNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void EnableTracing(const std::string &trace_path) {
+  Tracer &tracer = GetTracer();
+  tracer.trace_path = trace_path;
+  tracer.start = TraceNanos();
+  tracing_enabled.store(true, std::memory_order_relaxed);
+}
+
+void RecordStage(Stage stage, int64_t begin, int64_t end) {
+  Tracer &tracer = GetTracer();
+  tracer.nanos[stage].fetch_add(end - begin, std::memory_order_relaxed);
+  tracer.spans[stage].fetch_add(1, std::memory_order_relaxed);
+  if (tracer.trace_path.empty() || end - begin < kMinEventNanos) return;
+  std::vector<Event> &events = GetThreadEvents().events;
+  if (events.size() < kMaxEventsPerThread) {
+    events.push_back({stage, begin, end});
+  } else {
+    tracer.dropped_events.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void TraceProgress(int64_t frames) {
+  if (!TracingEnabled()) return;
+  std::atomic<int64_t> &total = GetTracer().frames;
+  int64_t seen = total.load(std::memory_order_relaxed);
+  while (seen < frames &&
+         !total.compare_exchange_weak(seen, frames,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+void ReportTracing(size_t samplerate) {
+  if (!TracingEnabled()) return;
+  tracing_enabled.store(false, std::memory_order_relaxed);
+  Tracer &tracer = GetTracer();
+  const double wall = (TraceNanos() - tracer.start) * 1e-9;
+  fprintf(stderr, "%-8s %10s %7s %10s\n", "stage", "seconds", "wall%",
+          "spans");
+  for (int s = 0; s < kNumStages; ++s) {
+    const int64_t spans = tracer.spans[s].load();
+    if (spans == 0) continue;
+    const double seconds = tracer.nanos[s].load() * 1e-9;
+    fprintf(stderr, "%-8s %10.3f %6.1f%% %10lld\n", kStageNames[s], seconds,
+            100 * seconds / wall, static_cast<long long>(spans));
+  }
+  const double audio = static_cast<double>(tracer.frames.load()) / samplerate;
+  fprintf(stderr,
+          "%.2f s of audio in %.2f s: real-time factor %.3f, %.1fx real "
+          "time\n",
+          audio, wall, audio > 0 ? wall / audio : 0.0,
+          wall > 0 ? audio / wall : 0.0);
+
+  if (tracer.trace_path.empty()) return;
+  FILE *f = fopen(tracer.trace_path.c_str(), "w");
+  QCHECK(f) << "Could not write " << tracer.trace_path;
+  fprintf(f, "{\"traceEvents\":[");
+  bool first = true;
+  std::lock_guard<std::mutex> lock(tracer.mutex);
+  for (const std::unique_ptr<ThreadEvents> &thread : tracer.threads) {
+    for (const Event &event : thread->events) {
+      fprintf(f,
+              "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              first ? "" : ",", kStageNames[event.stage], thread->tid,
+              (event.begin - tracer.start) * 1e-3,
+              (event.end - event.begin) * 1e-3);
+      first = false;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  QCHECK_EQ(fclose(f), 0) << "Could not write " << tracer.trace_path;
+  fprintf(stderr, "Wrote the trace to %s\n", tracer.trace_path.c_str());
+  if (tracer.dropped_events.load() > 0) {
+    fprintf(stderr, "Left out %lld later events\n",
+            static_cast<long long>(tracer.dropped_events.load()));
+  }
+}
+
+}  // namespace tabuli
@@ -0,0 +1,82 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TABULI_TRACE_H
+#define _TABULI_TRACE_H
+
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <string>
+
+namespace tabuli {
+
+// Stages of the renderers that are timed. Decode and encode are the reads
+// and writes of the asynchronous streams on their own threads; read and
+// write are what the renderer waits for.
+enum Stage {
+  kStageRead,
+  kStageHistory,
+  kStageFilter,
+  kStageMix,
+  kStageDriver,
+  kStageWrite,
+  kStageDecode,
+  kStageEncode,
+  kNumStages,
+};
+
+// Starts timing the stages, and also recording each span as an event of a
+// Chrome trace (chrome://tracing, Perfetto) unless trace_path is empty.
+void EnableTracing(const std::string &trace_path);
+
+extern std::atomic<bool> tracing_enabled;
+inline bool TracingEnabled() {
+  return tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Number of frames rendered so far, for the real-time factor. Fits the
+// set_progress callbacks of the Process functions.
+void TraceProgress(int64_t frames);
+
+// Prints the time of each stage and the real-time factor at the given sample
+// rate to stderr, and writes the trace. Does nothing unless enabled. Stages
+// that run on several threads at once can take more than 100% of the wall
+// time.
+void ReportTracing(size_t samplerate);
+
+int64_t TraceNanos();
+void RecordStage(Stage stage, int64_t begin, int64_t end);
+
+// Times its scope as a span of the stage. Without tracing, this costs one
+// relaxed load.
+class ScopedStage {
+ public:
+  explicit ScopedStage(Stage stage)
+      : stage_(stage), begin_(TracingEnabled() ? TraceNanos() : -1) {}
+  ~ScopedStage() {
+    if (begin_ >= 0) RecordStage(stage_, begin_, TraceNanos());
+  }
+
+  ScopedStage(const ScopedStage &) = delete;
+  ScopedStage &operator=(const ScopedStage &) = delete;
+
+ private:
+  Stage stage_;
+  int64_t begin_;
+};
+
+}  // namespace tabuli
+
+#endif  // _TABULI_TRACE_H
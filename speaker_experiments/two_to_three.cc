@@ -15,16 +15,25 @@
 #include <algorithm>
 #include <complex>
 #include <functional>
+#include <string>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/check.h"
 #include "fftw3.h"
+#include "pipeline.h"
 #include "sndfile.hh"
+#include "trace.h"
 
 ABSL_FLAG(int, overlap, 128, "how much to overlap the FFTs");
 ABSL_FLAG(int, window_size, 4096, "FFT window size");
+ABSL_FLAG(bool, trace, false,
+          "If set, prints the time spent in each stage and the real-time "
+          "factor.");
+ABSL_FLAG(std::string, trace_json, "",
+          "If set, also writes the spans of the stages to this file as a "
+          "Chrome trace.");
 
 namespace {
 
@@ -64,30 +73,45 @@ void Process(const int window_size, const int overlap, In& input_stream,
   start_progress();
   int64_t read = 0, written = 0, index = 0;
   for (;;) {
-    read += input_stream.readf(input.get() + 2 * (window_size - skip_size),
-                               skip_size);
-    for (int i = 0; i < skip_size; ++i) {
-      output[3 * (window_size - skip_size + i)] =
-          input[2 * (window_size - skip_size + i)];
-      output[3 * (window_size - skip_size + i) + 1] =
-          input[2 * (window_size - skip_size + i) + 1];
-      output[3 * (window_size - skip_size + i) + 2] = 0;
+    {
+      tabuli::ScopedStage stage(tabuli::kStageRead);
+      read += input_stream.readf(input.get() + 2 * (window_size - skip_size),
+                                 skip_size);
+    }
+    {
+      tabuli::ScopedStage stage(tabuli::kStageHistory);
+      for (int i = 0; i < skip_size; ++i) {
+        output[3 * (window_size - skip_size + i)] =
+            input[2 * (window_size - skip_size + i)];
+        output[3 * (window_size - skip_size + i) + 1] =
+            input[2 * (window_size - skip_size + i) + 1];
+        output[3 * (window_size - skip_size + i) + 2] = 0;
+      }
     }
 
-    fftwf_execute(left_right_fft);
+    {
+      tabuli::ScopedStage stage(tabuli::kStageFilter);
+      fftwf_execute(left_right_fft);
+    }
 
-    for (int i = 0; i < window_size / 2 + 1; ++i) {
-      if (SquaredNorm(input_fft[i * 2]) < SquaredNorm(input_fft[i * 2 + 1])) {
-        std::copy_n(input_fft[i * 2], 2, center_fft[i]);
-      } else {
-        std::copy_n(input_fft[i * 2 + 1], 2, center_fft[i]);
+    {
+      tabuli::ScopedStage stage(tabuli::kStageMix);
+      for (int i = 0; i < window_size / 2 + 1; ++i) {
+        if (SquaredNorm(input_fft[i * 2]) < SquaredNorm(input_fft[i * 2 + 1])) {
+          std::copy_n(input_fft[i * 2], 2, center_fft[i]);
+        } else {
+          std::copy_n(input_fft[i * 2 + 1], 2, center_fft[i]);
+        }
       }
     }
 
-    fftwf_execute(center_ifft);
+    {
+      tabuli::ScopedStage stage(tabuli::kStageFilter);
+      fftwf_execute(center_ifft);
 
-    for (int i = 0; i < window_size; ++i) {
-      output[3 * i + 2] += center[i];
+      for (int i = 0; i < window_size; ++i) {
+        output[3 * i + 2] += center[i];
+      }
     }
 
     if (index >= window_size - skip_size) {
@@ -97,7 +121,10 @@ void Process(const int window_size, const int overlap, In& input_stream,
         output[3 * i + 1] -= output[3 * i + 2];
       }
       const int64_t to_write = std::min<int64_t>(skip_size, read - written);
-      output_stream.writef(output.data(), to_write);
+      {
+        tabuli::ScopedStage stage(tabuli::kStageWrite);
+        output_stream.writef(output.data(), to_write);
+      }
       written += to_write;
       set_progress(written);
       if (written == read) break;
@@ -120,25 +147,32 @@ void Process(const int window_size, const int overlap, In& input_stream,
 }  // namespace
 
 int main(int argc, char** argv) {
-  absl::ParseCommandLine(argc, argv);
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  if (absl::GetFlag(FLAGS_trace) || !absl::GetFlag(FLAGS_trace_json).empty()) {
+    tabuli::EnableTracing(absl::GetFlag(FLAGS_trace_json));
+  }
 
   const int window_size = absl::GetFlag(FLAGS_window_size);
   const int overlap = absl::GetFlag(FLAGS_overlap);
 
   QCHECK_EQ(window_size % overlap, 0);
 
-  QCHECK_EQ(argc, 3) << "Usage: " << argv[0] << " <input> <output>";
+  QCHECK_EQ(args.size(), 3)
+      << "Usage: " << argv[0] << " <input> <output>";
 
-  SndfileHandle input_file(argv[1]);
+  SndfileHandle input_file(args[1]);
   QCHECK(input_file) << input_file.strError();
 
   QCHECK_EQ(input_file.channels(), 2);
 
-  SndfileHandle output_file(
-      argv[2], /*mode=*/SFM_WRITE, /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
-      /*channels=*/3, /*samplerate=*/input_file.samplerate());
+  SndfileHandle output_file(args[2], /*mode=*/SFM_WRITE,
+                            /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
+                            /*channels=*/3,
+                            /*samplerate=*/input_file.samplerate());
 
-  Process(
-      window_size, overlap, input_file, output_file, [] {},
-      [](const int64_t written) {});
+  tabuli::AsyncReader<SndfileHandle> input(input_file);
+  tabuli::AsyncWriter<SndfileHandle> output(output_file, /*channels=*/3);
+  Process(window_size, overlap, input, output, [] {}, tabuli::TraceProgress);
+  output.Close();
+  tabuli::ReportTracing(input_file.samplerate());
 }
@@ -28,6 +28,7 @@
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
+#include "output_file.h"
 #include "sndfile.hh"
 
 ABSL_FLAG(std::string, input_file, "",
@@ -43,6 +44,14 @@ ABSL_FLAG(float, speaker_separation, 0.1,
 ABSL_FLAG(int, num_speakers, 12, "Number of physical speakers in the array");
 ABSL_FLAG(float, speed_of_sound, 343.f,
           "Speed of sound in distance units per second");
+ABSL_FLAG(std::string, output_format, "wav",
+          "Container of the output: wav, rf64 or w64 for files over 4 GB, or "
+          "raw.");
+ABSL_FLAG(std::string, sample_format, "pcm24",
+          "Samples of the output: pcm16, pcm24 or float.");
+ABSL_FLAG(bool, split_output, false,
+          "If set, writes one mono file per output channel, numbered before "
+          "the extension.");
 
 namespace {
 
@@ -128,11 +137,12 @@ int main(int argc, char** argv) {
 
   const int64_t num_output_frames = sound_file.frames() + delays.maxCoeff();
 
-  SndfileHandle output_sound_file(output_file, /*mode=*/SFM_WRITE,
-                                  /*format=*/SF_FORMAT_WAV | SF_FORMAT_PCM_24,
-                                  /*channels=*/num_speakers,
-                                  /*samplerate=*/sound_file.samplerate());
-  QCHECK(output_sound_file) << output_sound_file.strError();
+  tabuli::OutputFile output_sound_file(
+      output_file,
+      tabuli::OutputFormat(absl::GetFlag(FLAGS_output_format),
+                           absl::GetFlag(FLAGS_sample_format)),
+      /*channels=*/num_speakers, /*samplerate=*/sound_file.samplerate(),
+      absl::GetFlag(FLAGS_split_output));
   std::vector<float> output_buffer(kBufferSize * output_sound_file.channels());
   for (int64_t i = 0; i < num_output_frames; i += kBufferSize) {
     absl::c_fill(output_buffer, 0.f);